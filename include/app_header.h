@@ -0,0 +1,23 @@
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * Header the application carries at a fixed offset from its base, right
+ * after the vector table. The CRC (crc.h) covers the first length bytes of
+ * the image, header included, except for the crc field itself.
+ * tools/apphdr.py fills it in; the application only has to reserve the
+ * space (APP_HEADER_OFFSET, sizeof(app_header_t) bytes).
+ */
+
+#define APP_BASE_ADDR      0x08100000u
+#define APP_MAX_SIZE       (1024u * 1024u) // bank 2
+#define APP_HEADER_OFFSET  0x400u          // vector table is 0x298 bytes
+#define APP_HEADER_MAGIC   0x48505041u     // "APPH"
+
+typedef struct {
+    uint32_t magic;
+    uint32_t length;   // bytes from the image base
+    uint32_t crc;
+    uint32_t version;  // for the application to fill in, not checked
+} app_header_t;
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "stm32h7xx.h"
+
+/*
+ * RTC backup registers: survive resets (and power-off with VBAT), read as 0
+ * after a backup domain reset.
+ */
+
+typedef enum {
+    BACKUP_BOOTFLAG = 0,     // BOOT_MAGIC_GO_APP: start the application
+    BACKUP_BOOT_CYCLES,      // Reset_Handler to application entry, last start
+    BACKUP_BOOT_CYCLES_PREV, // of a pass that reset to get there
+    BACKUP_APP_CRC,          // image found valid: its header CRC,
+    BACKUP_APP_LENGTH,       // length,
+    BACKUP_APP_CHECK,        // and both xor its base xor BACKUP_APP_VALID
+} backup_reg_t;
+
+#define BACKUP_APP_VALID 0x56414C44u // "VALD"
+
+// Enable RTC register access and lift the backup domain write protection
+void backup_init(void);
+
+// Undo backup_init(), back to reset state
+void backup_deinit(void);
+
+// backup_init() must have been called
+static inline uint32_t backup_read(backup_reg_t reg) {
+    return (&RTC->BKP0R)[reg];
+}
+
+static inline void backup_write(backup_reg_t reg, uint32_t value) {
+    (&RTC->BKP0R)[reg] = value;
+}
@@ -1,3 +1,18 @@
 #pragma once
 
-void jump_to_application(void);
+#include <stdbool.h>
+#include <stdint.h>
+
+// Base address of the application to start: the newest activated slot
+// (slots.h) with a valid image, or else a single image at APP_BASE_ADDR.
+// 0 if there is none. An image with a header (app_header.h) needs a
+// matching CRC, which is only computed again when the image differs from
+// the one that last passed; one without has to have sane first two vectors.
+// Needs the backup domain unlocked.
+uint32_t app_find(void);
+
+// The same checks for the image at base, at most max_size bytes long, but
+// always computing the CRC. The CRC unit has to be running.
+bool app_check(uint32_t base, uint32_t max_size);
+
+void jump_to_application(uint32_t base);
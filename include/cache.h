@@ -0,0 +1,48 @@
+#pragma once
+
+/*
+ * Cortex-M7 L1 caches and the MPU map they run under (src/cache.c).
+ *
+ *   bank 1    0x08000000  1 MB    normal, write-through, read-only
+ *   bank 2    0x08100000  1 MB    normal, write-through, no execute
+ *   AXI SRAM  0x24000000  512 KB  normal, write-back, no execute
+ *   periph.   0x40000000  512 MB  device, no execute
+ *
+ * Everything else keeps the default map, the TCMs are never cached. The
+ * USB buffers are plain AXI SRAM: the OTG_FS core runs without DMA, its
+ * FIFOs are loaded and emptied by the CPU.
+ *
+ * Write-through means nothing is ever dirty in flash lines, but an erase
+ * or a program the controller finishes on its own changes flash under the
+ * D-cache. The flash engine drops those lines (cache_invalidate()) as each
+ * operation completes, so all other readers of bank 2 see current data.
+ */
+
+#include <stdint.h>
+
+#include "stm32h7xx.h"
+
+#define CACHE_LINE_SIZE   32u
+#define DCACHE_SIZE       (16u * 1024u)
+
+// Set up the MPU and enable both caches; first thing after SystemInit()
+void cache_init(void);
+
+// Back to the reset state for the application: D-cache cleaned, caches and
+// MPU off, all regions cleared
+void cache_deinit(void);
+
+// Make the CPU read addr..addr+length from flash again. Lines are rounded
+// outwards; past the size of the D-cache it cleans and drops all of it,
+// which is cheaper than walking the range.
+static inline void cache_invalidate(uint32_t addr, uint32_t length) {
+    if (length > DCACHE_SIZE) {
+        SCB_CleanInvalidateDCache();
+        return;
+    }
+
+    uint32_t start = addr & ~(CACHE_LINE_SIZE - 1u);
+    uint32_t end   = (addr + length + CACHE_LINE_SIZE - 1u) & ~(CACHE_LINE_SIZE - 1u);
+
+    SCB_InvalidateDCache_by_Addr((void *)start, (int32_t)(end - start));
+}
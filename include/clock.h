@@ -1,4 +1,10 @@
 #pragma once
 
+// Core clock once start_pll() has run: HSE 25 MHz / M 5 * N 160 / P 2
+#define CPU_CLOCK_HZ 400000000u
+
+// Timers on APB1 (TIM2-7, 12-14): twice the 100 MHz APB1 clock
+#define APB1_TIMER_CLOCK_HZ 200000000u
+
 /// @brief Initialize clock tree for H743
 void start_pll();
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * CRC-32 as used by zlib, Ethernet and `crc32` on the host (reflected,
+ * polynomial 0x04C11DB7, init and final xor 0xFFFFFFFF), computed by the
+ * CRC peripheral. Not reentrant: only call it from thread context.
+ */
+
+void crc_init(void);
+
+// Put the CRC unit back into reset state and stop its clock
+void crc_deinit(void);
+
+/// @brief Continue a CRC over more data
+/// @param crc result of a previous call, 0 to start a new CRC
+/// @return CRC of everything so far
+uint32_t crc32_update(uint32_t crc, const void *data, uint32_t length);
@@ -3,7 +3,33 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+#include "stm32h7xx.h"
+
 #define FLASH_WRITE_SIZE 32 // STM32H7 flash parallelism requirement
+#define FLASH_SECTOR_SIZE (128u * 1024u)
+#define FLASH_SECTOR_COUNT 8
+#ifndef FLASH_BANK2_BASE // the device header has it too
+#define FLASH_BANK2_BASE  0x08100000u
+#endif
+#define FLASH_ALL_SECTORS ((uint8_t)((1u << FLASH_SECTOR_COUNT) - 1u))
+
+// Engine options (flash_set_options)
+#define FLASH_OPT_DIFF    (1u << 0) // Defer erases, only program rows that differ from flash
+#define FLASH_OPT_AUTO_ERASE (1u << 1) // Erase each sector on its first write of a download
+
+// Diff mode needs a sector-sized copy in RAM, builds without DFU_DIFF leave
+// it out and ignore FLASH_OPT_DIFF
+#ifdef DFU_DIFF
+#define FLASH_OPTS_SUPPORTED (FLASH_OPT_DIFF | FLASH_OPT_AUTO_ERASE)
+#else
+#define FLASH_OPTS_SUPPORTED FLASH_OPT_AUTO_ERASE
+#endif
+
+// Number of blocks the DfuSe layer can hand off before it has to wait for
+// the flash to catch up (write-behind depth)
+#ifndef FLASH_QUEUE_DEPTH
+#define FLASH_QUEUE_DEPTH 4
+#endif
 
 typedef enum {
     FLASH_OP_IDLE = 0,
@@ -11,19 +37,95 @@ typedef enum {
     FLASH_OP_ERASE_BUSY,
     FLASH_OP_WRITE_PENDING,
     FLASH_OP_WRITE_BUSY,
+    FLASH_OP_DIFF_ERASE_BUSY,
+    FLASH_OP_DIFF_RESTORE_BUSY,
+    FLASH_OP_DIFF_FINISH,
 } flash_op_state_t;
 
+typedef enum {
+    FLASH_ERR_NONE = 0,
+    FLASH_ERR_WRITE_PROTECT, // WRPERR
+    FLASH_ERR_PROGRAM,       // PGSERR, STRBERR, INCERR
+    FLASH_ERR_OPERATION,     // OPERR
+} flash_error_t;
+
+// The session the engine's completions go to (flash_job_done_cb())
+typedef enum {
+    FLASH_OWNER_DFU = 0,
+    FLASH_OWNER_VENDOR,
+    FLASH_OWNER_MSC,
+} flash_owner_t;
+
+typedef enum {
+    FLASH_JOB_ERASE = 0,
+    FLASH_JOB_WRITE,
+    FLASH_JOB_FINISH,
+} flash_job_type_t;
+
+// The engine runs from FLASH_IRQHandler; queueing a job kicks it.
 void flash_init(void);
-void flash_process(void);
 
-// Async operations - return immediately
+// Async operations - queue the operation and return immediately.
+// Return false if the queue is full.
 bool flash_erase_sector_async(uint32_t addr);
-bool flash_write_async(uint32_t addr, const uint8_t *data, uint16_t length);
+// Erase a set of bank-2 sectors (bit n = sector n) as one job; all of them
+// becomes a single bank erase
+bool flash_erase_sectors_async(uint8_t sectors);
+bool flash_write_async(uint32_t addr, const uint8_t *data, uint32_t length);
+
+// End of a download: settle erases that diff mode still has deferred, so the
+// result is the same as if every requested erase had been done up front
+bool flash_finish_async(void);
+
+// Sequential writer for data produced a little at a time (decompressors,
+// bulk protocols). Bytes go straight into queued job buffers:
+//   begin(addr), then repeatedly space() -> fill up to *space bytes ->
+//   commit(n), and flush() at the end.
+// space() returns NULL and begin()/flush() return false while the queue is
+// full. Other writes and erases may
+// be queued in between; a flash word split by them is held back so it is
+// still programmed in one go.
+bool flash_stream_begin(uint32_t addr);
+uint8_t *flash_stream_space(uint32_t *space);
+void flash_stream_commit(uint32_t length);
+bool flash_stream_flush(void);
+
+// CRC-32 (crc.h) and length of the data queued for writing since the last
+// flash_finish_async(), in the order it was queued
+uint32_t flash_session_crc(uint32_t *bytes);
 
 // Status checks
 bool flash_is_busy(void);
+bool flash_queue_full(void);
 flash_op_state_t flash_get_state(void);
 
-// Blocking operations for simple cases
+// Timing, from running averages of measured erase and row-program times.
+// time_to_free: until a queue slot frees up; time_to_idle: until everything
+// queued is done. Both are at least 1 ms while the engine is busy.
+uint32_t flash_erase_time_ms(uint8_t sectors);
+uint32_t flash_write_time_ms(uint32_t length);
+uint32_t flash_time_to_free_ms(void);
+uint32_t flash_time_to_idle_ms(void);
+
+// Waits for the queue to drain and for erases deferred by diff mode to be
+// settled, then applies the FLASH_OPT_* flags in FLASH_OPTS_SUPPORTED
+void flash_set_options(uint32_t options);
+uint32_t flash_get_options(void);
+
+// Set by a session as it starts queueing jobs; DFU after flash_init()
+void flash_set_owner(flash_owner_t owner);
+flash_owner_t flash_get_owner(void);
+
+bool flash_sector_is_blank(uint32_t addr);
+
+// Copy flash to RAM once everything queued has been written
+void flash_read(uint8_t *dst, uint32_t addr, uint32_t length);
+
+// Called from the FLASH interrupt each time a queued job has finished. On an
+// error, everything queued behind the failed job has been dropped.
+void flash_job_done_cb(flash_job_type_t type, uint32_t addr, flash_error_t err);
+
+// Blocking operations for simple cases, interrupts must be enabled
 void flash_erase_sector_blocking(uint32_t addr);
-void flash_write_blocking(uint32_t addr, const uint8_t *data, uint16_t length);
+void flash_write_blocking(uint32_t addr, const uint8_t *data, uint32_t length);
+void flash_wait_idle(void);
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "stm32h7xx.h"
+
+// Cycle counter for timing measurements, runs at the CPU clock
+
+static inline void dwt_init(void) {
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->LAR          = 0xC5ACCE55; // unlock on Cortex-M7
+    DWT->CYCCNT       = 0;
+    DWT->CTRL        |= DWT_CTRL_CYCCNTENA_Msk;
+}
+
+// Counter and trace off again, as the application finds them after a reset
+static inline void dwt_deinit(void) {
+    DWT->CTRL        &= ~DWT_CTRL_CYCCNTENA_Msk;
+    DWT->CYCCNT       = 0;
+    DWT->LAR          = 0; // lock again
+    CoreDebug->DEMCR &= ~CoreDebug_DEMCR_TRCENA_Msk;
+}
+
+static inline uint32_t dwt_cycles(void) {
+    return DWT->CYCCNT;
+}
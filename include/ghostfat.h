@@ -0,0 +1,23 @@
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * Virtual FAT16 volume for UF2 flashing. Nothing is stored: every sector is
+ * made up when it is read, and the volume always holds the same two files,
+ *
+ *   INFO_UF2.TXT  board and flash layout
+ *   CURRENT.UF2   bank 2 as it is now, as a UF2 file
+ *
+ * Writes are not kept; msc_flash.c picks UF2 blocks out of them. Pure C
+ * apart from reading bank 2 for CURRENT.UF2.
+ */
+
+#define GHOSTFAT_SECTOR_SIZE  512
+#define GHOSTFAT_SECTOR_COUNT 16384 // 8 MB, enough clusters to be FAT16
+
+#define GHOSTFAT_VOLUME_LABEL "CS7000BOOT "
+
+/// @brief Produce one sector of the volume
+/// @param sector GHOSTFAT_SECTOR_SIZE bytes to fill
+void ghostfat_read(uint32_t lba, uint8_t *sector);
@@ -298,6 +298,21 @@ static inline uint8_t gpio_readPin(const void *port, const uint8_t pin)
     return ((p->IDR & (1 << pin)) != 0) ? 1 : 0;
 }
 
+/**
+ * Set up the 74HC595 chain behind extGpio and shift out an all-low image.
+ * The bits go out from the TIM7 interrupt, a couple of microseconds apart,
+ * so setting or clearing a pin only updates the image and starts a
+ * shift-out in the background; changes made while one is running go out
+ * with the next. Needs TCM loaded (tcm_init()), and is for thread context.
+ */
 void gpioShiftReg_init();
 
+/**
+ * Group extGpio pin changes: from gpioShiftReg_begin() to the matching
+ * gpioShiftReg_commit() nothing is shifted out, then all of the changes go
+ * out together in one shift-out. Calls nest.
+ */
+void gpioShiftReg_begin(void);
+void gpioShiftReg_commit(void);
+
 extern const struct gpioDev extGpio;
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Streaming decoder for the heatshrink LZSS format, as produced by
+ * `heatshrink -e -w <HS_WINDOW_BITS> -l <HS_LOOKAHEAD_BITS>`. RAM use is the
+ * window plus a few bytes of state; input and output can be fed in pieces of
+ * any size.
+ */
+
+#ifndef HS_WINDOW_BITS
+#define HS_WINDOW_BITS    11 // heatshrink CLI default
+#endif
+
+#ifndef HS_LOOKAHEAD_BITS
+#define HS_LOOKAHEAD_BITS 4  // heatshrink CLI default
+#endif
+
+#define HS_WINDOW_SIZE (1u << HS_WINDOW_BITS)
+
+typedef struct {
+    uint8_t  state;
+    uint8_t  nbits;      // valid bits in bits, MSB-first
+    uint32_t bits;
+    uint16_t index;      // back-reference distance
+    uint16_t count;      // back-reference bytes still to copy
+    uint16_t head;       // window write position
+    uint8_t  window[HS_WINDOW_SIZE];
+} hs_decoder_t;
+
+void hs_decoder_reset(hs_decoder_t *dec);
+
+/**
+ * Decode as much as possible from in into out.
+ *
+ * @param consumed: set to the number of input bytes used; the rest has to be
+ * passed again on the next call.
+ * @return number of bytes written to out. Less than out_len means the input
+ * ran out.
+ */
+uint32_t hs_decode(hs_decoder_t *dec, const uint8_t *in, uint32_t in_len,
+                   uint32_t *consumed, uint8_t *out, uint32_t out_len);
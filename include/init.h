@@ -1,5 +1,22 @@
 #pragma once
 
+#include <stdbool.h>
+
+// Interrupt priorities, set up by irq_init() as 16 preemption levels with no
+// subpriority: a handler is only ever preempted by a more urgent one. USB
+// has to be serviced within a packet time even while the flash engine runs
+// a long step (a sector blank check, a cache invalidation), and the two
+// don't share any state. The tick only counts. The flash engine is at 15,
+// the lowest (FLASH_IRQ_PRIORITY in dfu_flash.c), and so is the shift
+// register clock, which nothing waits for.
+#define IRQ_PRIO_USB      5
+#define IRQ_PRIO_TICK     6
+#define IRQ_PRIO_SHIFTREG 15
+
+// Sample ALARM_KEY with nothing but GPIOE set up, and put GPIOE back into
+// reset state afterwards. Needs the DWT cycle counter running.
+bool boot_key_pressed(void);
+
 void gpio_init(void);
 void irq_init(void);
 void usb_init(void);
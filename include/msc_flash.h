@@ -0,0 +1,21 @@
+#pragma once
+
+/*
+ * Flashing by copying a UF2 file to the mass-storage volume (ghostfat.h).
+ * UF2 blocks for bank 2 are streamed into the flash engine as they are
+ * written, erasing each sector on first use. A file that lies within one
+ * application slot (slots.h) activates it. Shares the engine with DFU and
+ * the vendor interface, so use one at a time.
+ */
+
+#include <stdbool.h>
+
+#include "dfu_flash.h"
+
+// Call from the main loop, after tud_task(). Returns true once a whole UF2
+// file has been written and is on flash.
+bool msc_task(void);
+
+// Flash completions while this session owns the engine (flash_set_owner()),
+// forwarded by the owner of flash_job_done_cb()
+void msc_job_done_cb(flash_job_type_t type, uint32_t addr, flash_error_t err);
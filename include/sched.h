@@ -0,0 +1,37 @@
+#pragma once
+
+/*
+ * Run-to-completion scheduler for the bootloader's main loop. Interrupt
+ * handlers post event flags; sched_run() hands them to the highest priority
+ * task waiting for any of them and sleeps in WFI while no task has one.
+ * Tasks don't preempt each other: a higher priority one runs as soon as the
+ * task on the CPU returns, so tasks have to return rather than wait.
+ */
+
+#include <stdint.h>
+
+#define SCHED_EV_USB     (1u << 0) // OTG_FS interrupt
+#define SCHED_EV_FLASH   (1u << 1) // flash job done, or failed
+#define SCHED_EV_TICK    (1u << 2) // every SCHED_TICK_MS
+
+#define SCHED_TICK_MS    10u
+#define SCHED_MAX_TASKS  8u
+
+typedef struct {
+    void     (*run)(uint32_t events); // the events it was woken for
+    uint32_t events;                  // the ones it waits for
+} sched_task_t;
+
+// Task table, highest priority first; it has to stay around
+void sched_init(const sched_task_t *tasks, uint32_t count);
+
+// From any context, interrupts included
+void sched_post(uint32_t events);
+
+// From SysTick_Handler, once a millisecond
+void sched_tick(void);
+
+// Milliseconds counted by sched_tick(), wrapping after 49 days
+uint32_t sched_ms(void);
+
+__attribute__((noreturn)) void sched_run(void);
@@ -0,0 +1,25 @@
+#pragma once
+
+/*
+ * Placement in the Cortex-M7 tightly coupled memories (linker/bootloader.ld):
+ * ITCM for code that has to run without flash wait states, DTCM for data
+ * the interrupt handlers work on. Both are zero wait state and never stall
+ * behind a flash operation.
+ *
+ * They are only loaded by tcm_init(), which main() calls once the
+ * bootloader stays. Nothing on the way to the application may live there.
+ * Host builds ignore the placement.
+ */
+
+#if defined(__ARM_ARCH)
+#define ITCM_FUNC __attribute__((section(".itcm_text")))
+#define DTCM_DATA __attribute__((section(".dtcm_data")))
+#define DTCM_BSS  __attribute__((section(".dtcm_bss")))
+#else
+#define ITCM_FUNC
+#define DTCM_DATA
+#define DTCM_BSS
+#endif
+
+// Copy .itcm_text and .dtcm_data from flash, clear .dtcm_bss
+void tcm_init(void);
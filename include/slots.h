@@ -0,0 +1,72 @@
+#pragma once
+
+/*
+ * Two application slots in bank 2, four sectors each. A new image goes into
+ * the slot that isn't running while the other one stays untouched, then a
+ * single flash word switches over: every slot ends in a log of records,
+ * appended to one flash word at a time and only cleared by erasing the
+ * slot's last sector.
+ *
+ * The bootloader starts the activated slot with the highest sequence number
+ * whose image checks out (boot_jump.h), falling back to the other one.
+ * Revoking the running slot therefore rolls back to the previous image. An
+ * activation is tied to the CRC in the image header, so rewriting a slot
+ * deactivates it until it is activated again. With no slot activated,
+ * bank 2 holds a single image at APP_BASE_ADDR as before.
+ *
+ * Images run in place, so an image for slot 1 has to be linked for
+ * SLOT_BASE(1).
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "dfu_flash.h"
+
+#define SLOT_COUNT       2u
+#define SLOT_SIZE        (4u * FLASH_SECTOR_SIZE)
+#define SLOT_BASE(n)     (FLASH_BANK2_BASE + (n) * SLOT_SIZE)
+#define SLOT_LOG_SIZE    1024u // 32 records
+#define SLOT_IMAGE_MAX   (SLOT_SIZE - SLOT_LOG_SIZE)
+
+#define SLOT_RECORD_MAGIC 0x544F4C53u // "SLOT"
+
+typedef enum {
+    SLOT_ACTIVATE = 1,
+    SLOT_REVOKE   = 2,
+} slot_record_kind_t;
+
+// One flash word, so a record is programmed all at once or not at all
+typedef struct {
+    uint32_t magic;
+    uint32_t kind;      // slot_record_kind_t
+    uint32_t sequence;  // one more than any record so far, in any slot
+    uint32_t crc;       // header CRC of the image it applies to
+    uint32_t check;     // xor of the fields above
+    uint32_t reserved[3];
+} slot_record_t;
+
+_Static_assert(sizeof(slot_record_t) == FLASH_WRITE_SIZE, "a record is one flash word");
+
+// Slot holding all of addr..addr+length, SLOT_COUNT if none does
+unsigned slot_of(uint32_t addr, uint32_t length);
+
+// Whether the latest record of a slot activates the image now in it, and
+// that record's sequence number
+bool slot_is_active(unsigned slot, uint32_t *sequence);
+
+// Whether addr..addr+length touches the slot the bootloader would start,
+// image or log. Downloads must leave that one alone: it is what revoking
+// the new image rolls back to.
+bool slot_overlaps_active(uint32_t addr, uint32_t length);
+
+// Bank 2 sectors of that slot (bit n for sector n), 0 with no slot active
+uint8_t slot_active_sectors(void);
+
+// Append an activation record, once the image in the slot has been checked
+// (needs the CRC unit running), or a revocation of an active slot. Settles
+// the download first (flash_finish_async()) and waits for the record to be
+// written; the flash must not be busy. False if the slot can't be switched
+// or its log is full, which takes erasing the slot.
+bool slot_activate(unsigned slot);
+bool slot_revoke(unsigned slot);
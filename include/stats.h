@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "stm32h7xx.h"
+
+/*
+ * Always-on counters and log2 histograms. The struct is read verbatim by a
+ * DfuSe upload from STATS_ADDR, so only ever append fields and bump
+ * STATS_VERSION when the layout changes. Everything is little endian.
+ */
+
+#define STATS_ADDR    0xF0000000u // virtual address for UPLOAD
+#define STATS_MAGIC   0x54415453u // "STAT"
+#define STATS_VERSION 2
+
+// Bucket 0 counts zeros, bucket n values in [2^(n-1), 2^n)
+#define STATS_BUCKETS 24
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size;                // sizeof(stats_t)
+
+    uint32_t usb_mounts;          // enumerations, i.e. bus resets that led somewhere
+    uint32_t getstatus;           // GETSTATUS requests answered by the DfuSe layer
+    uint32_t getstatus_busy;      // ... of which reported DNBUSY
+    uint32_t blocks;              // data blocks queued
+    uint32_t bytes_programmed;    // data bytes of finished write jobs
+    uint32_t rows_programmed;     // flash words programmed
+    uint32_t rows_skipped;        // flash words left alone (blank or unchanged)
+    uint32_t erases;              // sector and bank erases
+    uint32_t flash_errors;
+
+    uint32_t block_latency_us[STATS_BUCKETS];    // block queued -> on flash
+    uint32_t erase_ms[STATS_BUCKETS];            // one erase operation
+    uint32_t getstatus_per_block[STATS_BUCKETS]; // polls before a block was taken
+
+    // Version 2
+    uint32_t boot_cycles;         // Reset_Handler to application entry on the last
+                                  // start, in 64 MHz HSI cycles
+} stats_t;
+
+extern stats_t stats;
+
+static inline void stats_hist(uint32_t *hist, uint32_t value) {
+    uint32_t bucket = 32u - __CLZ(value); // __CLZ(0) == 32
+
+    hist[(bucket < STATS_BUCKETS) ? bucket : STATS_BUCKETS - 1u]++;
+}
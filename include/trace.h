@@ -0,0 +1,49 @@
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * Event trace: fixed-size records stamped with the DWT cycle counter, kept
+ * in a RAM ring and dumped over CDC ('T' on the serial port). Convert a dump
+ * with tools/trace2chrome.py. Built with -DDFU_TRACE=ON, otherwise every
+ * call compiles away.
+ */
+
+typedef enum {
+    TRACE_DNLOAD = 1,     // DNLOAD data block taken up on GETSTATUS, arg = block << 16 | length
+    TRACE_UPLOAD,         // arg = block << 16 | length
+    TRACE_GETSTATUS,      // arg = state << 16 | block
+    TRACE_STATUS_REPLY,   // arg = reported state << 24 | poll timeout in ms
+    TRACE_JOB_START,      // arg = flash job type << 24 | queue count
+    TRACE_JOB_END,        // arg = flash job type
+    TRACE_ERASE_START,    // arg = sector, 0xFF for the whole bank
+    TRACE_ERASE_END,
+    TRACE_ROW,            // arg = address
+    TRACE_FORCE_WRITE,    // arg = end address of the data
+    TRACE_FLASH_ERROR,    // arg = FLASH->SR2 error flags
+    TRACE_READ_START,     // UPLOAD copying flash, arg = address
+    TRACE_READ_END,       // arg = length
+} trace_event_t;
+
+typedef struct {
+    uint32_t cycles;
+    uint32_t event;
+    uint32_t arg;
+} trace_record_t;
+
+#ifdef DFU_TRACE
+
+// Safe from any context, lock-free
+void trace_event(trace_event_t event, uint32_t arg);
+
+// Start sending the ring over CDC; recording pauses until it is all out
+void trace_dump_start(void);
+void trace_dump_task(void);
+
+#else
+
+#define trace_event(event, arg) ((void)0)
+#define trace_dump_start()      ((void)0)
+#define trace_dump_task()       ((void)0)
+
+#endif
@@ -46,6 +46,8 @@
 //------------- CLASS -------------//
 #define CFG_TUD_CDC               1
 #define CFG_TUD_DFU               1
+#define CFG_TUD_VENDOR            1
+#define CFG_TUD_MSC               1
 
 // CDC FIFO size of TX and RX
 #define CFG_TUD_CDC_RX_BUFSIZE   (TUD_OPT_HIGH_SPEED ? 512 : 64)
@@ -54,5 +56,20 @@
 // CDC Endpoint transfer buffer size, more is faster
 #define CFG_TUD_CDC_EP_BUFSIZE   (TUD_OPT_HIGH_SPEED ? 512 : 64)
 
-// DFU buffer size, must match buffer size used in TUD_DFU_DESCRIPTOR
+// DFU buffer size, must match buffer size used in TUD_DFU_DESCRIPTOR.
+// Set with -DDFU_XFER_SIZE=<bytes> at configure time; a multiple of 32 (one
+// flash word) between 1 KB and 32 KB. Larger blocks mean fewer
+// DNLOAD/GETSTATUS round trips per image.
+#ifndef CFG_TUD_DFU_XFER_BUFSIZE
 #define CFG_TUD_DFU_XFER_BUFSIZE 1024
+#endif
+
+// Vendor bulk interface (vendor_flash.c). The receive buffer is also the
+// flow control window the host gets, see vendor_proto.h.
+#define CFG_TUD_VENDOR_EPSIZE     64
+#define CFG_TUD_VENDOR_RX_BUFSIZE 4096
+#define CFG_TUD_VENDOR_TX_BUFSIZE 2048
+
+// MSC transfer buffer (msc_flash.c), a whole number of 512-byte sectors.
+// Each callback gets this much, so fewer and larger flash stream commits.
+#define CFG_TUD_MSC_EP_BUFSIZE    4096
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * UF2 block format (https://github.com/microsoft/uf2): a file is a sequence
+ * of self-describing 512-byte blocks, each carrying up to 476 bytes of data
+ * for a target address. Hosts copy it to the virtual FAT volume sector by
+ * sector, so every sector written either is a whole UF2 block or is not
+ * one at all. Pure C, no hardware access.
+ */
+
+#define UF2_BLOCK_SIZE    512
+#define UF2_PAYLOAD_MAX   476
+#define UF2_PAYLOAD_SIZE  256 // what CURRENT.UF2 and most tools use
+
+#define UF2_MAGIC_START0  0x0A324655u // "UF2\n"
+#define UF2_MAGIC_START1  0x9E5D5157u
+#define UF2_MAGIC_END     0x0AB16F30u
+
+#define UF2_FLAG_NOT_MAIN_FLASH  0x00000001u
+#define UF2_FLAG_FILE_CONTAINER  0x00001000u
+#define UF2_FLAG_FAMILY_ID       0x00002000u
+#define UF2_FLAG_MD5             0x00004000u
+#define UF2_FLAG_EXTENSION_TAGS  0x00008000u
+
+#define UF2_FAMILY_STM32H7 0x6DB66082u
+
+typedef struct __attribute__((packed)) {
+    uint32_t magic_start0;
+    uint32_t magic_start1;
+    uint32_t flags;
+    uint32_t target_addr;
+    uint32_t payload_size;
+    uint32_t block_no;
+    uint32_t num_blocks;
+    uint32_t family_id;    // file size with UF2_FLAG_FILE_CONTAINER
+    uint8_t  data[UF2_PAYLOAD_MAX];
+    uint32_t magic_end;
+} uf2_block_t;
+
+_Static_assert(sizeof(uf2_block_t) == UF2_BLOCK_SIZE, "UF2 blocks are one sector");
+
+typedef enum {
+    UF2_NOT_UF2 = 0,  // some other sector (FAT, directory, foreign data)
+    UF2_SKIP,         // valid, but not for our flash: other family, container
+    UF2_DATA,         // to be programmed
+    UF2_BAD,          // magic matches but the header is inconsistent
+} uf2_kind_t;
+
+/// @brief Classify a sector written to the volume
+/// @param sector UF2_BLOCK_SIZE bytes, any alignment
+/// @param block gets a copy of the block unless UF2_NOT_UF2
+uf2_kind_t uf2_check(const void *sector, uf2_block_t *block);
+
+/// @brief Build block block_no of a UF2 image of [base, base + size)
+/// @param sector UF2_BLOCK_SIZE bytes to fill
+void uf2_render(void *sector, uint32_t base, uint32_t size, uint32_t block_no);
+
+/// @brief Number of UF2_PAYLOAD_SIZE blocks in a UF2 image of size bytes
+static inline uint32_t uf2_num_blocks(uint32_t size) {
+    return (size + UF2_PAYLOAD_SIZE - 1u) / UF2_PAYLOAD_SIZE;
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+/*
+ * Flashing over the vendor bulk interface, see vendor_proto.h. Feeds the
+ * same flash engine as DFU, so use one or the other at a time.
+ */
+
+#include "dfu_flash.h"
+
+// Must match the interface number in usb_descriptors.c
+#define VENDOR_ITF_NUM 3
+
+// Call from the main loop, after tud_task()
+void vendor_task(void);
+
+// Flash completions while this session owns the engine (flash_set_owner()),
+// forwarded by the owner of flash_job_done_cb()
+void vendor_job_done_cb(flash_job_type_t type, uint32_t addr, flash_error_t err);
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * Wire format of the vendor bulk interface (EP 0x04 OUT, 0x84 IN), shared
+ * with tools/vendorflash. Everything is little endian.
+ *
+ * OUT is a byte stream of commands: a vnd_cmd_t, followed by `length` bytes
+ * of data for VND_CMD_WRITE. Sequence numbers count up from 1 after a reset.
+ * The host may send bytes (commands included) up to the `credit` of the
+ * latest status. That much always fits in the device's receive buffer, so
+ * data the host was allowed to send is never held up by NAKs.
+ *
+ * IN carries vnd_status_t packets, each one followed by `value` bytes of
+ * data for VND_CMD_READ. Commands complete in order, and a status
+ * acknowledges everything up to `seq`. Writes and erases complete once
+ * queued, and their statuses are coalesced into credit updates. CRC, READ
+ * SYNC, ACTIVATE and REVOKE always get their own status.
+ *
+ * After an error the device drops OUT data until VND_REQ_RESET.
+ */
+
+#define VND_PROTO_VERSION 1
+
+// Control requests: vendor type, interface recipient
+#define VND_REQ_RESET 0x01 // no data: drop buffered data, seq and credit start over
+#define VND_REQ_INFO  0x02 // IN vnd_info_t
+
+typedef enum {
+    VND_CMD_WRITE = 1,    // program length bytes of data at addr (bank 2). A
+                          // write that doesn't follow on from the previous one,
+                          // or comes after CRC/READ/SYNC, must start a flash word
+    VND_CMD_ERASE,        // erase the sectors overlapping addr..addr+length
+    VND_CMD_CRC,          // CRC-32 of addr..addr+length once written, or of
+                          // the session if length is 0
+    VND_CMD_READ,         // send length bytes from addr once written
+    VND_CMD_SYNC,         // end of download: wait for flash, value = session CRC
+    VND_CMD_ACTIVATE,     // end of download, then activate slot addr (slots.h)
+    VND_CMD_REVOKE,       // end of download, then revoke slot addr
+} vnd_cmd_type_t;
+
+typedef enum {
+    VND_OK = 0,
+    VND_ERR_COMMAND,      // unknown command
+    VND_ERR_SEQ,          // sequence number out of order
+    VND_ERR_ADDRESS,      // range outside the flash it applies to, a WRITE
+                          // or ERASE touching the slot the bootloader would
+                          // start, or a WRITE that should start a flash word
+                          // and doesn't
+    VND_ERR_WRITE_PROTECT,
+    VND_ERR_PROGRAM,      // any other flash error
+    VND_ERR_SLOT,         // slot can't be switched, see slot_activate()
+} vnd_status_code_t;
+
+typedef struct __attribute__((packed)) {
+    uint8_t  cmd;         // vnd_cmd_type_t
+    uint8_t  reserved;
+    uint16_t seq;
+    uint32_t addr;
+    uint32_t length;
+} vnd_cmd_t;
+
+typedef struct __attribute__((packed)) {
+    uint8_t  status;      // vnd_status_code_t
+    uint8_t  cmd;         // command that was answered, 0 for credit updates
+    uint16_t seq;         // last command completed
+    uint32_t credit;      // OUT bytes the host may have sent since the reset
+    uint32_t value;       // CRC for CRC and SYNC, bytes following for READ
+} vnd_status_t;
+
+typedef struct __attribute__((packed)) {
+    uint16_t version;     // VND_PROTO_VERSION
+    uint16_t reserved;
+    uint32_t window;      // initial credit
+    uint32_t write_base;  // writable range
+    uint32_t write_size;
+    uint32_t read_base;   // readable range
+    uint32_t read_size;
+} vnd_info_t;
@@ -0,0 +1,13 @@
+#include "backup.h"
+
+void backup_init(void) {
+    // Enable APB4 RTC access and unlock backup domain
+    RCC->APB4ENR |= RCC_APB4ENR_RTCAPBEN;
+    PWR->CR1 |= PWR_CR1_DBP;
+    while (!(PWR->CR1 & PWR_CR1_DBP)) ; // Wait
+}
+
+void backup_deinit(void) {
+    PWR->CR1     &= ~PWR_CR1_DBP;
+    RCC->APB4ENR &= ~RCC_APB4ENR_RTCAPBEN;
+}
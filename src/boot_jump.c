@@ -1,19 +1,128 @@
-#include "stm32h7xx.h"
+#include <stddef.h>
 
-#define APP_BASE_ADDR 0x08100000U
+#include "stm32h7xx.h"
+#include "app_header.h"
+#include "backup.h"
+#include "boot_jump.h"
+#include "cache.h"
+#include "crc.h"
+#include "dwt.h"
+#include "slots.h"
 
 typedef void (*app_entry_t)(void);
 
-__attribute__((noreturn))
-void jump_to_application(void) {
-    uint32_t app_msp   = *(__IO uint32_t *)APP_BASE_ADDR;
-    uint32_t app_reset = *(__IO uint32_t *)(APP_BASE_ADDR + 4U) ;
+// Plausible initial stack pointer: word aligned, in DTCM, AXI SRAM or
+// SRAM1-4 (top of the region included)
+static bool app_sp_valid(uint32_t sp) {
+    return (sp & 3u) == 0
+        && ((sp >  0x20000000u && sp <= 0x20020000u)
+         || (sp >  0x24000000u && sp <= 0x24080000u)
+         || (sp >  0x30000000u && sp <= 0x30048000u)
+         || (sp >  0x38000000u && sp <= 0x38010000u));
+}
+
+static bool app_vectors_valid(uint32_t base, uint32_t max_size) {
+    uint32_t app_msp   = *(__IO uint32_t *)base;
+    uint32_t app_reset = *(__IO uint32_t *)(base + 4U);
+
+    // Thumb entry point inside the image
+    return app_sp_valid(app_msp)
+        && (app_reset & 1u)
+        && app_reset > base && app_reset < base + max_size;
+}
+
+static uint32_t app_crc(uint32_t base, const app_header_t *hdr) {
+    const uint8_t *start = (const uint8_t *)base;
+    const uint8_t *field = (const uint8_t *)&hdr->crc;
+    const uint8_t *after = field + sizeof(hdr->crc);
+
+    uint32_t crc = crc32_update(0, start, (uint32_t)(field - start));
+    return crc32_update(crc, after, hdr->length - (uint32_t)(after - start));
+}
+
+// Header, if any, and vectors; the CRC is left to the caller
+static bool app_plausible(uint32_t base, uint32_t max_size, const app_header_t *hdr) {
+    if (hdr->magic == APP_HEADER_MAGIC
+     && (hdr->length < APP_HEADER_OFFSET + sizeof(app_header_t) || hdr->length > max_size)) {
+        return false;
+    }
+    return app_vectors_valid(base, max_size);
+}
+
+bool app_check(uint32_t base, uint32_t max_size) {
+    const app_header_t *hdr = (const app_header_t *)(base + APP_HEADER_OFFSET);
 
-    if ((app_msp == 0xFFFFFFFFU) || (app_reset == 0xFFFFFFFFU)) {
-        // No valid app, handle error?
-        //while (1) { }
+    return app_plausible(base, max_size, hdr)
+        && (hdr->magic != APP_HEADER_MAGIC || app_crc(base, hdr) == hdr->crc);
+}
+
+static bool app_is_valid(uint32_t base, uint32_t max_size) {
+    const app_header_t *hdr = (const app_header_t *)(base + APP_HEADER_OFFSET);
+
+    if (!app_plausible(base, max_size, hdr)) {
+        return false;
+    }
+    if (hdr->magic != APP_HEADER_MAGIC) {
+        // Built without a header
+        return true;
     }
 
+    // Same image as the one that passed last time
+    const uint32_t check = hdr->crc ^ hdr->length ^ base ^ BACKUP_APP_VALID;
+    if (backup_read(BACKUP_APP_CRC) == hdr->crc
+     && backup_read(BACKUP_APP_LENGTH) == hdr->length
+     && backup_read(BACKUP_APP_CHECK) == check) {
+        return true;
+    }
+
+    crc_init();
+    bool valid = (app_crc(base, hdr) == hdr->crc);
+    crc_deinit();
+
+    if (valid) {
+        backup_write(BACKUP_APP_CRC, hdr->crc);
+        backup_write(BACKUP_APP_LENGTH, hdr->length);
+        backup_write(BACKUP_APP_CHECK, check);
+    }
+    return valid;
+}
+
+uint32_t app_find(void) {
+    uint32_t sequence[SLOT_COUNT];
+    bool     active[SLOT_COUNT];
+
+    for (unsigned s = 0; s < SLOT_COUNT; s++) {
+        active[s] = slot_is_active(s, &sequence[s]);
+    }
+
+    // Newest activation first, an image that doesn't check out falls back
+    // to the one before
+    for (;;) {
+        unsigned best = SLOT_COUNT;
+        for (unsigned s = 0; s < SLOT_COUNT; s++) {
+            if (active[s] && (best == SLOT_COUNT || sequence[s] > sequence[best])) {
+                best = s;
+            }
+        }
+        if (best == SLOT_COUNT) {
+            break;
+        }
+
+        if (app_is_valid(SLOT_BASE(best), SLOT_IMAGE_MAX)) {
+            return SLOT_BASE(best);
+        }
+        active[best] = false;
+    }
+
+    // No slot to start: a single image in bank 2
+    return app_is_valid(APP_BASE_ADDR, APP_MAX_SIZE) ? APP_BASE_ADDR : 0;
+}
+
+__attribute__((noreturn))
+void jump_to_application(uint32_t base) {
+    uint32_t app_msp   = *(__IO uint32_t *)base;
+    uint32_t app_reset = *(__IO uint32_t *)(base + 4U);
+
     // 1. Disable interrupts
     __disable_irq();
 
@@ -27,16 +136,21 @@ void jump_to_application(void) {
         NVIC->ICPR[i] = 0xFFFFFFFFU;
     }
 
-    // 4. Set vector table to application base
-    SCB->VTOR = APP_BASE_ADDR;
+    // 4. Caches and MPU back to reset state, RAM written back, and the cycle
+    //    counter and trace off again (dwt_init() at reset)
+    cache_deinit();
+    dwt_deinit();
+
+    // 5. Set vector table to application base
+    SCB->VTOR = base;
 
-    // 5. Set MSP to app's initial stack pointer
+    // 6. Set MSP to app's initial stack pointer
     __set_MSP(app_msp);
 
     __DSB();
     __ISB();
 
-    // 6. Jump to app's ResetHandler
+    // 7. Jump to app's ResetHandler
     app_entry_t app_reset_handler = (app_entry_t)app_reset;
     app_reset_handler();
 
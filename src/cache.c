@@ -0,0 +1,54 @@
+#include "cache.h"
+
+enum {
+    MPU_REGION_BANK1,
+    MPU_REGION_BANK2,
+    MPU_REGION_AXIRAM,
+    MPU_REGION_PERIPH,
+};
+
+// ARM_MPU_RASR(XN, AP, TEX, S, C, B, subregions off, size):
+// TEX 0 C B = 0 1 0 normal write-through, 1 1 1 normal write-back with
+// allocation, 0 0 1 shared device
+
+void cache_init(void) {
+    ARM_MPU_Disable();
+
+    // The bootloader never writes its own bank, only the flash registers
+    ARM_MPU_SetRegion(ARM_MPU_RBAR(MPU_REGION_BANK1, FLASH_BANK1_BASE),
+                      ARM_MPU_RASR(0u, ARM_MPU_AP_PRO, 0u, 0u, 1u, 0u, 0u, ARM_MPU_REGION_SIZE_1MB));
+
+    // Write-through keeps programmed rows in step with the cache; erases
+    // still need cache_invalidate()
+    ARM_MPU_SetRegion(ARM_MPU_RBAR(MPU_REGION_BANK2, FLASH_BANK2_BASE),
+                      ARM_MPU_RASR(1u, ARM_MPU_AP_PRIV, 0u, 0u, 1u, 0u, 0u, ARM_MPU_REGION_SIZE_1MB));
+
+    ARM_MPU_SetRegion(ARM_MPU_RBAR(MPU_REGION_AXIRAM, D1_AXISRAM_BASE),
+                      ARM_MPU_RASR(1u, ARM_MPU_AP_PRIV, 1u, 0u, 1u, 1u, 0u, ARM_MPU_REGION_SIZE_512KB));
+
+    ARM_MPU_SetRegion(ARM_MPU_RBAR(MPU_REGION_PERIPH, PERIPH_BASE),
+                      ARM_MPU_RASR(1u, ARM_MPU_AP_PRIV, 0u, 1u, 0u, 1u, 0u, ARM_MPU_REGION_SIZE_512MB));
+
+    // Default map everywhere else (TCMs, system space)
+    ARM_MPU_Enable(MPU_CTRL_PRIVDEFENA_Msk);
+
+    SCB_EnableICache();
+    SCB_EnableDCache();
+}
+
+void cache_deinit(void) {
+    // Disabling the D-cache cleans it first, the application finds in RAM
+    // what the bootloader wrote
+    SCB_DisableDCache();
+    SCB_DisableICache();
+
+    ARM_MPU_Disable();
+
+    uint32_t regions = (MPU->TYPE & MPU_TYPE_DREGION_Msk) >> MPU_TYPE_DREGION_Pos;
+    for (uint32_t i = 0; i < regions; i++) {
+        ARM_MPU_ClrRegion(i);
+    }
+
+    __DSB();
+    __ISB();
+}
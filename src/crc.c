@@ -0,0 +1,46 @@
+#include "crc.h"
+
+#include "stm32h7xx.h"
+
+void crc_init(void) {
+    RCC->AHB4ENR |= RCC_AHB4ENR_CRCEN;
+    __DSB();
+
+    // 32-bit polynomial, input bit-reversed per byte, output bit-reversed
+    CRC->POL = 0x04C11DB7u;
+    CRC->CR  = CRC_CR_REV_IN_0 | CRC_CR_REV_OUT;
+}
+
+void crc_deinit(void) {
+    RCC->AHB4RSTR |= RCC_AHB4RSTR_CRCRST;
+    RCC->AHB4RSTR &= ~RCC_AHB4RSTR_CRCRST;
+    RCC->AHB4ENR  &= ~RCC_AHB4ENR_CRCEN;
+    __DSB();
+}
+
+uint32_t crc32_update(uint32_t crc, const void *data, uint32_t length) {
+    const uint8_t *p = data;
+
+    // The peripheral keeps its state un-reflected and without the final
+    // xor, so undo both to carry on from a previous result
+    CRC->INIT = __RBIT(crc ^ 0xFFFFFFFFu);
+    CRC->CR  |= CRC_CR_RESET;
+
+    while (length != 0 && ((uint32_t)p & 3u) != 0) {
+        *(volatile uint8_t *)&CRC->DR = *p++;
+        length--;
+    }
+
+    // Words are shifted in MSB first, swap so the lowest address goes first
+    const uint32_t *w = (const uint32_t *)p;
+    for (; length >= 4; length -= 4) {
+        CRC->DR = __REV(*w++);
+    }
+
+    p = (const uint8_t *)w;
+    while (length-- != 0) {
+        *(volatile uint8_t *)&CRC->DR = *p++;
+    }
+
+    return CRC->DR ^ 0xFFFFFFFFu;
+}
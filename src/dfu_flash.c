@@ -1,6 +1,14 @@
 #include <string.h>
 
 #include "dfu_flash.h"
+#include "cache.h"
+#include "clock.h"
+#include "crc.h"
+#include "dwt.h"
+#include "sched.h"
+#include "sections.h"
+#include "stats.h"
+#include "trace.h"
 #include "tusb.h"
 #include "stm32h7xx.h"
 
@@ -11,113 +19,927 @@
 #include "pinmap.h"
 #endif
 
-// TODO: Error handling
+_Static_assert(CFG_TUD_DFU_XFER_BUFSIZE % FLASH_WRITE_SIZE == 0,
+               "DFU transfer size must be a whole number of flash words");
+_Static_assert(CFG_TUD_DFU_XFER_BUFSIZE >= 1024 && CFG_TUD_DFU_XFER_BUFSIZE <= 32768,
+               "DFU transfer size must be between 1 KB and 32 KB");
+_Static_assert((FLASH_QUEUE_DEPTH & (FLASH_QUEUE_DEPTH - 1)) == 0 && FLASH_QUEUE_DEPTH <= 128,
+               "Flash queue depth must be a power of two");
 
-static struct {
-    flash_op_state_t state;
+#define FLASH_SR_ERRORS (FLASH_SR_WRPERR | FLASH_SR_PGSERR | FLASH_SR_STRBERR \
+                       | FLASH_SR_INCERR | FLASH_SR_OPERR)
+
+#define FLASH_CR_IRQS   (FLASH_CR_EOPIE | FLASH_CR_WRPERRIE | FLASH_CR_PGSERRIE \
+                       | FLASH_CR_STRBERRIE | FLASH_CR_INCERRIE | FLASH_CR_OPERRIE)
+
+// Lowest priority: the engine only needs to run before the next row is due
+#define FLASH_IRQ_PRIORITY 15
+
+// Accesses the host model in tools/flashsim has to see; it defines its own
+#ifndef FLASH_HW_SHIM
+#define flash_store32(addr, value) (*(volatile uint32_t *)(addr) = (value))
+#define flash_store8(addr, value)  (*(volatile uint8_t *)(addr) = (value))
+#define flash_wait_event()         ((void)0)
+#endif
+
+#define CYCLES_PER_MS (CPU_CLOCK_HZ / 1000u)
+
+// Starting points for the timing estimates, from bench measurements
+#define SECTOR_ERASE_MS_INIT     844u
+#define ROW_PROGRAM_CYCLES_INIT  (CYCLES_PER_MS * 27u / 10u / (1024u / FLASH_WRITE_SIZE))
+
+typedef struct {
+    flash_job_type_t type;
     uint32_t addr;
-    uint8_t buffer[CFG_TUD_DFU_XFER_BUFSIZE];
-    uint16_t length;
-    uint16_t offset; // Current write offset
-} flash_ctx;
+    uint32_t length;
+    uint8_t sectors;  // FLASH_JOB_ERASE: bit mask of sectors still to erase
+    uint32_t queued_at; // DWT cycles
+    uint8_t *buffer;    // in flash_buffers, fixed by flash_init()
+} flash_job_t;
+
+// The queue is single producer (thread, flash_*_async) / single consumer
+// (FLASH_IRQHandler). head is only written by the producer and tail only by
+// the consumer; both run freely and are reduced modulo the queue depth.
+static struct {
+    volatile flash_op_state_t state;
+
+    flash_job_t jobs[FLASH_QUEUE_DEPTH];
+    volatile uint8_t head;
+    volatile uint8_t tail;
+
+    uint32_t offset; // Current write offset into the active job
+
+    uint32_t options;
+    flash_owner_t owner;
+
+    // Everything queued for writing since the last finished download
+    struct {
+        uint32_t crc;
+        uint32_t bytes;
+        bool     restart;  // a download finished, start over on the next write
+    } session;
+
+    // Sequential writer (flash_stream_*): while open, jobs[head] is being
+    // filled in place and not visible to the engine yet
+    struct {
+        bool     open;
+        uint32_t addr;    // flash address of the next byte
+        uint32_t fill;    // bytes in jobs[head]
+        uint32_t carry;   // bytes of a split flash word waiting in row[]
+        uint8_t  row[FLASH_WRITE_SIZE];
+    } stream;
+
+    // Sectors erased (or found blank) since the download started, so
+    // FLASH_OPT_AUTO_ERASE knows which ones still need it
+    uint8_t  erased;
+
+    // Diff programming: sectors whose erase is deferred, and for each the
+    // byte range [lo, hi) spanning what this session has written so far
+    // (diff_written has the flash words within it)
+    uint8_t  deferred;
+    uint32_t written_lo[FLASH_SECTOR_COUNT];
+    uint32_t written_hi[FLASH_SECTOR_COUNT];
+
+    uint8_t  restore_sector;
+    uint32_t restore_offset;
+    flash_op_state_t resume_state;
+
+    // What the erase in progress clears, for cache_invalidate()
+    uint32_t erase_addr;
+    uint32_t erase_size;
+
+    // Running estimates of how long operations take, and the measurements
+    // in progress. Erases are timed in SysTick milliseconds: a bank erase
+    // can take longer than the 32-bit cycle counter's 10.7 s at 400 MHz.
+    struct {
+        uint32_t erase;       // ms, one sector
+        uint32_t bank;        // ms, bank erase
+        uint32_t erase_start; // ms
+        bool     is_bank;
+        uint32_t row;         // DWT cycles, one flash word, including interrupt overhead
+        uint32_t start;       // DWT cycles
+        uint32_t rows;        // rows programmed since start
+    } time;
+} flash_ctx DTCM_BSS; // the interrupt handler's working set
+
+_Static_assert(sizeof(flash_ctx) <= 4u * 1024u,
+               "flash engine state too big for DTCM, lower FLASH_QUEUE_DEPTH");
+
+// Job data stays in AXI SRAM: at the larger transfer sizes it wouldn't fit
+// in DTCM next to the stack. The interrupt only reads a row at a time.
+static uint8_t flash_buffers[FLASH_QUEUE_DEPTH][CFG_TUD_DFU_XFER_BUFSIZE] __attribute__((aligned(8)));
+
+#ifdef DFU_DIFF
+// Copy of a deferred sector's session data while it is erased. The erase
+// takes the only other copy, so this has to be able to hold a whole sector.
+static uint8_t diff_shadow[FLASH_SECTOR_SIZE] __attribute__((aligned(4)));
+#define DIFF_SHADOW_SIZE sizeof(diff_shadow)
+#else
+#define DIFF_SHADOW_SIZE 0u
+#endif
+
+#define SECTOR_WORDS  (FLASH_SECTOR_SIZE / FLASH_WRITE_SIZE)
+
+// Flash words of each deferred sector that hold this session's data. A
+// gap within [written_lo, written_hi) may still have stale data in it,
+// which an erase must not bring back.
+static uint32_t diff_written[FLASH_SECTOR_COUNT][SECTOR_WORDS / 32u];
+
+// The engine's share of the 512 KB of AXI SRAM (linker/bootloader.ld). The
+// rest is for TinyUSB's buffers (a DFU transfer among them), the trace ring
+// and everybody else's .data and .bss.
+#define FLASH_AXI_BUDGET (384u * 1024u)
+
+_Static_assert(sizeof(flash_buffers) + DIFF_SHADOW_SIZE + sizeof(diff_written) <= FLASH_AXI_BUDGET,
+               "flash engine buffers over budget, lower DFU_XFER_SIZE or FLASH_QUEUE_DEPTH, or build without DFU_DIFF");
+
+// Runs in the producer's (thread) context, like the CRC unit's other users
+static void flash_session_add(const uint8_t *data, uint32_t length) {
+    if (flash_ctx.session.restart) {
+        flash_ctx.session.crc     = 0;
+        flash_ctx.session.bytes   = 0;
+        flash_ctx.session.restart = false;
+    }
+
+    flash_ctx.session.crc    = crc32_update(flash_ctx.session.crc, data, length);
+    flash_ctx.session.bytes += length;
+}
+
+uint32_t flash_session_crc(uint32_t *bytes) {
+    *bytes = flash_ctx.session.bytes;
+    return flash_ctx.session.crc;
+}
+
+static inline uint8_t flash_queue_count(void) {
+    return (uint8_t)(flash_ctx.head - flash_ctx.tail);
+}
 
 void flash_init(void) {
-    flash_ctx.state = FLASH_OP_IDLE;
+    NVIC_DisableIRQ(FLASH_IRQn);
+
+    flash_ctx.state    = FLASH_OP_IDLE;
+    flash_ctx.head     = 0;
+    flash_ctx.tail     = 0;
+    flash_ctx.deferred = 0;
+    flash_ctx.erased   = 0;
+    flash_ctx.owner    = FLASH_OWNER_DFU;
+
+    for (uint32_t i = 0; i < FLASH_QUEUE_DEPTH; i++) {
+        flash_ctx.jobs[i].buffer = flash_buffers[i];
+    }
+
+    flash_ctx.session.crc     = 0;
+    flash_ctx.session.bytes   = 0;
+    flash_ctx.session.restart = false;
+
+    flash_ctx.time.erase = SECTOR_ERASE_MS_INIT;
+    flash_ctx.time.bank  = SECTOR_ERASE_MS_INIT * FLASH_SECTOR_COUNT;
+    flash_ctx.time.row   = ROW_PROGRAM_CYCLES_INIT;
 
     // Unlock flash bank 2 if not already
     if ((FLASH->CR2 & FLASH_CR_LOCK) != 0) {
         FLASH->KEYR2 = 0x45670123;
         FLASH->KEYR2 = 0xCDEF89AB;
     }
+
+    // Stale flags would fire the interrupt straight away
+    FLASH->CCR2 = FLASH_CCR_CLR_EOP | (FLASH->SR2 & FLASH_SR_ERRORS);
+    FLASH->CR2 |= FLASH_CR_IRQS;
+
+    NVIC_ClearPendingIRQ(FLASH_IRQn);
+    NVIC_SetPriority(FLASH_IRQn, FLASH_IRQ_PRIORITY);
+    NVIC_EnableIRQ(FLASH_IRQn);
+}
+
+// Default completion hook, overridden by the DfuSe layer
+__attribute__((weak))
+void flash_job_done_cb(flash_job_type_t type, uint32_t addr, flash_error_t err) {
+    (void) type;
+    (void) addr;
+    (void) err;
 }
 
-static uint8_t addr_to_sector(uint32_t addr) {
+static ITCM_FUNC uint8_t addr_to_sector(uint32_t addr) {
     // Bank 2 at 0x08100000, 128KB sectors
-    return ((addr - 0x08100000) / (128 * 1024)) & 0x7;
+    return ((addr - FLASH_BANK2_BASE) / FLASH_SECTOR_SIZE) & 0x7;
 }
 
-bool flash_erase_sector_async(uint32_t addr) {
-    if (flash_ctx.state != FLASH_OP_IDLE) {
-        return false; // busy
+static ITCM_FUNC uint32_t sector_base(uint32_t addr) {
+    return addr & ~(FLASH_SECTOR_SIZE - 1u);
+}
+
+// True if all bytes read back as the erased value. Uses 64-bit loads, four
+// per iteration, so a whole 128 KB sector is checked in a fraction of a
+// millisecond; len must be a multiple of 32.
+static ITCM_FUNC bool flash_is_blank(uint32_t addr, uint32_t len) {
+    const uint64_t *p   = (const uint64_t *)addr;
+    const uint64_t *end = (const uint64_t *)(addr + len);
+
+    while (p < end) {
+        if ((p[0] & p[1] & p[2] & p[3]) != UINT64_MAX) {
+            return false;
+        }
+        p += 4;
+    }
+    return true;
+}
+
+bool flash_sector_is_blank(uint32_t addr) {
+    return flash_is_blank(sector_base(addr), FLASH_SECTOR_SIZE);
+}
+
+void flash_read(uint8_t *dst, uint32_t addr, uint32_t length) {
+    // Blocks still in the write queue would read back as the old contents
+    flash_wait_idle();
+
+    // The AXI flash interface is 64 bits wide: four doubleword loads per
+    // flash word keep it busy, where byte loads waste 7/8 of every access.
+    // Only a head up to a doubleword boundary of flash goes byte by byte.
+    while ((addr & 7u) != 0 && length > 0) {
+        *dst++ = *(const uint8_t *)addr++;
+        length--;
+    }
+
+    // Volatile so the loop stays doubleword loads rather than becoming a
+    // memcpy call
+    const volatile uint64_t *src = (const volatile uint64_t *)addr;
+
+    for (; length >= FLASH_WRITE_SIZE; length -= FLASH_WRITE_SIZE) {
+        uint64_t w[4] = { src[0], src[1], src[2], src[3] };
+
+        // Word stores to RAM, unaligned ones included, run at full speed
+        // on the M7, so any dst alignment takes this path
+        memcpy(dst, w, sizeof(w));
+        src += 4;
+        dst += sizeof(w);
+    }
+
+    memcpy(dst, (const void *)src, length);
+}
+
+// True if a row of data only holds the erased value, so programming it
+// would leave an erased flash word unchanged
+static ITCM_FUNC bool row_is_blank(const uint8_t *src, uint32_t len) {
+    if (len == FLASH_WRITE_SIZE) {
+        const uint32_t *w = (const uint32_t *)src;
+        return (w[0] & w[1] & w[2] & w[3] & w[4] & w[5] & w[6] & w[7]) == UINT32_MAX;
+    }
+
+    for (uint32_t i = 0; i < len; i++) {
+        if (src[i] != 0xFF) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static ITCM_FUNC flash_job_t *flash_job_alloc(void) {
+    if (flash_queue_count() == FLASH_QUEUE_DEPTH) {
+        return NULL; // full
+    }
+
+    return &flash_ctx.jobs[flash_ctx.head % FLASH_QUEUE_DEPTH];
+}
+
+static ITCM_FUNC void flash_job_commit(void) {
+    flash_ctx.jobs[flash_ctx.head % FLASH_QUEUE_DEPTH].queued_at = dwt_cycles();
+
+    // Job contents must be visible before the engine can see the new head
+    __DMB();
+    flash_ctx.head++;
+
+    // Kick the engine, it takes the job from here
+    NVIC_SetPendingIRQ(FLASH_IRQn);
+}
+
+// Moving average over roughly the last 8 samples
+static ITCM_FUNC void flash_time_update(uint32_t *estimate, uint32_t sample) {
+    *estimate = *estimate - (*estimate >> 3) + (sample >> 3);
+}
+
+static ITCM_FUNC void flash_time_erase_done(void) {
+    trace_event(TRACE_ERASE_END, 0);
+
+    uint32_t elapsed = sched_ms() - flash_ctx.time.erase_start;
+    stats.erases++;
+    stats_hist(stats.erase_ms, elapsed);
+    flash_time_update(flash_ctx.time.is_bank ? &flash_ctx.time.bank : &flash_ctx.time.erase, elapsed);
+}
+
+// The controller has changed flash under the D-cache
+static ITCM_FUNC void flash_erase_done(void) {
+    flash_time_erase_done();
+    cache_invalidate(flash_ctx.erase_addr, flash_ctx.erase_size);
+}
+
+static ITCM_FUNC void flash_time_write_done(void) {
+    // A handful of rows averages out the interrupt latency
+    if (flash_ctx.time.rows >= 4) {
+        uint32_t elapsed = dwt_cycles() - flash_ctx.time.start;
+        flash_time_update(&flash_ctx.time.row, elapsed / flash_ctx.time.rows);
     }
+}
+
+static uint32_t cycles_to_ms(uint32_t cycles) {
+    return (cycles + CYCLES_PER_MS - 1u) / CYCLES_PER_MS;
+}
+
+static uint32_t rows_in(uint32_t length) {
+    return (length + FLASH_WRITE_SIZE - 1u) / FLASH_WRITE_SIZE;
+}
+
+// Time left on the erase in progress
+static uint32_t erase_ms_left(uint32_t estimate) {
+    uint32_t elapsed = sched_ms() - flash_ctx.time.erase_start;
+    return (elapsed < estimate) ? (estimate - elapsed) : 0;
+}
+
+uint32_t flash_erase_time_ms(uint8_t sectors) {
+    uint32_t n = __builtin_popcount(sectors);
+
+    if (sectors == FLASH_ALL_SECTORS) {
+        return flash_ctx.time.bank;
+    }
+    return n * flash_ctx.time.erase;
+}
+
+uint32_t flash_write_time_ms(uint32_t length) {
+    return cycles_to_ms(rows_in(length) * flash_ctx.time.row);
+}
+
+// Estimated time for the job at the queue tail, which the engine may be in
+// the middle of. The interrupt moves on underneath, so this is only ever an
+// estimate.
+static uint32_t flash_active_job_ms(const flash_job_t *job) {
+    switch (flash_ctx.state) {
+        case FLASH_OP_ERASE_BUSY:
+            return erase_ms_left(flash_ctx.time.is_bank ? flash_ctx.time.bank : flash_ctx.time.erase)
+                 + __builtin_popcount(job->sectors) * flash_ctx.time.erase;
+
+        case FLASH_OP_WRITE_BUSY:
+            return flash_write_time_ms(job->length - flash_ctx.offset);
+
+        case FLASH_OP_DIFF_ERASE_BUSY:
+            return erase_ms_left(flash_ctx.time.erase)
+                 + flash_write_time_ms(job->length - flash_ctx.offset);
+
+        case FLASH_OP_DIFF_RESTORE_BUSY:
+            return flash_write_time_ms(flash_ctx.written_hi[flash_ctx.restore_sector]
+                                       - flash_ctx.restore_offset)
+                 + flash_write_time_ms(job->length - flash_ctx.offset);
+
+        default:
+            break;
+    }
+
+    switch (job->type) {
+        case FLASH_JOB_ERASE: return flash_erase_time_ms(job->sectors);
+        case FLASH_JOB_WRITE: return flash_write_time_ms(job->length);
+        default:              return 0;
+    }
+}
+
+// At least 1 ms while busy, a 0 poll timeout would have the host spin
+static uint32_t flash_busy_ms(uint32_t ms) {
+    return (ms == 0 && flash_is_busy()) ? 1 : ms;
+}
+
+uint32_t flash_time_to_free_ms(void) {
+    if (flash_queue_count() < FLASH_QUEUE_DEPTH) {
+        return 0;
+    }
+
+    return flash_busy_ms(flash_active_job_ms(&flash_ctx.jobs[flash_ctx.tail % FLASH_QUEUE_DEPTH]));
+}
+
+uint32_t flash_time_to_idle_ms(void) {
+    uint8_t  tail = flash_ctx.tail;
+    uint8_t  head = flash_ctx.head;
+    uint32_t ms   = 0;
+
+    for (uint8_t i = tail; i != head; i++) {
+        const flash_job_t *job = &flash_ctx.jobs[i % FLASH_QUEUE_DEPTH];
+
+        if (i == tail) {
+            ms += flash_active_job_ms(job);
+        } else if (job->type == FLASH_JOB_ERASE) {
+            ms += flash_erase_time_ms(job->sectors);
+        } else if (job->type == FLASH_JOB_WRITE) {
+            ms += flash_write_time_ms(job->length);
+        }
+    }
+    return flash_busy_ms(ms);
+}
+
+static ITCM_FUNC void flash_job_pop(void) {
+    flash_job_t *job = &flash_ctx.jobs[flash_ctx.tail % FLASH_QUEUE_DEPTH];
+
+    flash_job_done_cb(job->type, job->addr, FLASH_ERR_NONE);
+    trace_event(TRACE_JOB_END, job->type);
+
+    if (job->type == FLASH_JOB_WRITE) {
+        stats.bytes_programmed += job->length;
+        stats_hist(stats.block_latency_us,
+                   (dwt_cycles() - job->queued_at) / (CPU_CLOCK_HZ / 1000000u));
+    }
+
+    flash_ctx.tail++;
+    flash_ctx.state = FLASH_OP_IDLE;
+}
+
+static void flash_stream_close(void);
+
+bool flash_erase_sectors_async(uint8_t sectors) {
+    flash_stream_close();
 
-    flash_ctx.addr = addr;
-    flash_ctx.state = FLASH_OP_ERASE_PENDING;
+    flash_job_t *job = flash_job_alloc();
+    if (job == NULL) {
+        return false; // queue full
+    }
+
+    job->type    = FLASH_JOB_ERASE;
+    job->addr    = FLASH_BANK2_BASE + __builtin_ctz(sectors | 0x100u) * FLASH_SECTOR_SIZE;
+    job->length  = 0;
+    job->sectors = sectors;
+    flash_job_commit();
     return true;
 }
 
-static bool flash_op_complete(void) {
+bool flash_erase_sector_async(uint32_t addr) {
+    return flash_erase_sectors_async(1u << addr_to_sector(addr));
+}
+
+static ITCM_FUNC bool flash_op_complete(void) {
     bool busy = FLASH->SR2 & FLASH_SR_QW;
     if (busy) return false;
 
     // If we were programming, clear EOP flag
     if (FLASH->SR2 & FLASH_SR_EOP) {
-        FLASH->CCR2 |= FLASH_CCR_CLR_EOP;
+        FLASH->CCR2 = FLASH_CCR_CLR_EOP;
     }
     return true;
 }
 
-bool flash_write_async(uint32_t addr, const uint8_t *data, uint16_t length) {
-    if (flash_ctx.state != FLASH_OP_IDLE) {
-        return false; // busy
+// Clear any error flags and drop everything still queued: the DfuSe layer
+// reports the error on the next GETSTATUS and the host has to start over.
+static ITCM_FUNC bool flash_check_error(void) {
+    uint32_t sr = FLASH->SR2 & FLASH_SR_ERRORS;
+    if (sr == 0) {
+        return false;
+    }
+    trace_event(TRACE_FLASH_ERROR, sr);
+    stats.flash_errors++;
+
+    flash_error_t err;
+    if (sr & FLASH_SR_WRPERR) {
+        err = FLASH_ERR_WRITE_PROTECT;
+    } else if (sr & FLASH_SR_OPERR) {
+        err = FLASH_ERR_OPERATION;
+    } else {
+        err = FLASH_ERR_PROGRAM;
+    }
+
+    FLASH->CCR2 = sr; // CLR_* bits share the SR bit positions
+    FLASH->CR2 &= ~(FLASH_CR_PG | FLASH_CR_SER | FLASH_CR_BER);
+
+    // Whatever was deferred is in an unknown state now, so stop trusting it,
+    // and the same goes for anything cached of bank 2
+    flash_ctx.deferred = 0;
+    flash_ctx.erased   = 0;
+    cache_invalidate(FLASH_BANK2_BASE, FLASH_SECTOR_COUNT * FLASH_SECTOR_SIZE);
+
+    if (flash_queue_count() != 0) {
+        flash_job_t *job = &flash_ctx.jobs[flash_ctx.tail % FLASH_QUEUE_DEPTH];
+        flash_job_done_cb(job->type, job->addr, err);
+    } else {
+        flash_job_done_cb(FLASH_JOB_WRITE, 0, err);
     }
 
-    // Copy data to internal buffer
-    memcpy(flash_ctx.buffer, data, length);
-    flash_ctx.addr = addr;
-    flash_ctx.length = length;
-    flash_ctx.offset = 0;
-    flash_ctx.state = FLASH_OP_WRITE_PENDING;
+    flash_ctx.tail  = flash_ctx.head;
+    flash_ctx.state = FLASH_OP_IDLE;
+
+#ifdef DEBUG_MEASURE
+    gpio_clearPin(PHONE_TXD);
+#endif
+    return true;
+}
+
+bool flash_finish_async(void) {
+    if (!flash_stream_flush()) {
+        return false;
+    }
+
+    flash_job_t *job = flash_job_alloc();
+    if (job == NULL) {
+        return false; // queue full
+    }
+
+    job->type   = FLASH_JOB_FINISH;
+    job->addr   = 0;
+    job->length = 0;
+    flash_job_commit();
+
+    flash_ctx.session.restart = true;
+    return true;
+}
+
+void flash_set_options(uint32_t options) {
+    flash_wait_idle();
+
+    // Settle deferred sectors under the options they were deferred with;
+    // forgetting them would leave stale data next to the session's
+    if (flash_ctx.deferred != 0 && flash_finish_async()) {
+        flash_wait_idle();
+    }
+
+    flash_ctx.options  = options & FLASH_OPTS_SUPPORTED;
+    flash_ctx.deferred = 0;
+    flash_ctx.erased   = 0;
+}
+
+uint32_t flash_get_options(void) {
+    return flash_ctx.options;
+}
+
+ITCM_FUNC void flash_set_owner(flash_owner_t owner) {
+    flash_ctx.owner = owner;
+}
+
+ITCM_FUNC flash_owner_t flash_get_owner(void) {
+    return flash_ctx.owner;
+}
+
+bool flash_write_async(uint32_t addr, const uint8_t *data, uint32_t length) {
+    if (length > CFG_TUD_DFU_XFER_BUFSIZE) {
+        return false;
+    }
+
+    flash_stream_close();
+
+    flash_job_t *job = flash_job_alloc();
+    if (job == NULL) {
+        return false; // queue full
+    }
+
+    // Copy data to the job buffer, the caller's buffer gets reused for the
+    // next block as soon as we return
+    memcpy(job->buffer, data, length);
+
+    job->type   = FLASH_JOB_WRITE;
+    job->addr   = addr;
+    job->length = length;
+    flash_session_add(job->buffer, length);
+
+#ifdef DEBUG_MEASURE
+    gpio_setPin(PHONE_TXD);
+#endif
+
+    flash_job_commit();
+    return true;
+}
+
+bool flash_stream_begin(uint32_t addr) {
+    if (!flash_stream_flush()) {
+        return false;
+    }
+
+    flash_ctx.stream.addr  = addr;
+    flash_ctx.stream.fill  = 0;
+    flash_ctx.stream.carry = 0;
+    return true;
+}
+
+uint8_t *flash_stream_space(uint32_t *space) {
+    if (!flash_ctx.stream.open) {
+        flash_job_t *job = flash_job_alloc();
+        if (job == NULL) {
+            return NULL; // queue full
+        }
+
+        // Pick up the start of a flash word split off by an earlier close
+        job->addr = flash_ctx.stream.addr - flash_ctx.stream.carry;
+        memcpy(job->buffer, flash_ctx.stream.row, flash_ctx.stream.carry);
+        flash_ctx.stream.fill  = flash_ctx.stream.carry;
+        flash_ctx.stream.carry = 0;
+        flash_ctx.stream.open  = true;
+    }
+
+    flash_job_t *job = &flash_ctx.jobs[flash_ctx.head % FLASH_QUEUE_DEPTH];
+    *space = CFG_TUD_DFU_XFER_BUFSIZE - flash_ctx.stream.fill;
+    return &job->buffer[flash_ctx.stream.fill];
+}
+
+static void flash_stream_submit(uint32_t length) {
+    flash_job_t *job = &flash_ctx.jobs[flash_ctx.head % FLASH_QUEUE_DEPTH];
+
+    job->type   = FLASH_JOB_WRITE;
+    job->length = length;
+    flash_ctx.stream.open = false;
 
 #ifdef DEBUG_MEASURE
     gpio_setPin(PHONE_TXD);
 #endif
+
+    flash_job_commit();
+}
+
+void flash_stream_commit(uint32_t length) {
+    flash_session_add(&flash_ctx.jobs[flash_ctx.head % FLASH_QUEUE_DEPTH].buffer[flash_ctx.stream.fill],
+                      length);
+
+    flash_ctx.stream.fill += length;
+    flash_ctx.stream.addr += length;
+
+    if (flash_ctx.stream.fill == CFG_TUD_DFU_XFER_BUFSIZE) {
+        flash_stream_submit(flash_ctx.stream.fill);
+    }
+}
+
+bool flash_stream_flush(void) {
+    uint32_t space;
+
+    // Reopening picks up a split flash word left behind by a close
+    if (!flash_ctx.stream.open && flash_ctx.stream.carry != 0 &&
+        flash_stream_space(&space) == NULL) {
+        return false;
+    }
+
+    if (flash_ctx.stream.open) {
+        if (flash_ctx.stream.fill != 0) {
+            flash_stream_submit(flash_ctx.stream.fill);
+        } else {
+            flash_ctx.stream.open = false;
+        }
+    }
+    return true;
+}
+
+// Another producer needs the queue: submit what the stream has, but keep a
+// trailing partial flash word back so it is programmed whole later on
+static void flash_stream_close(void) {
+    if (!flash_ctx.stream.open) {
+        return;
+    }
+
+    flash_job_t *job = &flash_ctx.jobs[flash_ctx.head % FLASH_QUEUE_DEPTH];
+    uint32_t whole = (job->addr + flash_ctx.stream.fill) & ~(FLASH_WRITE_SIZE - 1u);
+    uint32_t carry = (whole > job->addr) ? (job->addr + flash_ctx.stream.fill - whole)
+                                         : flash_ctx.stream.fill;
+
+    memcpy(flash_ctx.stream.row, &job->buffer[flash_ctx.stream.fill - carry], carry);
+    flash_ctx.stream.carry = carry;
+
+    if (flash_ctx.stream.fill > carry) {
+        flash_stream_submit(flash_ctx.stream.fill - carry);
+    } else {
+        flash_ctx.stream.open = false;
+    }
+}
+
+// Start a sector erase, EOP fires when it is done
+static ITCM_FUNC void flash_start_erase(uint8_t sector) {
+    /* Sector erase sequence */
+    flash_ctx.time.erase_start = sched_ms();
+    flash_ctx.time.is_bank     = false;
+    flash_ctx.erase_addr   = FLASH_BANK2_BASE + sector * FLASH_SECTOR_SIZE;
+    flash_ctx.erase_size   = FLASH_SECTOR_SIZE;
+    trace_event(TRACE_ERASE_START, sector);
+
+    // Set programming parallelism
+    FLASH->CR2 |= (FLASH_CR_PSIZE_1 | FLASH_CR_PSIZE_0);
+
+    // Sector number
+    FLASH->CR2 &= ~FLASH_CR_SNB;
+    FLASH->CR2 |= (sector << FLASH_CR_SNB_Pos);
+
+    // Sector erase command
+    FLASH->CR2 |= FLASH_CR_SER;
+
+    // Start
+    FLASH->CR2 |= FLASH_CR_START;
+}
+
+// Erase all of bank 2 in one operation
+static ITCM_FUNC void flash_start_bank_erase(void) {
+    flash_ctx.time.erase_start = sched_ms();
+    flash_ctx.time.is_bank     = true;
+    flash_ctx.erase_addr   = FLASH_BANK2_BASE;
+    flash_ctx.erase_size   = FLASH_SECTOR_COUNT * FLASH_SECTOR_SIZE;
+    trace_event(TRACE_ERASE_START, 0xFF);
+
+    FLASH->CR2 |= (FLASH_CR_PSIZE_1 | FLASH_CR_PSIZE_0);
+    FLASH->CR2 |= FLASH_CR_BER;
+    FLASH->CR2 |= FLASH_CR_START;
+}
+
+// Start erasing the lowest sector left in an erase job
+static ITCM_FUNC void flash_start_next_erase(flash_job_t *job) {
+    uint8_t sector = __builtin_ctz(job->sectors);
+
+    job->sectors &= ~(1u << sector);
+    flash_start_erase(sector);
+}
+
+// Push one row (or the <32 byte tail of a job) into the write buffer. PG must
+// be set and the controller idle.
+static ITCM_FUNC void flash_program_row(uint32_t addr, const uint8_t *data, uint32_t len) {
+    trace_event(TRACE_ROW, addr);
+    stats.rows_programmed++;
+
+    if (len == 32) {
+        // Write next 32-byte chunk (must be 32-byte aligned)
+        const uint32_t *src = (const uint32_t *)data;
+
+        // Write 8 words (32 bytes) - this fills the 256-bit write buffer
+        for (uint8_t i = 0; i < 8; i++) {
+            flash_store32(addr + 4u * i, src[i]);
+        }
+    }
+    else {
+        // Write remaining bytes (<32)
+        for (uint32_t i = 0; i < len; i++) {
+            flash_store8(addr + i, data[i]);
+        }
+    }
+
+    __ISB();
+    __DSB();
+}
+
+// Nothing of this session's in a deferred sector yet
+static ITCM_FUNC void diff_reset(uint8_t sector) {
+    flash_ctx.written_lo[sector] = FLASH_SECTOR_SIZE;
+    flash_ctx.written_hi[sector] = 0;
+    memset(diff_written[sector], 0, sizeof(diff_written[sector]));
+}
+
+#ifdef DFU_DIFF
+static ITCM_FUNC bool diff_is_written(uint8_t sector, uint32_t offset) {
+    uint32_t word = offset / FLASH_WRITE_SIZE;
+    return (diff_written[sector][word / 32u] & (1u << (word % 32u))) != 0;
+}
+#endif
+
+// Record this session's data in a deferred sector
+static ITCM_FUNC void diff_track(uint8_t sector, uint32_t addr, uint32_t len) {
+    uint32_t lo = addr - sector_base(addr);
+    uint32_t hi = lo + len;
+
+    if (lo < flash_ctx.written_lo[sector]) flash_ctx.written_lo[sector] = lo;
+    if (hi > flash_ctx.written_hi[sector]) flash_ctx.written_hi[sector] = hi;
+
+    for (uint32_t word = lo / FLASH_WRITE_SIZE; word * FLASH_WRITE_SIZE < hi; word++) {
+        diff_written[sector][word / 32u] |= (1u << (word % 32u));
+    }
+}
+
+// Whether every flash word of a deferred sector that this session hasn't
+// written is blank, i.e. the sector already looks exactly as if it had
+// been erased first
+static ITCM_FUNC bool diff_rest_is_blank(uint8_t sector) {
+    uint32_t base = FLASH_BANK2_BASE + sector * FLASH_SECTOR_SIZE;
+
+    for (uint32_t i = 0; i < SECTOR_WORDS / 32u; i++) {
+        uint32_t map  = diff_written[sector][i];
+        uint32_t addr = base + i * 32u * FLASH_WRITE_SIZE;
+
+        if (map == 0) {
+            if (!flash_is_blank(addr, 32u * FLASH_WRITE_SIZE)) {
+                return false;
+            }
+            continue;
+        }
+
+        for (uint32_t bit = 0; bit < 32u; bit++) {
+            if (!(map & (1u << bit))
+             && !flash_is_blank(addr + bit * FLASH_WRITE_SIZE, FLASH_WRITE_SIZE)) {
+                return false;
+            }
+        }
+    }
     return true;
 }
 
-void flash_process(void) {
+// A deferred sector has to be erased after all. Save what this session has
+// already put there (it matched or was programmed into blank rows), erase,
+// then program those flash words back before carrying on in resume_state.
+// Auto-erase uses it with an empty range, the only use without DFU_DIFF.
+static ITCM_FUNC void diff_erase(uint8_t sector, flash_op_state_t resume_state) {
+    uint32_t lo = flash_ctx.written_lo[sector];
+
+#ifdef DFU_DIFF
+    uint32_t base = FLASH_BANK2_BASE + sector * FLASH_SECTOR_SIZE;
+    uint32_t hi   = flash_ctx.written_hi[sector];
+
+    if (hi > lo) {
+        memcpy(diff_shadow, (const void *)(base + lo), hi - lo);
+    }
+#endif
+
+    FLASH->CR2 &= ~FLASH_CR_PG;
+    flash_start_erase(sector);
+
+    flash_ctx.restore_sector = sector;
+    flash_ctx.restore_offset = lo;
+    flash_ctx.resume_state   = resume_state;
+    flash_ctx.state          = FLASH_OP_DIFF_ERASE_BUSY;
+}
+
+// Advance the state machine by one step. Returns true if it can be stepped
+// again right away, false if it is idle or waiting for the controller (which
+// will raise EOP or an error flag when done).
+static ITCM_FUNC bool flash_step(void) {
+    flash_job_t *job = &flash_ctx.jobs[flash_ctx.tail % FLASH_QUEUE_DEPTH];
+
     switch (flash_ctx.state) {
         case FLASH_OP_IDLE:
-            // Nothing to do.
-            break;
-        
+            // Pick up the next queued job, if any
+            if (flash_queue_count() == 0) {
+                // An error can drop the queue with a row still in flight;
+                // its EOP must not keep the interrupt pending
+                flash_op_complete();
+                return false;
+            }
+
+            trace_event(TRACE_JOB_START, ((uint32_t)job->type << 24) | flash_queue_count());
+
+            flash_ctx.offset = 0;
+            switch (job->type) {
+                case FLASH_JOB_ERASE:  flash_ctx.state = FLASH_OP_ERASE_PENDING; break;
+                case FLASH_JOB_WRITE:  flash_ctx.state = FLASH_OP_WRITE_PENDING; break;
+                case FLASH_JOB_FINISH: flash_ctx.state = FLASH_OP_DIFF_FINISH;   break;
+            }
+            return true;
+
         case FLASH_OP_ERASE_PENDING:
+        {
             // Wait for any previous operation
             if (!flash_op_complete()) {
-                break;
+                return false;
             }
 
-            /* Sector erase sequence */
+            const bool whole_bank = (job->sectors == FLASH_ALL_SECTORS);
+            flash_ctx.erased |= job->sectors;
 
-            // Set programming parallelism
-            FLASH->CR2 |= (FLASH_CR_PSIZE_1 | FLASH_CR_PSIZE_0);
+            for (uint8_t sector = 0; sector < FLASH_SECTOR_COUNT; sector++) {
+                if ((job->sectors & (1u << sector)) == 0) {
+                    continue;
+                }
+
+                // An erase of a sector that is already blank is a no-op
+                if (flash_is_blank(FLASH_BANK2_BASE + sector * FLASH_SECTOR_SIZE, FLASH_SECTOR_SIZE)) {
+                    flash_ctx.deferred &= ~(1u << sector);
+                    job->sectors       &= ~(1u << sector);
+                    continue;
+                }
 
-            // Sector number
-            FLASH->CR2 &= ~FLASH_CR_SNB;
-            FLASH->CR2 |= (addr_to_sector(flash_ctx.addr) << FLASH_CR_SNB_Pos);
+                // In diff mode the erase waits until a row actually differs
+                if (flash_ctx.options & FLASH_OPT_DIFF) {
+                    flash_ctx.deferred |= (1u << sector);
+                    diff_reset(sector);
+                    job->sectors &= ~(1u << sector);
+                }
+            }
 
-            // Sector erase command
-            FLASH->CR2 |= FLASH_CR_SER;
+            if (job->sectors == 0) {
+                flash_job_pop();
+                return true;
+            }
 
-            // Start
-            FLASH->CR2 |= FLASH_CR_START;
+            // A bank erase takes one operation however many sectors need it
+            if (whole_bank && (job->sectors & (job->sectors - 1u)) != 0) {
+                job->sectors = 0;
+                flash_start_bank_erase();
+            } else {
+                flash_start_next_erase(job);
+            }
 
-            // Command is queued, hand back control
+            // Command is queued, EOP fires when it is done
             flash_ctx.state = FLASH_OP_ERASE_BUSY;
-            break;
+            return false;
+        }
 
         case FLASH_OP_ERASE_BUSY:
             // Erase command is queued, Check if erase completed
-            if (flash_op_complete()) {
-                FLASH->CR2 &= ~FLASH_CR_SER;
-                flash_ctx.state = FLASH_OP_IDLE;
+            if (!flash_op_complete()) {
+                return false;
             }
-            break;
-        
+
+            FLASH->CR2 &= ~(FLASH_CR_SER | FLASH_CR_BER);
+            flash_erase_done();
+
+            if (job->sectors != 0) {
+                flash_start_next_erase(job);
+                return false;
+            }
+
+            flash_job_pop();
+            return true;
+
         case FLASH_OP_WRITE_PENDING:
             // Wait for any previous operation
             if (!flash_op_complete()) {
-                break;
+                return false;
             }
 
             // Enable programming
@@ -127,88 +949,247 @@ void flash_process(void) {
             __ISB();
             __DSB();
 
+            flash_ctx.time.start = dwt_cycles();
+            flash_ctx.time.rows  = 0;
             flash_ctx.state = FLASH_OP_WRITE_BUSY;
-            __attribute__((fallthrough));
-            // Fall through to start first write
-        
+            return true;
+
         case FLASH_OP_WRITE_BUSY:
             // Don't write new data if queue still has pending operations
             if (!flash_op_complete()) {
-                break;
+                return false;
             }
 
-            if (flash_ctx.offset < flash_ctx.length) {
-                uint32_t remaining = flash_ctx.length - flash_ctx.offset;
+            if (flash_ctx.offset < job->length) {
+                uint32_t remaining = job->length - flash_ctx.offset;
+                uint32_t row_len   = (remaining >= 32) ? 32 : remaining;
+                uint32_t addr      = job->addr + flash_ctx.offset;
+                const uint8_t *src = &job->buffer[flash_ctx.offset];
+                uint8_t  sector    = addr_to_sector(addr);
 
-                if (remaining >= 32) {
-                    // Write next 32-byte chunk (must be 32-byte aligned)
-                    uint32_t *src = (uint32_t *)&flash_ctx.buffer[flash_ctx.offset];
-                    volatile uint32_t *dst = (volatile uint32_t *)(flash_ctx.addr + flash_ctx.offset);
+                // First write to a sector this download: erase it now
+                if ((flash_ctx.options & FLASH_OPT_AUTO_ERASE)
+                 && !(flash_ctx.erased & (1u << sector))) {
+                    flash_ctx.erased |= (1u << sector);
 
-                    // Write 8 words (32 bytes) - this fills the 256-bit write buffer
-                    for (uint8_t i = 0; i < 8; i++) {
-                        dst[i] = src[i];
-                    }
+                    if (!flash_is_blank(sector_base(addr), FLASH_SECTOR_SIZE)) {
+                        // Nothing of this session's in it yet, so the diff
+                        // erase has nothing to restore
+                        diff_reset(sector);
 
-                    flash_ctx.offset += 32;
+                        if (flash_ctx.options & FLASH_OPT_DIFF) {
+                            flash_ctx.deferred |= (1u << sector);
+                        } else {
+                            diff_erase(sector, FLASH_OP_WRITE_BUSY);
+                            return false;
+                        }
+                    }
                 }
-                else {
-                    // Write remaining bytes (<32)
-                    volatile uint8_t *dst = (volatile uint8_t *)(flash_ctx.addr + flash_ctx.offset);
-                    uint8_t *src = &flash_ctx.buffer[flash_ctx.offset];
 
-                    for (uint32_t i = 0; i < remaining; i++) {
-                        dst[i] = src[i];
+                if (flash_ctx.deferred & (1u << sector)) {
+                    // Erase still deferred: rows that already match cost
+                    // nothing, rows over blank flash can be programmed as
+                    // usual, anything else needs the erase after all
+                    if (memcmp((const void *)addr, src, row_len) == 0) {
+                        diff_track(sector, addr, row_len);
+                        flash_ctx.offset += row_len;
+                        stats.rows_skipped++;
+                        return true;
+                    }
+
+                    if (!flash_is_blank(addr & ~(FLASH_WRITE_SIZE - 1u), FLASH_WRITE_SIZE)) {
+                        diff_erase(sector, FLASH_OP_WRITE_BUSY);
+                        return false;
                     }
 
-                    flash_ctx.offset = flash_ctx.length;
+                    diff_track(sector, addr, row_len);
                 }
 
-                __ISB();
-                __DSB();
-            }
-            else {
-                // All data written to buffer
-                // Check if write buffer has uncommitted data
-                if (FLASH->SR2 & FLASH_SR_WBNE) {
-                    // Force write the partial buffer
-                    FLASH->CR2 |= FLASH_CR_FW;
-                    // This will cause QW to go high
-                    break; // Wait for force-write to complete
+                flash_ctx.offset += row_len;
+
+                // Padding over an erased flash word can be left out, the
+                // word stays programmable later on. Whether it is erased is
+                // read back: the sector may not have been erased this
+                // download.
+                if (row_is_blank(src, row_len)
+                 && flash_is_blank(addr & ~(FLASH_WRITE_SIZE - 1u), FLASH_WRITE_SIZE)) {
+                    stats.rows_skipped++;
+                    return true;
                 }
 
-                // No partial data, or force-write complete
-                if (flash_op_complete()) {
-                    FLASH->CR2 &= ~FLASH_CR_PG;
-                    flash_ctx.state = FLASH_OP_IDLE;
+                flash_program_row(addr, src, row_len);
+                flash_ctx.time.rows++;
+
+                // A full row sets QW and comes back through EOP. A partial
+                // one only sets WBNE, so go straight on to the force-write.
+                return flash_op_complete();
+            }
+
+            // All data written to buffer
+            // Check if write buffer has uncommitted data
+            if (FLASH->SR2 & FLASH_SR_WBNE) {
+                // Force write the partial buffer
+                trace_event(TRACE_FORCE_WRITE, job->addr + flash_ctx.offset);
+                FLASH->CR2 |= FLASH_CR_FW;
+                // This will cause QW to go high, wait for EOP
+                return false;
+            }
+
+            // No partial data, or force-write complete. The rows were
+            // stored through the write-through cache already; drop them all
+            // the same, so whatever is cached was read back from flash.
+            FLASH->CR2 &= ~FLASH_CR_PG;
+            flash_time_write_done();
+            cache_invalidate(job->addr, job->length);
+            flash_job_pop();
 
 #ifdef DEBUG_MEASURE
-                    gpio_clearPin(PHONE_TXD);
+            if (flash_queue_count() == 0) {
+                gpio_clearPin(PHONE_TXD);
+            }
 #endif
+            return true;
+
+        case FLASH_OP_DIFF_ERASE_BUSY:
+        {
+            if (!flash_op_complete()) {
+                return false;
+            }
+
+            uint8_t sector = flash_ctx.restore_sector;
+
+            FLASH->CR2 &= ~FLASH_CR_SER;
+            flash_ctx.deferred &= ~(1u << sector);
+            flash_erase_done();
+
+            FLASH->CR2 |= FLASH_CR_PG;
+            __ISB();
+            __DSB();
+
+            flash_ctx.state = FLASH_OP_DIFF_RESTORE_BUSY;
+            return true;
+        }
+
+        case FLASH_OP_DIFF_RESTORE_BUSY:
+        {
+            if (!flash_op_complete()) {
+                return false;
+            }
+
+            uint8_t  sector = flash_ctx.restore_sector;
+            uint32_t base   = FLASH_BANK2_BASE + sector * FLASH_SECTOR_SIZE;
+            uint32_t lo     = flash_ctx.written_lo[sector];
+            uint32_t hi     = flash_ctx.written_hi[sector];
+
+#ifdef DFU_DIFF
+            if (flash_ctx.restore_offset < hi) {
+                uint32_t remaining = hi - flash_ctx.restore_offset;
+                uint32_t row_len   = (remaining >= 32) ? 32 : remaining;
+                const uint8_t *src = &diff_shadow[flash_ctx.restore_offset - lo];
+                uint32_t addr      = base + flash_ctx.restore_offset;
+                bool     written   = diff_is_written(sector, flash_ctx.restore_offset);
+
+                flash_ctx.restore_offset += row_len;
+
+                // Words the session didn't write stay erased. So do blank
+                // ones, the sector has just been erased.
+                if (!written) {
+                    return true;
                 }
+                if (row_is_blank(src, row_len)) {
+                    stats.rows_skipped++;
+                    return true;
+                }
+
+                flash_program_row(addr, src, row_len);
+                return flash_op_complete();
             }
-            break;
+#endif
+
+            if (FLASH->SR2 & FLASH_SR_WBNE) {
+                trace_event(TRACE_FORCE_WRITE, base + flash_ctx.restore_offset);
+                FLASH->CR2 |= FLASH_CR_FW;
+                return false;
+            }
+
+            // Sector is back to what the session wrote, carry on
+            cache_invalidate(base + lo, hi - lo);
+            if (flash_ctx.resume_state != FLASH_OP_WRITE_BUSY) {
+                FLASH->CR2 &= ~FLASH_CR_PG;
+            }
+            // The erase ran in the middle of the write measurement
+            flash_ctx.time.start = dwt_cycles();
+            flash_ctx.time.rows  = 0;
+
+            flash_ctx.state = flash_ctx.resume_state;
+            return true;
+        }
+
+        case FLASH_OP_DIFF_FINISH:
+            if (!flash_op_complete()) {
+                return false;
+            }
+
+            // Settle the sectors whose erase is still deferred: one is
+            // done once everything this session didn't write is blank
+            while (flash_ctx.deferred != 0) {
+                uint8_t sector = __builtin_ctz(flash_ctx.deferred);
+
+                if (diff_rest_is_blank(sector)) {
+                    flash_ctx.deferred &= ~(1u << sector);
+                    continue;
+                }
+
+                diff_erase(sector, FLASH_OP_DIFF_FINISH);
+                return false;
+            }
+
+            // The next download starts with a clean slate
+            flash_ctx.erased = 0;
+            flash_job_pop();
+            return true;
     }
+
+    return false;
+}
+
+// Raised on EOP (QW cleared) and on any error flag, and pended by software
+// whenever a new job is queued
+ITCM_FUNC void FLASH_IRQHandler(void) {
+    if (flash_check_error()) {
+        return;
+    }
+
+    while (flash_step()) { }
 }
 
 bool flash_is_busy(void) {
-    return flash_ctx.state != FLASH_OP_IDLE;
+    return flash_queue_count() != 0;
+}
+
+bool flash_queue_full(void) {
+    return flash_queue_count() == FLASH_QUEUE_DEPTH;
 }
 
 flash_op_state_t flash_get_state(void) {
     return flash_ctx.state;
 }
 
-void flash_erase_sector_blocking(uint32_t addr) {
-    flash_erase_sector_async(addr);
+// Interrupts must be enabled
+void flash_wait_idle(void) {
     while (flash_is_busy()) {
-        flash_process();
+        flash_wait_event();
     }
 }
 
-void flash_write_blocking(uint32_t addr, const uint8_t *data, uint16_t length) {
+void flash_erase_sector_blocking(uint32_t addr) {
+    flash_wait_idle();
+    flash_erase_sector_async(addr);
+    flash_wait_idle();
+}
+
+void flash_write_blocking(uint32_t addr, const uint8_t *data, uint32_t length) {
+    flash_wait_idle();
     flash_write_async(addr, data, length);
-    while (flash_is_busy()) {
-        flash_process();
-    }
+    flash_wait_idle();
 }
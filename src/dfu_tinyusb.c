@@ -3,18 +3,45 @@
 
 #include "tusb.h"
 #include "tusb_config.h"
+#include "crc.h"
 #include "dfu_flash.h"
+#include "heatshrink.h"
+#include "stats.h"
+#include "trace.h"
+#include "msc_flash.h"
+#include "sched.h"
+#include "sections.h"
+#include "slots.h"
+#include "vendor_flash.h"
 #include "debug.h"
 
 #define APP_BASE_ADDR 0x08100000
 
+// Whole internal flash, both banks
+#define FLASH_MEM_BASE 0x08000000u
+#define FLASH_MEM_SIZE (2u * 1024u * 1024u)
+
+// Alternate settings, see usb_descriptors.c
+#define DFU_ALT_FLASH      0 // plain image
+#define DFU_ALT_HEATSHRINK 1 // heatshrink-compressed image, inflated on the fly
+
 #define DFUSE_CMD_GET_COMMANDS 0x00
 #define DFUSE_CMD_SET_ADDRESS  0x21
 #define DFUSE_CMD_ERASE        0x41
 
+// Vendor extensions
+#define DFUSE_CMD_SET_OPTIONS  0xB1 // 1 byte of FLASH_OPT_* flags
+#define DFUSE_CMD_CRC          0xB2 // session CRC, or addr + length of a range
+#define DFUSE_CMD_ACTIVATE     0xB3 // 1 byte slot number, see slots.h
+#define DFUSE_CMD_REVOKE       0xB4 // 1 byte slot number
+
 static const uint8_t dfuse_cmds[] = { DFUSE_CMD_GET_COMMANDS,
                                       DFUSE_CMD_SET_ADDRESS,
-                                      DFUSE_CMD_ERASE };
+                                      DFUSE_CMD_ERASE,
+                                      DFUSE_CMD_SET_OPTIONS,
+                                      DFUSE_CMD_CRC,
+                                      DFUSE_CMD_ACTIVATE,
+                                      DFUSE_CMD_REVOKE };
 
 // DfuSe emulation
 typedef enum {
@@ -22,6 +49,9 @@ typedef enum {
     DFUSE_OP_ERASE_BUSY,
     DFUSE_OP_WRITE_BUSY,
     DFUSE_OP_SET_ADDR_BUSY,
+    DFUSE_OP_OPTIONS_BUSY,
+    DFUSE_OP_CRC_BUSY,
+    DFUSE_OP_SLOT_BUSY,
 } dfuse_op_t;
 
 static struct {
@@ -29,27 +59,79 @@ static struct {
     bool       have_addr;
 
     dfuse_op_t op;
-    uint32_t   current_addr;  // addr of active erase/write
+    uint32_t   current_addr;  // addr of active write
+    uint8_t    erase_sectors; // sectors of active erase
+    bool       queued;        // active erase (or slot switch finish job) made
+                              // it into the flash queue
+    bool       finishing;     // end-of-download job is queued
+    uint32_t   block_polls;   // GETSTATUS requests for the current data block
+
+    volatile flash_error_t flash_error; // latched by flash_job_done_cb()
 
     bool last_was_get_cmds;   // to answer UPLOAD after 0x00 command
-} dfuse_ctx;
+    bool crc_ready;           // to answer UPLOAD after 0xB2 command
+    uint32_t crc_result;
+    uint32_t crc_length;
+
+    // Compressed download (alt 1). Addresses the host sends are offsets into
+    // the compressed file, while the decoder output goes to flash in sequence.
+    struct {
+        bool     active;      // stream open, decoder state valid
+        bool     restart;     // SetAddress asked for a new stream
+        uint32_t next_addr;   // host address that continues the stream
+        uint32_t out_addr;    // flash address of the next decoded byte
+        uint16_t in_pos;      // bytes of the current block already decoded
+        uint8_t  refused;     // dfu_status_t the output was refused with
+    } z;
+} dfuse_ctx DTCM_BSS;
+
+static hs_decoder_t dfuse_hs;
 
 // TinyUSB device callbacks
 
 void tud_mount_cb(void) {
-    flash_init();
+    stats.usb_mounts++;
 
     dfuse_ctx.base_addr         = APP_BASE_ADDR;
     dfuse_ctx.have_addr         = true;
     dfuse_ctx.op                = DFUSE_OP_IDLE;
     dfuse_ctx.current_addr      = 0;
+    dfuse_ctx.queued            = false;
+    dfuse_ctx.finishing         = false;
+    dfuse_ctx.flash_error       = FLASH_ERR_NONE;
     dfuse_ctx.last_was_get_cmds = false;
+    dfuse_ctx.crc_ready         = false;
+    dfuse_ctx.z.active          = false;
+    dfuse_ctx.z.restart         = false;
 }
 
 void tud_umount_cb(void) {
 
 }
 
+// Flash engine completion, runs in the FLASH interrupt. Goes to the session
+// that queued the job, the others don't see another one's errors.
+ITCM_FUNC void flash_job_done_cb(flash_job_type_t type, uint32_t addr, flash_error_t err) {
+    switch (flash_get_owner()) {
+        case FLASH_OWNER_DFU:
+            // Keep the first error until GETSTATUS reports it
+            if (err != FLASH_ERR_NONE && dfuse_ctx.flash_error == FLASH_ERR_NONE) {
+                dfuse_ctx.flash_error = err;
+            }
+            break;
+
+        case FLASH_OWNER_VENDOR:
+            vendor_job_done_cb(type, addr, err);
+            break;
+
+        case FLASH_OWNER_MSC:
+            msc_job_done_cb(type, addr, err);
+            break;
+    }
+
+    sched_post(SCHED_EV_FLASH);
+}
+
 // Patched TinyUSB doesn't use this callback anymore, return 0
 // The real bwPollTimeout is set via tud_dfu_get_status_cb
 uint32_t tud_dfu_get_timeout_cb(uint8_t alt, uint8_t state) {
@@ -57,22 +139,135 @@ uint32_t tud_dfu_get_timeout_cb(uint8_t alt, uint8_t state) {
     return 0;
 }
 
+static bool dfuse_in_bank2(uint32_t addr, uint32_t length) {
+    const uint32_t size = FLASH_SECTOR_COUNT * FLASH_SECTOR_SIZE;
+
+    return addr >= FLASH_BANK2_BASE && length <= size
+        && addr - FLASH_BANK2_BASE <= size - length;
+}
+
+// Only bank 2 is writable (not the bootloader, not STATS_ADDR), and not the
+// slot the bootloader would start
+static ITCM_FUNC dfu_status_t dfuse_check_range(uint32_t addr, uint32_t length) {
+    if (!dfuse_in_bank2(addr, length)) {
+        return DFU_STATUS_ERR_ADDRESS;
+    }
+    return slot_overlaps_active(addr, length) ? DFU_STATUS_ERR_WRITE : DFU_STATUS_OK;
+}
+
+// Inflate a compressed block into the flash stream. Returns false when the
+// flash queue filled up first; call again with the same block to carry on.
+// Output that would land outside what dfuse_check_range() allows is dropped
+// and z.refused set.
+static ITCM_FUNC bool dfuse_inflate_block(const uint8_t *buffer, uint16_t length) {
+    for (;;) {
+        uint32_t space;
+        uint8_t *out = flash_stream_space(&space);
+        if (out == NULL) {
+            return false;
+        }
+
+        uint32_t used;
+        uint32_t produced = hs_decode(&dfuse_hs, &buffer[dfuse_ctx.z.in_pos],
+                                      length - dfuse_ctx.z.in_pos, &used, out, space);
+        dfuse_ctx.z.in_pos += (uint16_t)used;
+
+        if (produced > 0) {
+            dfuse_ctx.z.refused = dfuse_check_range(dfuse_ctx.z.out_addr, produced);
+            if (dfuse_ctx.z.refused != DFU_STATUS_OK) {
+                return true;
+            }
+        }
+        flash_stream_commit(produced);
+        dfuse_ctx.z.out_addr += produced;
+
+        // Output to spare means the decoder ran out of input
+        if (produced < space) {
+            return true;
+        }
+    }
+}
+
+// Queue a data block for the current alt setting
+static ITCM_FUNC bool dfuse_write_block(uint8_t alt, uint32_t addr, const uint8_t *buffer, uint16_t length) {
+    // TinyUSB receives into its own transfer buffer, so the block is copied
+    // into a flash job once
+    if (alt == DFU_ALT_FLASH) {
+        return flash_write_async(addr, buffer, length);
+    }
+
+    if (!dfuse_ctx.z.active) {
+        return false; // no SetAddress yet, nothing to continue
+    }
+
+    if (!dfuse_inflate_block(buffer, length)) {
+        return false;
+    }
+
+    dfuse_ctx.z.next_addr = addr + length;
+    return true;
+}
+
+// Turn the address list of an erase command into a sector mask. No
+// addresses means a mass erase, which leaves out the slot the bootloader
+// would start. Only bank 2 may be erased, and not that slot.
+static dfu_status_t dfuse_erase_sectors(const uint8_t *list, uint16_t length, uint8_t *sectors) {
+    if (length == 0) {
+        *sectors = FLASH_ALL_SECTORS & ~slot_active_sectors();
+        return DFU_STATUS_OK;
+    }
+
+    if (length % 4u != 0) {
+        return DFU_STATUS_ERR_ADDRESS;
+    }
+
+    *sectors = 0;
+    for (uint16_t i = 0; i < length; i += 4) {
+        uint32_t addr =  (uint32_t)list[i]
+                      | ((uint32_t)list[i + 1] << 8)
+                      | ((uint32_t)list[i + 2] << 16)
+                      | ((uint32_t)list[i + 3] << 24);
+
+        if (!dfuse_in_bank2(addr, 1)) {
+            return DFU_STATUS_ERR_ADDRESS;
+        }
+
+        *sectors |= 1u << ((addr - FLASH_BANK2_BASE) / FLASH_SECTOR_SIZE);
+    }
+    return (*sectors & slot_active_sectors()) ? DFU_STATUS_ERR_WRITE : DFU_STATUS_OK;
+}
+
+static ITCM_FUNC void dfuse_block_taken(void) {
+    stats.blocks++;
+    stats_hist(stats.getstatus_per_block, dfuse_ctx.block_polls);
+}
+
 // Helper to write bwPollTimeout in the DFU status response
-static void set_poll_timeout(dfu_status_response_t *resp, uint32_t ms) {
+static ITCM_FUNC void set_poll_timeout(dfu_status_response_t *resp, uint32_t ms) {
     resp->bwPollTimeout[0] = (uint8_t)((ms >>  0) & 0xff);
     resp->bwPollTimeout[1] = (uint8_t)((ms >>  8) & 0xff);
     resp->bwPollTimeout[2] = (uint8_t)((ms >> 16) & 0xff);
 }
 
+// Decoder output was refused: report it, the stream can't go on from here
+static ITCM_FUNC bool dfuse_stream_refused(dfu_status_response_t *resp) {
+    dfuse_ctx.z.active = false;
+
+    resp->bStatus = dfuse_ctx.z.refused;
+    resp->bState  = DFU_ERROR;
+    set_poll_timeout(resp, 0);
+    return true;
+}
+
 // DfuSe-style GETSTATUS handling
-bool tud_dfu_get_status_cb(uint8_t alt, tud_dfu_get_status_request_t const *req, dfu_status_response_t *resp, tud_dfu_get_status_control_t *ctl) {
+static ITCM_FUNC bool dfuse_get_status(uint8_t alt, tud_dfu_get_status_request_t const *req, dfu_status_response_t *resp, tud_dfu_get_status_control_t *ctl) {
     CDC_LOG("get_status_cb: alt=%u state=%u block=%u length=%u\r\n", alt, (unsigned)req->state, req->block, req->length);
     // Default: no extra callbacks. For alt 0/DfuSe we never want tud_dfu_download_cb().
     ctl->invoke_download = false;
     ctl->invoke_manifest = false;
 
-    // DfuSe emulation only on alt 0; let TinyUSB handle other alts normally
-    if (alt != 0) {
+    // DfuSe emulation on both alts; let TinyUSB handle anything else normally
+    if (alt != DFU_ALT_FLASH && alt != DFU_ALT_HEATSHRINK) {
         return false;
     }
 
@@ -83,10 +278,30 @@ bool tud_dfu_get_status_cb(uint8_t alt, tud_dfu_get_status_request_t const *req,
 
     // Start from TinyUSB's current idea of status/state; we'll overwrite.
 
+    // A download request makes this the engine's session
+    if (state == DFU_DNLOAD_SYNC) {
+        flash_set_owner(FLASH_OWNER_DFU);
+    }
+
+    // Flash errors from write-behind blocks surface on the next GETSTATUS
+    flash_error_t err = dfuse_ctx.flash_error;
+    if (err != FLASH_ERR_NONE) {
+        dfuse_ctx.flash_error = FLASH_ERR_NONE;
+        CDC_LOG("  Flash error %u\r\n", (unsigned)err);
+        dfuse_ctx.op = DFUSE_OP_IDLE;
+
+        resp->bStatus = (err == FLASH_ERR_WRITE_PROTECT) ? DFU_STATUS_ERR_WRITE
+                                                         : DFU_STATUS_ERR_PROG;
+        resp->bState  = DFU_ERROR;
+        set_poll_timeout(resp, 0);
+        return true;
+    }
+
     // DfuSe GetCommands: DNLOAD block 0, len=1, 0x00, then UPLOAD block 0.
     if (block == 0 && length == 1 && buffer[0] == DFUSE_CMD_GET_COMMANDS) {
         CDC_LOG("  GetCommands\r\n");
         dfuse_ctx.last_was_get_cmds = true;
+        dfuse_ctx.crc_ready         = false;
 
         resp->bStatus = DFU_STATUS_OK;
         resp->bState  = DFU_DNLOAD_IDLE;
@@ -109,6 +324,13 @@ bool tud_dfu_get_status_cb(uint8_t alt, tud_dfu_get_status_request_t const *req,
             dfuse_ctx.have_addr = true;
             dfuse_ctx.op        = DFUSE_OP_SET_ADDR_BUSY;
 
+            // dfu-util sends SetAddress before every chunk; only an address
+            // that doesn't follow on from the last block starts a new stream
+            if (alt == DFU_ALT_HEATSHRINK) {
+                dfuse_ctx.z.restart = !dfuse_ctx.z.active
+                                   || addr != dfuse_ctx.z.next_addr;
+            }
+
             resp->bStatus = DFU_STATUS_OK;
             resp->bState  = DFU_DNBUSY;
             set_poll_timeout(resp, 0);
@@ -118,6 +340,22 @@ bool tud_dfu_get_status_cb(uint8_t alt, tud_dfu_get_status_request_t const *req,
 
         // Subsequent GETSTATUS after we already reported DNBUSY
         if (state == DFU_DNBUSY && dfuse_ctx.op == DFUSE_OP_SET_ADDR_BUSY) {
+            if (alt == DFU_ALT_HEATSHRINK && dfuse_ctx.z.restart) {
+                // Flushing the previous stream needs a free queue slot
+                if (!flash_stream_begin(dfuse_ctx.base_addr)) {
+                    resp->bStatus = DFU_STATUS_OK;
+                    resp->bState  = DFU_DNBUSY;
+                    set_poll_timeout(resp, flash_time_to_free_ms());
+                    return true;
+                }
+
+                hs_decoder_reset(&dfuse_hs);
+                dfuse_ctx.z.restart   = false;
+                dfuse_ctx.z.active    = true;
+                dfuse_ctx.z.next_addr = dfuse_ctx.base_addr;
+                dfuse_ctx.z.out_addr  = dfuse_ctx.base_addr;
+            }
+
             // We're done
             dfuse_ctx.op = DFUSE_OP_IDLE;
 
@@ -129,48 +367,65 @@ bool tud_dfu_get_status_cb(uint8_t alt, tud_dfu_get_status_request_t const *req,
         }
     }
 
-    // DfuSe Erase: DNLOAD block 0, len=5, 0x41, addr bytes
+    // DfuSe Erase: DNLOAD block 0, 0x41 followed by
+    //   nothing       mass erase, i.e. all of bank 2
+    //   addr bytes    erase the sector holding addr
+    //   n addresses   erase list extension: all of those sectors in one go
     // Erase starts with first GETSTATUS (state == DFU_DNLOAD_SYNC)
     // Subsequent GETSTATUS poll until flash_is_busy() == false
     if (block == 0 && length >= 1 && buffer[0] == DFUSE_CMD_ERASE)  {
         // First GETSTATUS after DNLOAD: state is DFU_DNLOAD_SYNC
         if (state == DFU_DNLOAD_SYNC) {
-            if (length != 5) {
-                // mas erase not implemented; report error
-                resp->bStatus = DFU_STATUS_ERR_TARGET;
-                resp->bState  = DFU_ERROR;
-                set_poll_timeout(resp, 0);
-                return true;
-            }
+            uint8_t      sectors;
+            dfu_status_t status = dfuse_erase_sectors(&buffer[1], length - 1u, &sectors);
 
-            uint32_t addr =  (uint32_t)buffer[1]
-                          | ((uint32_t)buffer[2] << 8)
-                          | ((uint32_t)buffer[3] << 16)
-                          | ((uint32_t)buffer[4] << 24);
-            CDC_LOG("  EraseSector: addr=%08" PRIX32 "\r\n", addr);
-            
-            if (!flash_erase_sector_async(addr)) {
-                resp->bStatus = DFU_STATUS_ERR_ADDRESS;
+            if (status != DFU_STATUS_OK) {
+                resp->bStatus = status;
                 resp->bState  = DFU_ERROR;
                 set_poll_timeout(resp, 0);
                 return true;
             }
+            CDC_LOG("  Erase: sectors=%02X\r\n", sectors);
+
+            // Wake the host when the blocks queued ahead of the erase and
+            // the erase itself should be done. The engine skips sectors that
+            // are already blank, and diff mode defers the erase.
+            uint32_t timeout = flash_time_to_idle_ms();
+            if (!(flash_get_options() & FLASH_OPT_DIFF)) {
+                uint8_t dirty = 0;
+                for (uint8_t i = 0; i < FLASH_SECTOR_COUNT; i++) {
+                    if ((sectors & (1u << i))
+                     && !flash_sector_is_blank(FLASH_BANK2_BASE + i * FLASH_SECTOR_SIZE)) {
+                        dirty |= (1u << i);
+                    }
+                }
+
+                // Mirrors the engine's choice of a bank erase
+                if (sectors == FLASH_ALL_SECTORS && (dirty & (dirty - 1u)) != 0) {
+                    dirty = FLASH_ALL_SECTORS;
+                }
+                timeout += flash_erase_time_ms(dirty);
+            }
 
-            dfuse_ctx.op           = DFUSE_OP_ERASE_BUSY;
-            dfuse_ctx.current_addr = addr;
+            // If the queue is still full of data blocks, queue it on a later poll
+            dfuse_ctx.op            = DFUSE_OP_ERASE_BUSY;
+            dfuse_ctx.erase_sectors = sectors;
+            dfuse_ctx.queued        = flash_erase_sectors_async(sectors);
 
             resp->bStatus = DFU_STATUS_OK;
             resp->bState  = DFU_DNBUSY;
+            set_poll_timeout(resp, timeout);
 
-            // Measured ~844ms; use 900ms as a safe value
-            set_poll_timeout(resp, 900);
-            
             return true;
         }
 
         // Subsequent GETSTATUS after we already reported DNBUSY
         if (state == DFU_DNBUSY && dfuse_ctx.op == DFUSE_OP_ERASE_BUSY) {
-            if (!flash_is_busy()) {
+            if (!dfuse_ctx.queued) {
+                dfuse_ctx.queued = flash_erase_sectors_async(dfuse_ctx.erase_sectors);
+            }
+
+            if (dfuse_ctx.queued && !flash_is_busy()) {
                 // Erase complete
                 dfuse_ctx.op = DFUSE_OP_IDLE;
 
@@ -178,16 +433,142 @@ bool tud_dfu_get_status_cb(uint8_t alt, tud_dfu_get_status_request_t const *req,
                 resp->bState  = DFU_DNLOAD_IDLE;
                 set_poll_timeout(resp, 0);
             } else {
-                // Still erasing, ask host to poll again later
+                // Still erasing, ask host to poll again when it should be done
                 resp->bStatus = DFU_STATUS_OK;
                 resp->bState  = DFU_DNBUSY;
-                set_poll_timeout(resp, 20);
+                set_poll_timeout(resp, flash_time_to_idle_ms());
             }
 
             return true;
         }
     }
 
+    // Engine options: DNLOAD block 0, len=2, 0xB1, flags
+    // Only applied once everything queued under the old options is done
+    if (block == 0 && length == 2 && buffer[0] == DFUSE_CMD_SET_OPTIONS) {
+        if (state == DFU_DNLOAD_SYNC
+         || (state == DFU_DNBUSY && dfuse_ctx.op == DFUSE_OP_OPTIONS_BUSY)) {
+            if (flash_is_busy()) {
+                dfuse_ctx.op = DFUSE_OP_OPTIONS_BUSY;
+
+                resp->bStatus = DFU_STATUS_OK;
+                resp->bState  = DFU_DNBUSY;
+                set_poll_timeout(resp, flash_time_to_idle_ms());
+                return true;
+            }
+
+            CDC_LOG("  SetOptions: %02X\r\n", buffer[1]);
+            dfuse_ctx.op = DFUSE_OP_IDLE;
+
+            // Diff mode may have been left out of the build
+            if (buffer[1] & ~FLASH_OPTS_SUPPORTED) {
+                resp->bStatus = DFU_STATUS_ERR_VENDOR;
+                resp->bState  = DFU_ERROR;
+                set_poll_timeout(resp, 0);
+                return true;
+            }
+            flash_set_options(buffer[1]);
+
+            resp->bStatus = DFU_STATUS_OK;
+            resp->bState  = DFU_DNLOAD_IDLE;
+            set_poll_timeout(resp, 0);
+            return true;
+        }
+    }
+
+    // On-device CRC: DNLOAD block 0, len=1, 0xB2 for the CRC of the data
+    // written since the last download finished, or len=9, 0xB2, addr bytes,
+    // length bytes for the CRC of a flash range. UPLOAD block 0 then returns
+    // the CRC and the number of bytes it covers, little endian.
+    if (block == 0 && (length == 1 || length == 9) && buffer[0] == DFUSE_CMD_CRC) {
+        if (state == DFU_DNLOAD_SYNC
+         || (state == DFU_DNBUSY && dfuse_ctx.op == DFUSE_OP_CRC_BUSY)) {
+            // Let queued blocks reach flash first, so errors are reported
+            // and a range CRC sees the new contents
+            if (flash_is_busy()) {
+                dfuse_ctx.op = DFUSE_OP_CRC_BUSY;
+
+                resp->bStatus = DFU_STATUS_OK;
+                resp->bState  = DFU_DNBUSY;
+                set_poll_timeout(resp, flash_time_to_idle_ms());
+                return true;
+            }
+
+            dfuse_ctx.op                = DFUSE_OP_IDLE;
+            dfuse_ctx.last_was_get_cmds = false;
+
+            if (length == 1) {
+                dfuse_ctx.crc_result = flash_session_crc(&dfuse_ctx.crc_length);
+            } else {
+                uint32_t addr =  (uint32_t)buffer[1]
+                              | ((uint32_t)buffer[2] << 8)
+                              | ((uint32_t)buffer[3] << 16)
+                              | ((uint32_t)buffer[4] << 24);
+                uint32_t len  =  (uint32_t)buffer[5]
+                              | ((uint32_t)buffer[6] << 8)
+                              | ((uint32_t)buffer[7] << 16)
+                              | ((uint32_t)buffer[8] << 24);
+
+                if (addr < FLASH_MEM_BASE || len > FLASH_MEM_SIZE
+                 || addr - FLASH_MEM_BASE > FLASH_MEM_SIZE - len) {
+                    dfuse_ctx.crc_ready = false;
+
+                    resp->bStatus = DFU_STATUS_ERR_ADDRESS;
+                    resp->bState  = DFU_ERROR;
+                    set_poll_timeout(resp, 0);
+                    return true;
+                }
+
+                dfuse_ctx.crc_result = crc32_update(0, (const void *)addr, len);
+                dfuse_ctx.crc_length = len;
+            }
+
+            CDC_LOG("  Crc: %08" PRIX32 " over %" PRIu32 "\r\n",
+                    dfuse_ctx.crc_result, dfuse_ctx.crc_length);
+            dfuse_ctx.crc_ready = true;
+
+            resp->bStatus = DFU_STATUS_OK;
+            resp->bState  = DFU_DNLOAD_IDLE;
+            set_poll_timeout(resp, 0);
+            return true;
+        }
+    }
+
+    // Slot switch: DNLOAD block 0, len=2, 0xB3 (activate) or 0xB4 (revoke),
+    // slot number. Ends the download first, so deferred erases are settled
+    // before the image is checked.
+    if (block == 0 && length == 2 && (buffer[0] == DFUSE_CMD_ACTIVATE || buffer[0] == DFUSE_CMD_REVOKE)) {
+        if (state == DFU_DNLOAD_SYNC
+         || (state == DFU_DNBUSY && dfuse_ctx.op == DFUSE_OP_SLOT_BUSY)) {
+            if (state == DFU_DNLOAD_SYNC) {
+                dfuse_ctx.op     = DFUSE_OP_SLOT_BUSY;
+                dfuse_ctx.queued = false;
+            }
+            if (!dfuse_ctx.queued) {
+                dfuse_ctx.queued = flash_finish_async();
+            }
+
+            if (!dfuse_ctx.queued || flash_is_busy()) {
+                resp->bStatus = DFU_STATUS_OK;
+                resp->bState  = DFU_DNBUSY;
+                set_poll_timeout(resp, flash_time_to_idle_ms());
+                return true;
+            }
+
+            bool ok = (buffer[0] == DFUSE_CMD_ACTIVATE) ? slot_activate(buffer[1])
+                                                        : slot_revoke(buffer[1]);
+            CDC_LOG("  Slot %u %s: %s\r\n", buffer[1],
+                    (buffer[0] == DFUSE_CMD_ACTIVATE) ? "activate" : "revoke", ok ? "ok" : "refused");
+            dfuse_ctx.op = DFUSE_OP_IDLE;
+
+            // Refused: no valid image, not active, or the slot's log is full
+            resp->bStatus = ok ? DFU_STATUS_OK : DFU_STATUS_ERR_VERIFY;
+            resp->bState  = ok ? DFU_DNLOAD_IDLE : DFU_ERROR;
+            set_poll_timeout(resp, 0);
+            return true;
+        }
+    }
+
     // Firmware data blocks: DNLOAD block >= 2, len > 0
     // Write starts at first GETSTATUS after DNLOAD
     if (block >= 2 && length > 0 && dfuse_ctx.have_addr) {
@@ -197,29 +578,65 @@ bool tud_dfu_get_status_cb(uint8_t alt, tud_dfu_get_status_request_t const *req,
         CDC_LOG("  WriteMemory: addr=%08" PRIX32 "\r\n", addr);
 
         // First GETSTATUS after this DNLOAD: DFU_DNLOAD_SYNC
+        // The block is queued and programmed in the background, so the host
+        // can send the next one right away. Only a full queue makes it wait.
         if (state == DFU_DNLOAD_SYNC && dfuse_ctx.op == DFUSE_OP_IDLE) {
-            if (!flash_write_async(addr, buffer, length)) {
-                resp->bStatus = DFU_STATUS_ERR_ADDRESS;
+            trace_event(TRACE_DNLOAD, ((uint32_t)block << 16) | length);
+
+            // Compressed data needs a stream opened by SetAddress, its
+            // output is checked as it comes out of the decoder
+            dfu_status_t status = DFU_STATUS_OK;
+            if (alt == DFU_ALT_FLASH) {
+                status = dfuse_check_range(addr, length);
+            } else if (!dfuse_ctx.z.active) {
+                status = DFU_STATUS_ERR_ADDRESS;
+            }
+            if (status != DFU_STATUS_OK) {
+                resp->bStatus = status;
                 resp->bState  = DFU_ERROR;
                 set_poll_timeout(resp, 0);
+                return true;
+            }
+
+            dfuse_ctx.z.in_pos    = 0;
+            dfuse_ctx.z.refused   = DFU_STATUS_OK;
+            dfuse_ctx.block_polls = 1;
+
+            if (dfuse_write_block(alt, addr, buffer, length)) {
+                if (dfuse_ctx.z.refused != DFU_STATUS_OK) {
+                    return dfuse_stream_refused(resp);
+                }
+                dfuse_block_taken();
+
+                resp->bStatus = DFU_STATUS_OK;
+                resp->bState  = DFU_DNLOAD_IDLE;
+                set_poll_timeout(resp, 0);
             } else {
+                // Queue full. TinyUSB keeps the block in its buffer until we
+                // report DNLOAD_IDLE, so retry on the next poll.
                 dfuse_ctx.op           = DFUSE_OP_WRITE_BUSY;
                 dfuse_ctx.current_addr = addr;
 
                 resp->bStatus = DFU_STATUS_OK;
                 resp->bState  = DFU_DNBUSY;
 
-                // Measured ~2.7ms
-                set_poll_timeout(resp, 3);
+                // Come back when the oldest queued job is expected to be done
+                set_poll_timeout(resp, flash_time_to_free_ms());
             }
 
             return true;
         }
 
-        // Subsequent GETSTATUS while write is ongoing
+        // Subsequent GETSTATUS while waiting for a free queue slot
         if (state == DFU_DNBUSY && dfuse_ctx.op == DFUSE_OP_WRITE_BUSY) {
-            if (!flash_is_busy()) {
+            dfuse_ctx.block_polls++;
+
+            if (dfuse_write_block(alt, addr, buffer, length)) {
                 dfuse_ctx.op = DFUSE_OP_IDLE;
+                if (dfuse_ctx.z.refused != DFU_STATUS_OK) {
+                    return dfuse_stream_refused(resp);
+                }
+                dfuse_block_taken();
 
                 resp->bStatus = DFU_STATUS_OK;
                 resp->bState  = DFU_DNLOAD_IDLE;
@@ -227,23 +644,62 @@ bool tud_dfu_get_status_cb(uint8_t alt, tud_dfu_get_status_request_t const *req,
             } else {
                 resp->bStatus = DFU_STATUS_OK;
                 resp->bState  = DFU_DNBUSY;
-                set_poll_timeout(resp, 1);
+                set_poll_timeout(resp, flash_time_to_free_ms());
             }
 
             return true;
         }
     }
 
+    // Zero-length DNLOAD ends the download: hold the host in MANIFEST until
+    // the queued blocks have actually reached flash, and erases deferred by
+    // diff mode have been settled.
+    if (state == DFU_MANIFEST_SYNC || state == DFU_MANIFEST) {
+        if (!dfuse_ctx.finishing) {
+            dfuse_ctx.finishing = flash_finish_async();
+        }
+
+        if (!dfuse_ctx.finishing || flash_is_busy()) {
+            resp->bStatus = DFU_STATUS_OK;
+            resp->bState  = DFU_MANIFEST;
+            set_poll_timeout(resp, flash_time_to_idle_ms());
+            return true;
+        }
+
+        dfuse_ctx.finishing = false;
+        dfuse_ctx.z.active  = false; // finish flushed the stream
+    }
+
     // Anything else: let TinyUSB's default DFU logic handle it.
     CDC_LOG("  Unhandled by callback\r\n");
     return false;
 }
 
+ITCM_FUNC bool tud_dfu_get_status_cb(uint8_t alt, tud_dfu_get_status_request_t const *req, dfu_status_response_t *resp, tud_dfu_get_status_control_t *ctl) {
+    trace_event(TRACE_GETSTATUS, ((uint32_t)req->state << 16) | req->block);
+
+    bool handled = dfuse_get_status(alt, req, resp, ctl);
+
+    if (handled) {
+        stats.getstatus++;
+        if (resp->bState == DFU_DNBUSY) {
+            stats.getstatus_busy++;
+        }
+
+        trace_event(TRACE_STATUS_REPLY, ((uint32_t)resp->bState << 24)
+                                      | resp->bwPollTimeout[0]
+                                      | ((uint32_t)resp->bwPollTimeout[1] << 8)
+                                      | ((uint32_t)resp->bwPollTimeout[2] << 16));
+    }
+    return handled;
+}
+
 // Upload: used for DfuSe GetCommands and for reading back flash
 uint16_t tud_dfu_upload_cb(uint8_t alt, uint16_t block_num, uint8_t *data, uint16_t length) {
     CDC_LOG("upload_cb: alt=%u block_num=%u length=%u\r\n", alt, block_num, length);
-    if (alt != 0) {
-        return 0;
+    trace_event(TRACE_UPLOAD, ((uint32_t)block_num << 16) | length);
+    if (alt != DFU_ALT_FLASH && (alt != DFU_ALT_HEATSHRINK || block_num != 0)) {
+        return 0; // no compressed read back
     }
 
     // Block 0 upload after GetCommands: return supported commands.
@@ -255,6 +711,13 @@ uint16_t tud_dfu_upload_cb(uint8_t alt, uint16_t block_num, uint8_t *data, uint1
             dfuse_ctx.last_was_get_cmds = false;
             return n;
         }
+
+        if (dfuse_ctx.crc_ready && length >= 8) {
+            const uint32_t v[2] = { dfuse_ctx.crc_result, dfuse_ctx.crc_length };
+            memcpy(data, v, sizeof(v));
+            dfuse_ctx.crc_ready = false;
+            return sizeof(v);
+        }
         return 0;
     }
 
@@ -265,12 +728,30 @@ uint16_t tud_dfu_upload_cb(uint8_t alt, uint16_t block_num, uint8_t *data, uint1
 
     uint32_t addr = dfuse_ctx.base_addr
                   + (uint32_t)(block_num - 2u) * CFG_TUD_DFU_XFER_BUFSIZE;
-    
-    volatile uint8_t *src = (volatile uint8_t *)addr;
-    for (uint16_t i = 0; i < length; i++) {
-        data[i] = src[i];
+
+    // Statistics block, e.g. dfu-util -s 0xF0000000:4096 -U stats.bin.
+    // A short read ends the upload.
+    if (addr - STATS_ADDR < sizeof(stats)) {
+        uint32_t offset = addr - STATS_ADDR;
+        uint16_t n      = (sizeof(stats) - offset < length) ? (uint16_t)(sizeof(stats) - offset)
+                                                            : length;
+        memcpy(data, (const uint8_t *)&stats + offset, n);
+        return n;
     }
 
+    // Anything else has to be flash
+    if (addr < FLASH_MEM_BASE || addr - FLASH_MEM_BASE >= FLASH_MEM_SIZE) {
+        return 0;
+    }
+    if (length > FLASH_MEM_BASE + FLASH_MEM_SIZE - addr) {
+        length = (uint16_t)(FLASH_MEM_BASE + FLASH_MEM_SIZE - addr);
+    }
+
+    CDC_LOG("  ReadMemory: addr=%08" PRIX32 "\r\n", addr);
+
+    trace_event(TRACE_READ_START, addr);
+    flash_read(data, addr, length);
+    trace_event(TRACE_READ_END, length);
     return length;
 }
 
@@ -290,6 +771,7 @@ void tud_dfu_abort_cb(uint8_t alt) {
     dfuse_ctx.op                = DFUSE_OP_IDLE;
     dfuse_ctx.current_addr      = 0;
     dfuse_ctx.last_was_get_cmds = false;
+    dfuse_ctx.crc_ready         = false;
 }
 
 void tud_dfu_detach_cb(void) {
@@ -0,0 +1,223 @@
+#include <string.h>
+
+#include "dfu_flash.h"
+#include "ghostfat.h"
+#include "uf2.h"
+
+// Layout: boot sector, two FATs, root directory, then one sector per cluster
+#define GF_RESERVED      1
+#define GF_FAT_COUNT     2
+#define GF_FAT_SECTORS   64  // 256 entries each, covers every cluster
+#define GF_ROOT_ENTRIES  64
+#define GF_ROOT_SECTORS  (GF_ROOT_ENTRIES * 32 / GHOSTFAT_SECTOR_SIZE)
+
+#define GF_FAT_START     GF_RESERVED
+#define GF_ROOT_START    (GF_FAT_START + GF_FAT_COUNT * GF_FAT_SECTORS)
+#define GF_DATA_START    (GF_ROOT_START + GF_ROOT_SECTORS)
+#define GF_CLUSTERS      (GHOSTFAT_SECTOR_COUNT - GF_DATA_START)
+
+_Static_assert(GF_CLUSTERS >= 4085 && GF_CLUSTERS < 65525, "cluster count decides the FAT type");
+_Static_assert(GF_FAT_SECTORS * GHOSTFAT_SECTOR_SIZE / 2 >= GF_CLUSTERS + 2, "FAT too small");
+
+// Bank 2 as a UF2 file
+#define GF_IMAGE_BASE    FLASH_BANK2_BASE
+#define GF_IMAGE_SIZE    (FLASH_SECTOR_COUNT * FLASH_SECTOR_SIZE)
+
+// 2024-01-01 00:00 for every file
+#define GF_DATE          (((2024 - 1980) << 9) | (1 << 5) | 1)
+#define GF_TIME          0
+
+static const char info_uf2[] =
+    "UF2 Bootloader for CS7000-M17 Plus\r\n"
+    "Model: CS7000-M17 Plus\r\n"
+    "Board-ID: STM32H743-CS7000P\r\n"
+    "Family: 0x6DB66082\r\n"
+    "Flash: bank 2, 0x08100000, 1024 KB\r\n";
+
+typedef struct {
+    char     name[11];
+    uint32_t size;
+} gf_file_t;
+
+enum { GF_FILE_INFO = 0, GF_FILE_CURRENT, GF_FILE_COUNT };
+
+static const gf_file_t gf_files[GF_FILE_COUNT] = {
+    [GF_FILE_INFO]    = { "INFO_UF2TXT", sizeof(info_uf2) - 1 },
+    [GF_FILE_CURRENT] = { "CURRENT UF2", ((GF_IMAGE_SIZE + UF2_PAYLOAD_SIZE - 1) / UF2_PAYLOAD_SIZE)
+                                         * UF2_BLOCK_SIZE },
+};
+
+typedef struct __attribute__((packed)) {
+    uint8_t  jump[3];
+    char     oem_name[8];
+    uint16_t sector_size;
+    uint8_t  sectors_per_cluster;
+    uint16_t reserved_sectors;
+    uint8_t  fat_count;
+    uint16_t root_entries;
+    uint16_t total_sectors16;
+    uint8_t  media;
+    uint16_t fat_sectors;
+    uint16_t sectors_per_track;
+    uint16_t heads;
+    uint32_t hidden_sectors;
+    uint32_t total_sectors32;
+    uint8_t  drive_number;
+    uint8_t  reserved;
+    uint8_t  boot_signature;
+    uint32_t volume_serial;
+    char     volume_label[11];
+    char     fs_type[8];
+} gf_boot_t;
+
+typedef struct __attribute__((packed)) {
+    char     name[11];
+    uint8_t  attrs;
+    uint8_t  reserved;
+    uint8_t  ctime_ms;
+    uint16_t ctime;
+    uint16_t cdate;
+    uint16_t adate;
+    uint16_t start_hi;
+    uint16_t mtime;
+    uint16_t mdate;
+    uint16_t start;
+    uint32_t size;
+} gf_dirent_t;
+
+_Static_assert(sizeof(gf_dirent_t) == 32, "FAT directory entries are 32 bytes");
+
+static uint32_t gf_file_clusters(unsigned file) {
+    return (gf_files[file].size + GHOSTFAT_SECTOR_SIZE - 1) / GHOSTFAT_SECTOR_SIZE;
+}
+
+// First cluster of a file, files are laid out back to back from cluster 2
+static uint32_t gf_file_start(unsigned file) {
+    uint32_t cluster = 2;
+    for (unsigned i = 0; i < file; i++) {
+        cluster += gf_file_clusters(i);
+    }
+    return cluster;
+}
+
+// File a cluster belongs to, GF_FILE_COUNT for free space
+static unsigned gf_file_of(uint32_t cluster, uint32_t *index) {
+    for (unsigned i = 0; i < GF_FILE_COUNT; i++) {
+        uint32_t start = gf_file_start(i);
+        if (cluster >= start && cluster - start < gf_file_clusters(i)) {
+            *index = cluster - start;
+            return i;
+        }
+    }
+    return GF_FILE_COUNT;
+}
+
+static void gf_boot_sector(uint8_t *sector) {
+    gf_boot_t *boot = (gf_boot_t *)sector;
+
+    boot->jump[0]             = 0xEB;
+    boot->jump[1]             = 0x3C;
+    boot->jump[2]             = 0x90;
+    memcpy(boot->oem_name, "UF2 UF2 ", sizeof(boot->oem_name));
+    boot->sector_size         = GHOSTFAT_SECTOR_SIZE;
+    boot->sectors_per_cluster = 1;
+    boot->reserved_sectors    = GF_RESERVED;
+    boot->fat_count           = GF_FAT_COUNT;
+    boot->root_entries        = GF_ROOT_ENTRIES;
+    boot->total_sectors16     = GHOSTFAT_SECTOR_COUNT;
+    boot->media               = 0xF8;
+    boot->fat_sectors         = GF_FAT_SECTORS;
+    boot->sectors_per_track   = 1;
+    boot->heads               = 1;
+    boot->drive_number        = 0x80;
+    boot->boot_signature      = 0x29;
+    boot->volume_serial       = 0x00420042;
+    memcpy(boot->volume_label, GHOSTFAT_VOLUME_LABEL, sizeof(boot->volume_label));
+    memcpy(boot->fs_type, "FAT16   ", sizeof(boot->fs_type));
+
+    sector[510] = 0x55;
+    sector[511] = 0xAA;
+}
+
+static void gf_fat_sector(uint32_t index, uint8_t *sector) {
+    uint32_t cluster = index * (GHOSTFAT_SECTOR_SIZE / 2);
+
+    for (uint32_t i = 0; i < GHOSTFAT_SECTOR_SIZE / 2; i++, cluster++) {
+        uint32_t n;
+        uint16_t entry = 0;
+
+        if (cluster == 0) {
+            entry = 0xFFF8; // media byte
+        } else if (cluster == 1) {
+            entry = 0xFFFF;
+        } else {
+            unsigned file = gf_file_of(cluster, &n);
+            if (file != GF_FILE_COUNT) {
+                entry = (n + 1 == gf_file_clusters(file)) ? 0xFFFF : (uint16_t)(cluster + 1);
+            }
+        }
+
+        sector[2 * i]     = (uint8_t)entry;
+        sector[2 * i + 1] = (uint8_t)(entry >> 8);
+    }
+}
+
+static void gf_root_sector(uint8_t *sector) {
+    gf_dirent_t *d = (gf_dirent_t *)sector;
+
+    memcpy(d->name, GHOSTFAT_VOLUME_LABEL, sizeof(d->name));
+    d->attrs = 0x28; // volume label, archive
+    d->mtime = GF_TIME;
+    d->mdate = GF_DATE;
+    d++;
+
+    for (unsigned i = 0; i < GF_FILE_COUNT; i++, d++) {
+        memcpy(d->name, gf_files[i].name, sizeof(d->name));
+        d->attrs = 0x01; // read-only
+        d->ctime = GF_TIME;
+        d->cdate = GF_DATE;
+        d->adate = GF_DATE;
+        d->mtime = GF_TIME;
+        d->mdate = GF_DATE;
+        d->start = (uint16_t)gf_file_start(i);
+        d->size  = gf_files[i].size;
+    }
+}
+
+static void gf_data_sector(uint32_t cluster, uint8_t *sector) {
+    uint32_t n;
+
+    switch (gf_file_of(cluster, &n)) {
+        case GF_FILE_INFO:
+        {
+            uint32_t offset = n * GHOSTFAT_SECTOR_SIZE;
+            uint32_t length = gf_files[GF_FILE_INFO].size - offset;
+            if (length > GHOSTFAT_SECTOR_SIZE) {
+                length = GHOSTFAT_SECTOR_SIZE;
+            }
+            memcpy(sector, &info_uf2[offset], length);
+            break;
+        }
+
+        case GF_FILE_CURRENT:
+            uf2_render(sector, GF_IMAGE_BASE, GF_IMAGE_SIZE, n);
+            break;
+
+        default:
+            break;
+    }
+}
+
+void ghostfat_read(uint32_t lba, uint8_t *sector) {
+    memset(sector, 0, GHOSTFAT_SECTOR_SIZE);
+
+    if (lba == 0) {
+        gf_boot_sector(sector);
+    } else if (lba < GF_ROOT_START) {
+        gf_fat_sector((lba - GF_FAT_START) % GF_FAT_SECTORS, sector);
+    } else if (lba == GF_ROOT_START) {
+        gf_root_sector(sector);
+    } else if (lba >= GF_DATA_START && lba < GHOSTFAT_SECTOR_COUNT) {
+        gf_data_sector(lba - GF_DATA_START + 2, sector);
+    }
+}
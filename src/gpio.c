@@ -1,8 +1,8 @@
-#include <stddef.h>
-#include <string.h>
-
+#include "clock.h"
 #include "gpio.h"
+#include "init.h"
 #include "pinmap.h"
+#include "sections.h"
 
 static inline void setGpioAf(GPIO_TypeDef *port, uint8_t pin, const uint8_t af)
 {
@@ -158,7 +158,20 @@ const struct gpioDev GpioC = { .api = &gpioApi, .priv = GPIOC };
 const struct gpioDev GpioD = { .api = &gpioApi, .priv = GPIOD };
 const struct gpioDev GpioE = { .api = &gpioApi, .priv = GPIOE };
 
-static uint8_t srData_extGpio[3];
+#define SR_BITS    24
+#define SR_TICK_HZ 500000u // two ticks per bit, ~100 us for the whole chain
+
+// The image is only written from thread context; the TIM7 interrupt takes
+// a copy of it at the start of every shift-out
+static struct {
+    volatile uint32_t image;   // pin n in bit n
+    volatile bool     dirty;   // image changed since the last copy
+    volatile bool     busy;    // TIM7 running
+    volatile uint8_t  hold;    // open gpioShiftReg_begin() calls
+
+    uint32_t frame;            // being shifted out
+    uint8_t  step;             // clock edges done, 2 per bit
+} sr DTCM_BSS;
 
 static int gpioShiftReg_mode(const struct gpioDev *dev, const uint8_t pin, const uint16_t mode) {
     (void) dev;
@@ -168,34 +181,54 @@ static int gpioShiftReg_mode(const struct gpioDev *dev, const uint8_t pin, const
     return -1;
 }
 
-static void spiSr_send(const uint8_t *txbuf, const size_t size) {
-    for (size_t i = 0; i < size; i++) {
-        uint8_t value = txbuf[i];
-
-        for (uint8_t cnt = 0; cnt < 8; cnt++) {
-            GPIOE->BSRR = (1 << 23);   // Clear PE7 (CLK)
-
-            if (value & (0x80 >> cnt))
-                GPIOE->BSRR = 1 << 9;  // Set PE9 (MOSI)
-            else
-                GPIOE->BSRR = 1 << 25; // Clear PE9 (MOSI)
-            
-            // ~70ns delay
-            asm volatile("           mov   r1, #5     \n"
-                         "___loop_2: cmp   r1, #0     \n"
-                         "           itt   ne         \n"
-                         "           subne r1, r1, #1 \n"
-                         "           bne   ___loop_2  \n":::"r1");
-
-            GPIOE->BSRR = (1 << 7);                 // Set PE7 (CLK)
-    
-            // ~70ns delay
-            asm volatile("           mov   r1, #6     \n"
-                         "___loop_3: cmp   r1, #0     \n"
-                         "           itt   ne         \n"
-                         "           subne r1, r1, #1 \n"
-                         "           bne   ___loop_3  \n":::"r1");
+// One clock edge per tick: data changes with the falling edge, the 595
+// samples it on the rising one. STR goes low at the start of a shift-out
+// and its rising edge at the end copies the chain to the outputs.
+ITCM_FUNC void TIM7_IRQHandler(void) {
+    TIM7->SR = ~TIM_SR_UIF;
+
+    if (sr.step == 0) {
+        // Nothing new, or a transaction still open: gpioShiftReg_commit()
+        // starts over
+        if (sr.hold != 0 || !__atomic_exchange_n(&sr.dirty, false, __ATOMIC_ACQUIRE)) {
+            TIM7->CR1 = 0;
+            sr.busy   = false;
+            return;
         }
+        sr.frame = sr.image;
+        gpio_clearPin(GPIOEXT_STR);
+    }
+
+    if (sr.step < 2 * SR_BITS) {
+        if ((sr.step & 1) == 0) {
+            // Pin 23 first
+            uint32_t bit = SR_BITS - 1u - sr.step / 2u;
+
+            gpio_clearPin(GPIOEXT_CLK);
+            if (sr.frame & (1u << bit)) {
+                gpio_setPin(GPIOEXT_DAT);
+            } else {
+                gpio_clearPin(GPIOEXT_DAT);
+            }
+        } else {
+            gpio_setPin(GPIOEXT_CLK);
+        }
+        sr.step++;
+        return;
+    }
+
+    // All bits in, latch; the next tick looks for more
+    gpio_setPin(GPIOEXT_STR);
+    sr.step = 0;
+}
+
+// Have the image shifted out, unless held back by a transaction
+static void gpioShiftReg_kick(void) {
+    __atomic_store_n(&sr.dirty, true, __ATOMIC_RELEASE);
+
+    if (sr.hold == 0 && !__atomic_exchange_n(&sr.busy, true, __ATOMIC_ACQ_REL)) {
+        TIM7->CNT = 0;
+        TIM7->CR1 = TIM_CR1_CEN;
     }
 }
 
@@ -203,34 +236,51 @@ void gpioShiftReg_init() {
     gpio_setMode(GPIOEXT_STR, OUTPUT);
     gpio_setMode(GPIOEXT_CLK, OUTPUT);
     gpio_setMode(GPIOEXT_DAT, OUTPUT);
-    gpio_clearPin(GPIOEXT_STR);
-
-    memset(srData_extGpio, 0x00, 3);
-    spiSr_send(srData_extGpio, 3);
     gpio_setPin(GPIOEXT_STR);
+
+    RCC->APB1LENR |= RCC_APB1LENR_TIM7EN;
+    __DSB();
+
+    TIM7->CR1  = 0;
+    TIM7->PSC  = 0;
+    TIM7->ARR  = APB1_TIMER_CLOCK_HZ / SR_TICK_HZ - 1u;
+    TIM7->SR   = 0;
+    TIM7->DIER = TIM_DIER_UIE;
+
+    NVIC_SetPriority(TIM7_IRQn, IRQ_PRIO_SHIFTREG);
+    NVIC_ClearPendingIRQ(TIM7_IRQn);
+    NVIC_EnableIRQ(TIM7_IRQn);
+
+    sr.image = 0;
+    sr.hold  = 0;
+    sr.step  = 0;
+    sr.busy  = false;
+    gpioShiftReg_kick();
+}
+
+void gpioShiftReg_begin(void) {
+    sr.hold++;
+}
+
+void gpioShiftReg_commit(void) {
+    if (--sr.hold == 0 && sr.dirty) {
+        gpioShiftReg_kick();
+    }
 }
 
-static inline void gpioShiftReg_modify(const struct gpioDev *dev, const uint8_t pin, bool state) {
-    const size_t nBytes = 3;
-    const size_t byte = (24 - 1 - pin) / 8;
-    const size_t bit = pin % 8;
+static void gpioShiftReg_modify(const struct gpioDev *dev, const uint8_t pin, bool state) {
+    (void) dev;
 
-    if (pin > 24)
+    if (pin >= SR_BITS)
         return;
-    
-    __disable_irq();
 
     if (state == true) {
-        srData_extGpio[byte] |= (1 << bit);
+        sr.image |= (1u << pin);
     } else {
-        srData_extGpio[byte] &= ~(1 << bit);
+        sr.image &= ~(1u << pin);
     }
 
-    gpio_clearPin(GPIOEXT_STR);
-    spiSr_send(srData_extGpio, nBytes);
-    gpio_setPin(GPIOEXT_STR);
-
-    __enable_irq();
+    gpioShiftReg_kick();
 }
 
 static void gpioShiftReg_set(const struct gpioDev *dev, const uint8_t pin) {
@@ -242,13 +292,12 @@ static void gpioShiftReg_clear(const struct gpioDev *dev, const uint8_t pin) {
 }
 
 static bool gpioShiftReg_read(const struct gpioDev *dev, const uint8_t pin) {
-    const size_t byte = (24 - 1 - pin) / 8;
-    const size_t bit = pin % 8;
+    (void) dev;
 
-    if (pin > 24)
+    if (pin >= SR_BITS)
         return false;
-    
-    return ((srData_extGpio[byte] & (1 << bit)) != 0) ? true : false;
+
+    return (sr.image & (1u << pin)) != 0;
 }
 
 const struct gpioApi gpioShiftReg_ops = {
@@ -0,0 +1,92 @@
+#include <string.h>
+
+#include "heatshrink.h"
+
+enum {
+    HS_TAG = 0,     // 1 bit: literal or back-reference
+    HS_LITERAL,     // 8 bits
+    HS_INDEX,       // HS_WINDOW_BITS bits, distance - 1
+    HS_COUNT,       // HS_LOOKAHEAD_BITS bits, length - 1
+    HS_COPY,        // emitting a back-reference
+};
+
+void hs_decoder_reset(hs_decoder_t *dec) {
+    dec->state = HS_TAG;
+    dec->nbits = 0;
+    dec->bits  = 0;
+    dec->index = 0;
+    dec->count = 0;
+    dec->head  = 0;
+
+    // heatshrink starts out with a zeroed window
+    memset(dec->window, 0, sizeof(dec->window));
+}
+
+static inline void hs_emit(hs_decoder_t *dec, uint8_t c, uint8_t *out) {
+    dec->window[dec->head & (HS_WINDOW_SIZE - 1)] = c;
+    dec->head++;
+    *out = c;
+}
+
+uint32_t hs_decode(hs_decoder_t *dec, const uint8_t *in, uint32_t in_len,
+                   uint32_t *consumed, uint8_t *out, uint32_t out_len) {
+    uint32_t in_pos  = 0;
+    uint32_t out_pos = 0;
+
+    while (out_pos < out_len) {
+        if (dec->state == HS_COPY) {
+            uint8_t c = dec->window[(uint16_t)(dec->head - dec->index) & (HS_WINDOW_SIZE - 1)];
+            hs_emit(dec, c, &out[out_pos++]);
+
+            if (--dec->count == 0) {
+                dec->state = HS_TAG;
+            }
+            continue;
+        }
+
+        uint8_t need;
+        switch (dec->state) {
+            case HS_TAG:     need = 1;                 break;
+            case HS_LITERAL: need = 8;                 break;
+            case HS_INDEX:   need = HS_WINDOW_BITS;    break;
+            default:         need = HS_LOOKAHEAD_BITS; break;
+        }
+
+        // Refill a byte at a time, bits are taken MSB first
+        while (dec->nbits < need) {
+            if (in_pos == in_len) {
+                *consumed = in_pos;
+                return out_pos;
+            }
+            dec->bits   = (dec->bits << 8) | in[in_pos++];
+            dec->nbits += 8;
+        }
+
+        dec->nbits -= need;
+        uint16_t v = (dec->bits >> dec->nbits) & ((1u << need) - 1u);
+
+        switch (dec->state) {
+            case HS_TAG:
+                dec->state = v ? HS_LITERAL : HS_INDEX;
+                break;
+
+            case HS_LITERAL:
+                hs_emit(dec, (uint8_t)v, &out[out_pos++]);
+                dec->state = HS_TAG;
+                break;
+
+            case HS_INDEX:
+                dec->index = v + 1;
+                dec->state = HS_COUNT;
+                break;
+
+            default:
+                dec->count = v + 1;
+                dec->state = HS_COPY;
+                break;
+        }
+    }
+
+    *consumed = in_pos;
+    return out_pos;
+}
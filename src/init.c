@@ -1,10 +1,38 @@
 #include "init.h"
+#include "dwt.h"
 #include "gpio.h"
 #include "tusb.h"
 #include "pinmap.h"
 
 #include "stm32h7xx.h"
 
+// Before start_pll() the core runs from the 64 MHz HSI
+#define BOOT_HSI_HZ        64000000u
+// What the old delayUs(500) came to at HSI (133 * 500 loops of 3 cycles).
+// The key's settling time hasn't been measured, so don't wait any less.
+#define BOOT_KEY_SETTLE_US 3100
+
+bool boot_key_pressed(void) {
+    // Only GPIOE, and only for as long as it takes to read the key
+    RCC->AHB4ENR |= RCC_AHB4ENR_GPIOEEN;
+    __DSB();
+
+    gpio_setMode(ALARM_KEY, INPUT);
+
+    uint32_t t0 = dwt_cycles();
+    while (dwt_cycles() - t0 < BOOT_KEY_SETTLE_US * (BOOT_HSI_HZ / 1000000u)) ;
+
+    bool pressed = (gpio_readPin(ALARM_KEY) == 0);
+
+    // Leave GPIOE as the application would find it after a reset
+    RCC->AHB4RSTR |= RCC_AHB4RSTR_GPIOERST;
+    RCC->AHB4RSTR &= ~RCC_AHB4RSTR_GPIOERST;
+    RCC->AHB4ENR  &= ~RCC_AHB4ENR_GPIOEEN;
+    __DSB();
+
+    return pressed;
+}
+
 void usb_init(void) {
     gpio_setMode(USB_DM, ALTERNATE | ALTERNATE_FUNC(10));
     gpio_setMode(USB_DP, ALTERNATE | ALTERNATE_FUNC(10));
@@ -22,13 +50,17 @@ void usb_init(void) {
                         | USB_OTG_GOTGCTL_BVALOVAL;
     USB_OTG_FS->GUSBCFG |= USB_OTG_GUSBCFG_FDMOD;
 
-    NVIC_SetPriority(OTG_FS_IRQn, 14);
+    NVIC_SetPriority(OTG_FS_IRQn, IRQ_PRIO_USB);
     tusb_init();
 }
 
 void irq_init(void) {
-    NVIC_SetPriorityGrouping(7); // This should disable interrupt nesting
+    // PRIGROUP 3: all four priority bits the H7 implements are preemption
+    // bits, see the IRQ_PRIO_* levels
+    NVIC_SetPriorityGrouping(3);
+
     SysTick_Config(399999); // 1ms tick
+    NVIC_SetPriority(SysTick_IRQn, IRQ_PRIO_TICK);
     __enable_irq();
 }
 
@@ -1,49 +1,76 @@
+#include "backup.h"
 #include "boot_jump.h"
 #include "clock.h"
+#include "crc.h"
 #include "debug.h"
 #include "delay.h"
+#include "dwt.h"
 #include "gpio.h"
 #include "pinmap.h"
+#include "sched.h"
+#include "sections.h"
 #include "init.h"
 #include "dfu_flash.h"
+#include "msc_flash.h"
+#include "stats.h"
+#include "trace.h"
+#include "vendor_flash.h"
 
 #include "tusb.h"
 
 #define BOOT_MAGIC_GO_APP 0xDEADB007u
 
-static void backup_init(void) {
-    // ENable APB4 RTC access and unlock backup domain
-    RCC->APB4ENR |= RCC_APB4ENR_RTCAPBEN;
-    PWR->CR1 |= PWR_CR1_DBP;
-    while (!(PWR->CR1 & PWR_CR1_DBP)) ; // Wait
-}
-
 static void bootflag_set(uint32_t v) {
     backup_init();
-    RTC->BKP0R = v;
+    backup_write(BACKUP_BOOTFLAG, v);
 }
 
 static uint32_t bootflag_get(void) {
     backup_init();
-    return RTC->BKP0R;
+    return backup_read(BACKUP_BOOTFLAG);
 }
 
 static void bootflag_clear(void) {
     bootflag_set(0);
 }
 
+// Cycles (at the 64 MHz HSI) from Reset_Handler to the application entry on
+// the last start, plus those of a bootloader pass that reset to get there.
+// Read back into stats.boot_cycles when the bootloader stays.
+static void boot_time_record(void) {
+    backup_write(BACKUP_BOOT_CYCLES, backup_read(BACKUP_BOOT_CYCLES_PREV) + dwt_cycles());
+    backup_write(BACKUP_BOOT_CYCLES_PREV, 0);
+}
+
+// Returns only if there is no valid application to start
+static void start_application(void) {
+    uint32_t base = app_find();
+    if (base == 0) {
+        return;
+    }
+
+    boot_time_record();
+
+    // Backup domain back to reset state, as the application expects
+    backup_deinit();
+
+    jump_to_application(base);
+}
+
 void cdc_task(void);
 void led_blinking_task(void);
 void printUnsignedInt(unsigned int x);
 
 volatile unsigned int g_tickCount = 0;
 
-void SysTick_Handler() {
+ITCM_FUNC void SysTick_Handler() {
     g_tickCount++;
+    sched_tick();
 }
 
-void OTG_FS_IRQHandler(void) {
+ITCM_FUNC void OTG_FS_IRQHandler(void) {
     tud_int_handler(0);
+    sched_post(SCHED_EV_USB);
 }
 
 void reboot_into_application(void) {
@@ -55,6 +82,47 @@ bool button_read(void) {
     return gpio_readPin(ALARM_KEY) == 1;
 }
 
+// Tick at which a UF2 copy completed, 0 while none has
+static uint32_t uf2_done_ms;
+
+// The USB stack first, everything below works off what it hands over. The
+// tick catches events it queues from thread context.
+static void usb_task(uint32_t events) {
+    (void)events;
+    tud_task();
+}
+
+// Download paths into the flash engine: new data from the host, or room in
+// the flash queue
+static void download_task(uint32_t events) {
+    (void)events;
+    vendor_task();
+
+    if (msc_task() && uf2_done_ms == 0) {
+        uf2_done_ms = g_tickCount | 1u;
+    }
+}
+
+// Console, LED, and starting a copied UF2 once the host has had time to see
+// its last write acknowledged
+static void housekeeping_task(uint32_t events) {
+    cdc_task();
+
+    if (events & SCHED_EV_TICK) {
+        led_blinking_task();
+
+        if (uf2_done_ms != 0 && g_tickCount - uf2_done_ms > 500) {
+            reboot_into_application();
+        }
+    }
+}
+
+static const sched_task_t tasks[] = {
+    { usb_task,          SCHED_EV_USB | SCHED_EV_TICK  },
+    { download_task,     SCHED_EV_USB | SCHED_EV_FLASH },
+    { housekeeping_task, SCHED_EV_USB | SCHED_EV_TICK  },
+};
+
 void main(void) {
     // At this point: Reset_Handler and SystemInit have run
     // CPU is on HSI, PLLs are in reset state, peripherals in reset state
@@ -63,35 +131,59 @@ void main(void) {
 
     if (magic == BOOT_MAGIC_GO_APP) {
         bootflag_clear();
-        jump_to_application();
+        start_application();
     }
-
-    // Enter bootloader
-    gpio_init();
-
-    // Check to see if bootloader button is pressed
-    gpio_setMode(ALARM_KEY, INPUT);
-    delayUs(500);
-    if (gpio_readPin(ALARM_KEY) == 1) {
-        // Button not pressed
-        reboot_into_application();
+#ifdef BOOT_VIA_RESET
+    // Previous boot path, kept to compare boot times: full GPIO setup, then
+    // a second reset to start the application from a clean state
+    else {
+        gpio_init();
+        gpio_setMode(ALARM_KEY, INPUT);
+        delayUs(500);
+        if (gpio_readPin(ALARM_KEY) == 1) {
+            backup_write(BACKUP_BOOT_CYCLES_PREV, dwt_cycles());
+            reboot_into_application();
+        }
     }
+#else
+    // Button not pressed: straight on to the application, nothing but
+    // GPIOE and the backup domain have been touched
+    else if (!boot_key_pressed()) {
+        start_application();
+    }
+#endif
+
+    // Button pressed, or no valid application. Bank 2 may be rewritten from
+    // here on, so the next start checks the image in full.
+    backup_write(BACKUP_APP_CHECK, 0);
+    stats.boot_cycles = backup_read(BACKUP_BOOT_CYCLES);
 
-    // Button pressed, engage high speed, USB, etc.
+    // Engage high speed, USB, etc.
+    gpio_init();
     start_pll();
+    dwt_init();
+    tcm_init();     // at full speed; before anything placed in TCM runs
     gpioShiftReg_init();
     gpio_setMode(PHONE_TXD, OUTPUT);
+
+    // The bootloader's extGpio state, set in one shift-out: red LED on,
+    // green off and the RF stages unpowered, stated here rather than left
+    // to the all-low image gpioShiftReg_init() starts from
+    gpioShiftReg_begin();
     gpioDev_set(RED_LED);
+    gpioDev_clear(GREEN_LED);
+    gpioDev_clear(TX_PWR_EN);
+    gpioDev_clear(RX_PWR_EN);
+    gpioDev_clear(RF_APC_SW);
+    gpioDev_clear(VCOVCC_SW);
+    gpioShiftReg_commit();
+    crc_init();
     flash_init();
     usb_init();
+    sched_init(tasks, sizeof(tasks) / sizeof(tasks[0]));
     irq_init();
 
-    while (1) {
-        tud_task();
-        led_blinking_task();
-        cdc_task();
-        flash_process();
-    }
+    sched_run();
 }
 
 
@@ -113,11 +205,20 @@ void cdc_task(void) {
         uint32_t count = tud_cdc_read(buf, sizeof(buf));
         (void)count;
 
+#ifdef DFU_TRACE
+        if (count == 1 && buf[0] == 'T') {
+            trace_dump_start();
+            count = 0;
+        }
+#endif
+
         // Echo back
         tud_cdc_write(buf, count);
         tud_cdc_write_flush();
     }
 
+    trace_dump_task();
+
     static bool btn_prev = 0;
     const  bool btn      = button_read();
 
@@ -0,0 +1,346 @@
+#include <string.h>
+
+#include "tusb.h"
+#include "debug.h"
+#include "ghostfat.h"
+#include "msc_flash.h"
+#include "sections.h"
+#include "slots.h"
+#include "uf2.h"
+
+#define MSC_WRITE_BASE FLASH_BANK2_BASE
+#define MSC_WRITE_SIZE (FLASH_SECTOR_COUNT * FLASH_SECTOR_SIZE)
+
+// Most blocks a file may have, i.e. bank 2 in 128-byte payloads
+#define MSC_MAX_BLOCKS (MSC_WRITE_SIZE / 128u)
+
+_Static_assert(CFG_TUD_MSC_EP_BUFSIZE % GHOSTFAT_SECTOR_SIZE == 0,
+               "read10/write10 are handed whole sectors");
+
+typedef enum {
+    MSC_IDLE = 0,    // no file being written
+    MSC_WRITING,     // taking blocks of a file
+    MSC_FINISHING,   // all blocks queued, waiting for the flash
+    MSC_DONE,        // file on flash
+    MSC_ABORT,       // error or a different file: closing the session
+} msc_state_t;
+
+static bool msc_close(void);
+
+static struct {
+    msc_state_t state;
+
+    uint32_t num_blocks;      // of the file being written
+    uint32_t received;        // distinct blocks queued so far
+    uint8_t  seen[MSC_MAX_BLOCKS / 8];
+
+    uint32_t lo, hi;          // range the file covers so far
+
+    uint32_t block_no;        // block partly in the stream
+    uint32_t block_off;       // its bytes in the stream already, 0 if none
+
+    bool     streaming;       // flash stream open at next_addr
+    uint32_t next_addr;
+    bool     finishing;       // finish job queued
+    uint32_t options;         // engine options to restore afterwards
+
+    volatile flash_error_t flash_error; // latched by msc_job_done_cb()
+} msc;
+
+// Flash engine completion, runs in the FLASH interrupt
+ITCM_FUNC void msc_job_done_cb(flash_job_type_t type, uint32_t addr, flash_error_t err) {
+    (void)type;
+    (void)addr;
+
+    if (err != FLASH_ERR_NONE && msc.flash_error == FLASH_ERR_NONE) {
+        msc.flash_error = err;
+    }
+}
+
+static bool msc_in_range(uint32_t addr, uint32_t length) {
+    return addr >= MSC_WRITE_BASE && length <= MSC_WRITE_SIZE
+        && addr - MSC_WRITE_BASE <= MSC_WRITE_SIZE - length;
+}
+
+static bool msc_session_start(const uf2_block_t *block) {
+    // Changing options waits for the queue, don't let it
+    if (flash_is_busy()) {
+        return false;
+    }
+
+    flash_set_owner(FLASH_OWNER_MSC);
+    msc.options = flash_get_options();
+    flash_set_options(msc.options | FLASH_OPT_AUTO_ERASE);
+
+    memset(msc.seen, 0, sizeof(msc.seen));
+    msc.num_blocks  = block->num_blocks;
+    msc.received    = 0;
+    msc.lo          = UINT32_MAX;
+    msc.hi          = 0;
+    msc.block_off   = 0;
+    msc.streaming   = false;
+    msc.finishing   = false;
+    msc.flash_error = FLASH_ERR_NONE;
+    msc.state       = MSC_WRITING;
+
+    CDC_LOG("UF2: %lu blocks\r\n", (unsigned long)block->num_blocks);
+    return true;
+}
+
+// Stream the payload of a block into flash, picking up where a busy return
+// left off. False while the flash queue is full.
+static bool msc_stream_block(const uf2_block_t *block) {
+    if (msc.block_off == 0) {
+        if (!msc.streaming || block->target_addr != msc.next_addr) {
+            if (!flash_stream_begin(block->target_addr)) {
+                return false;
+            }
+            msc.streaming = true;
+            msc.next_addr = block->target_addr;
+        }
+        msc.block_no = block->block_no;
+    }
+
+    while (msc.block_off < block->payload_size) {
+        uint32_t space;
+        uint8_t *dst = flash_stream_space(&space);
+        if (dst == NULL) {
+            return false;
+        }
+
+        uint32_t n = block->payload_size - msc.block_off;
+        if (n > space) {
+            n = space;
+        }
+
+        memcpy(dst, &block->data[msc.block_off], n);
+        flash_stream_commit(n);
+        msc.block_off += n;
+        msc.next_addr += n;
+    }
+
+    msc.block_off = 0;
+    return true;
+}
+
+// 1: sector taken, 0: busy, try again, -1: write error
+static int msc_write_sector(uint8_t lun, const uint8_t *sector) {
+    uf2_block_t block;
+
+    switch (uf2_check(sector, &block)) {
+        case UF2_NOT_UF2: // directory and FAT updates
+        case UF2_SKIP:
+            return 1;
+
+        case UF2_BAD:
+            tud_msc_set_sense(lun, SCSI_SENSE_MEDIUM_ERROR, 0x0C, 0x00);
+            return -1;
+
+        case UF2_DATA:
+            break;
+    }
+
+    // Another file: drop what is left of this one, then start over
+    if (msc.state == MSC_WRITING && block.num_blocks != msc.num_blocks) {
+        msc.state = MSC_ABORT;
+    }
+
+    // TinyUSB offers a transfer that isn't taken again before msc_task()
+    // gets to run, so an abandoned session is closed from here. The flash
+    // engine gets on with it from its interrupt meanwhile.
+    if (msc.state == MSC_ABORT && !msc_close()) {
+        return 0;
+    }
+
+    switch (msc.state) {
+        case MSC_IDLE:
+            if (block.num_blocks > MSC_MAX_BLOCKS) {
+                tud_msc_set_sense(lun, SCSI_SENSE_MEDIUM_ERROR, 0x0C, 0x00);
+                return -1;
+            }
+            if (!msc_session_start(&block)) {
+                return 0;
+            }
+            break;
+
+        case MSC_WRITING:
+            break;
+
+        default:
+            // The whole file is in already, these are repeats
+            return 1;
+    }
+
+    // The same block again, as hosts do when retrying
+    if (msc.seen[block.block_no / 8] & (1u << (block.block_no % 8))) {
+        return 1;
+    }
+
+    // A block that doesn't carry on from the last one starts a new stream,
+    // and so has to start on a flash word
+    bool continues = msc.streaming && block.target_addr == msc.next_addr;
+    if (!msc_in_range(block.target_addr, block.payload_size)
+     || (!continues && msc.block_off == 0 && (block.target_addr % FLASH_WRITE_SIZE) != 0)
+     || (msc.block_off != 0 && block.block_no != msc.block_no)) {
+        msc.state = MSC_ABORT;
+        tud_msc_set_sense(lun, SCSI_SENSE_MEDIUM_ERROR, 0x0C, 0x00);
+        return -1;
+    }
+
+    // The slot the bootloader would start stays as it is
+    if (slot_overlaps_active(block.target_addr, block.payload_size)) {
+        msc.state = MSC_ABORT;
+        tud_msc_set_sense(lun, SCSI_SENSE_DATA_PROTECT, 0x27, 0x00);
+        return -1;
+    }
+
+    if (!msc_stream_block(&block)) {
+        return 0;
+    }
+
+    msc.seen[block.block_no / 8] |= (uint8_t)(1u << (block.block_no % 8));
+    if (block.target_addr < msc.lo) {
+        msc.lo = block.target_addr;
+    }
+    if (block.target_addr + block.payload_size > msc.hi) {
+        msc.hi = block.target_addr + block.payload_size;
+    }
+    if (++msc.received == msc.num_blocks) {
+        msc.state = MSC_FINISHING;
+    }
+    return 1;
+}
+
+// Get a finishing or abandoned session's data onto flash and give the
+// engine its options back. False while the flash is still busy with it.
+static bool msc_close(void) {
+    if (msc.streaming) {
+        if (!flash_stream_flush()) {
+            return false;
+        }
+        msc.streaming = false;
+    }
+
+    if (!msc.finishing) {
+        msc.finishing = flash_finish_async();
+        if (!msc.finishing) {
+            return false;
+        }
+    }
+
+    if (flash_is_busy()) {
+        return false;
+    }
+
+    flash_set_options(msc.options);
+    msc.finishing = false;
+
+    if (msc.state == MSC_FINISHING && msc.flash_error == FLASH_ERR_NONE) {
+        CDC_LOG("UF2: done\r\n");
+        msc.state = MSC_DONE;
+
+        // An image for one slot is switched to right away
+        unsigned slot = slot_of(msc.lo, msc.hi - msc.lo);
+        if (slot < SLOT_COUNT && !slot_activate(slot)) {
+            CDC_LOG("UF2: slot %u not activated\r\n", slot);
+        }
+    } else {
+        CDC_LOG("UF2: abandoned, flash error %u\r\n", msc.flash_error);
+        msc.state = MSC_IDLE;
+    }
+    msc.flash_error = FLASH_ERR_NONE;
+    return true;
+}
+
+bool msc_task(void) {
+    if (msc.state == MSC_FINISHING || msc.state == MSC_ABORT) {
+        msc_close();
+    }
+
+    return msc.state == MSC_DONE;
+}
+
+// TinyUSB MSC callbacks
+
+void tud_msc_inquiry_cb(uint8_t lun, uint8_t vendor_id[8], uint8_t product_id[16], uint8_t product_rev[4]) {
+    (void)lun;
+
+    memcpy(vendor_id,   "CS7000  ",         8);
+    memcpy(product_id,  "UF2 Bootloader  ", 16);
+    memcpy(product_rev, "1.0 ",             4);
+}
+
+bool tud_msc_test_unit_ready_cb(uint8_t lun) {
+    (void)lun;
+    return true;
+}
+
+void tud_msc_capacity_cb(uint8_t lun, uint32_t *block_count, uint16_t *block_size) {
+    (void)lun;
+
+    *block_count = GHOSTFAT_SECTOR_COUNT;
+    *block_size  = GHOSTFAT_SECTOR_SIZE;
+}
+
+bool tud_msc_start_stop_cb(uint8_t lun, uint8_t power_condition, bool start, bool load_eject) {
+    (void)lun;
+    (void)power_condition;
+    (void)start;
+    (void)load_eject;
+    return true;
+}
+
+int32_t tud_msc_read10_cb(uint8_t lun, uint32_t lba, uint32_t offset, void *buffer, uint32_t bufsize) {
+    (void)lun;
+    (void)offset; // always 0, see the assertion on CFG_TUD_MSC_EP_BUFSIZE
+
+    uint8_t *p = buffer;
+    for (uint32_t n = 0; n < bufsize; n += GHOSTFAT_SECTOR_SIZE, lba++) {
+        ghostfat_read(lba, p + n);
+    }
+    return (int32_t)bufsize;
+}
+
+// Returning fewer bytes than bufsize has TinyUSB call again with the rest,
+// which is how a full flash queue holds off the host
+int32_t tud_msc_write10_cb(uint8_t lun, uint32_t lba, uint32_t offset, uint8_t *buffer, uint32_t bufsize) {
+    (void)lba;
+    (void)offset;
+
+    if (msc.flash_error != FLASH_ERR_NONE && msc.state == MSC_WRITING) {
+        msc.state = MSC_ABORT;
+        if (msc.flash_error == FLASH_ERR_WRITE_PROTECT) {
+            tud_msc_set_sense(lun, SCSI_SENSE_DATA_PROTECT, 0x27, 0x00);
+        } else {
+            tud_msc_set_sense(lun, SCSI_SENSE_MEDIUM_ERROR, 0x0C, 0x00);
+        }
+        return -1;
+    }
+
+    uint32_t done = 0;
+    while (done < bufsize) {
+        int ret = msc_write_sector(lun, buffer + done);
+        if (ret < 0) {
+            return -1;
+        }
+        if (ret == 0) {
+            break;
+        }
+        done += GHOSTFAT_SECTOR_SIZE;
+    }
+    return (int32_t)done;
+}
+
+int32_t tud_msc_scsi_cb(uint8_t lun, uint8_t const scsi_cmd[16], void *buffer, uint16_t bufsize) {
+    (void)buffer;
+    (void)bufsize;
+
+    switch (scsi_cmd[0]) {
+        case SCSI_CMD_PREVENT_ALLOW_MEDIUM_REMOVAL:
+            return 0;
+
+        default:
+            tud_msc_set_sense(lun, SCSI_SENSE_ILLEGAL_REQUEST, 0x20, 0x00);
+            return -1;
+    }
+}
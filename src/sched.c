@@ -0,0 +1,89 @@
+#include <stdbool.h>
+
+#include "sched.h"
+#include "sections.h"
+#include "stm32h7xx.h"
+
+static struct {
+    const sched_task_t *tasks;
+    uint32_t count;
+
+    // Events posted to each task since it last ran
+    volatile uint32_t ready[SCHED_MAX_TASKS];
+
+    uint32_t ticks;
+    volatile uint32_t ms;
+} sched DTCM_BSS;
+
+void sched_init(const sched_task_t *tasks, uint32_t count) {
+    sched.tasks = tasks;
+    sched.count = (count < SCHED_MAX_TASKS) ? count : SCHED_MAX_TASKS;
+    sched.ticks = 0;
+
+    for (uint32_t i = 0; i < SCHED_MAX_TASKS; i++) {
+        sched.ready[i] = 0;
+    }
+}
+
+ITCM_FUNC void sched_post(uint32_t events) {
+    for (uint32_t i = 0; i < sched.count; i++) {
+        uint32_t ev = events & sched.tasks[i].events;
+        if (ev != 0) {
+            __atomic_fetch_or(&sched.ready[i], ev, __ATOMIC_RELEASE);
+        }
+    }
+}
+
+ITCM_FUNC void sched_tick(void) {
+    sched.ms++;
+
+    if (++sched.ticks >= SCHED_TICK_MS) {
+        sched.ticks = 0;
+        sched_post(SCHED_EV_TICK);
+    }
+}
+
+ITCM_FUNC uint32_t sched_ms(void) {
+    return sched.ms;
+}
+
+// Run the highest priority task with events pending, false if there is none
+static bool sched_dispatch(void) {
+    for (uint32_t i = 0; i < sched.count; i++) {
+        uint32_t ev = __atomic_exchange_n(&sched.ready[i], 0, __ATOMIC_ACQUIRE);
+        if (ev != 0) {
+            sched.tasks[i].run(ev);
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool sched_idle(void) {
+    for (uint32_t i = 0; i < sched.count; i++) {
+        if (sched.ready[i] != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void sched_run(void) {
+    for (;;) {
+        // Back to the top after every task, so the next one is always the
+        // most urgent
+        if (sched_dispatch()) {
+            continue;
+        }
+
+        // WFI wakes on a pending interrupt even with PRIMASK set, so an
+        // event posted after the check can't be slept through. The handler
+        // runs once interrupts are enabled again.
+        __disable_irq();
+        if (sched_idle()) {
+            __DSB();
+            __WFI();
+        }
+        __enable_irq();
+    }
+}
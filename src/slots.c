@@ -0,0 +1,199 @@
+#include <string.h>
+
+#include "app_header.h"
+#include "boot_jump.h"
+#include "slots.h"
+
+#define SLOT_LOG_RECORDS (SLOT_LOG_SIZE / sizeof(slot_record_t))
+
+// Slot the bootloader would start, worked out on first use and again after
+// every record. Reading the logs while bank 2 is programming stalls the bus,
+// so the per-block checks must not do it each time.
+static bool     slot_running_known;
+static unsigned slot_running_cached;
+
+static const slot_record_t *slot_log(unsigned slot) {
+    return (const slot_record_t *)(SLOT_BASE(slot) + SLOT_SIZE - SLOT_LOG_SIZE);
+}
+
+static const app_header_t *slot_header(unsigned slot) {
+    const app_header_t *hdr = (const app_header_t *)(SLOT_BASE(slot) + APP_HEADER_OFFSET);
+
+    return (hdr->magic == APP_HEADER_MAGIC) ? hdr : NULL;
+}
+
+static bool slot_record_blank(const slot_record_t *rec) {
+    const uint32_t *w = (const uint32_t *)rec;
+
+    for (uint32_t i = 0; i < sizeof(*rec) / sizeof(uint32_t); i++) {
+        if (w[i] != 0xFFFFFFFFu) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool slot_record_valid(const slot_record_t *rec) {
+    return rec->magic == SLOT_RECORD_MAGIC
+        && rec->check == (rec->magic ^ rec->kind ^ rec->sequence ^ rec->crc);
+}
+
+// Records are appended in order, the first blank one ends the log
+static uint32_t slot_log_length(unsigned slot) {
+    const slot_record_t *log = slot_log(slot);
+    uint32_t n = 0;
+
+    while (n < SLOT_LOG_RECORDS && !slot_record_blank(&log[n])) {
+        n++;
+    }
+    return n;
+}
+
+static uint32_t slot_next_sequence(void) {
+    uint32_t sequence = 0;
+
+    for (unsigned s = 0; s < SLOT_COUNT; s++) {
+        const slot_record_t *log = slot_log(s);
+        uint32_t n = slot_log_length(s);
+
+        for (uint32_t i = 0; i < n; i++) {
+            if (slot_record_valid(&log[i]) && log[i].sequence > sequence) {
+                sequence = log[i].sequence;
+            }
+        }
+    }
+    return sequence + 1u;
+}
+
+// Let queued writes and deferred erases reach flash, so the slot holds what
+// it is going to hold
+static void slot_settle(void) {
+    flash_finish_async();
+    flash_wait_idle();
+}
+
+static bool slot_append(unsigned slot, slot_record_kind_t kind, uint32_t crc) {
+    uint32_t n = slot_log_length(slot);
+    if (n == SLOT_LOG_RECORDS) {
+        return false;
+    }
+
+    slot_record_t rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.magic    = SLOT_RECORD_MAGIC;
+    rec.kind     = kind;
+    rec.sequence = slot_next_sequence();
+    rec.crc      = crc;
+    rec.check    = rec.magic ^ rec.kind ^ rec.sequence ^ rec.crc;
+
+    // The log shares a sector with the image, auto-erase must not touch it
+    const slot_record_t *dst     = &slot_log(slot)[n];
+    uint32_t             options = flash_get_options();
+
+    flash_set_options(0);
+    flash_write_blocking((uint32_t)dst, (const uint8_t *)&rec, sizeof(rec));
+    flash_set_options(options);
+    slot_running_known = false;
+
+    return memcmp(dst, &rec, sizeof(rec)) == 0;
+}
+
+unsigned slot_of(uint32_t addr, uint32_t length) {
+    for (unsigned s = 0; s < SLOT_COUNT; s++) {
+        if (addr >= SLOT_BASE(s) && length <= SLOT_SIZE
+         && addr - SLOT_BASE(s) <= SLOT_SIZE - length) {
+            return s;
+        }
+    }
+    return SLOT_COUNT;
+}
+
+bool slot_is_active(unsigned slot, uint32_t *sequence) {
+    const app_header_t *hdr = slot_header(slot);
+    uint32_t            n   = slot_log_length(slot);
+
+    if (hdr == NULL || n == 0) {
+        return false;
+    }
+
+    const slot_record_t *rec = &slot_log(slot)[n - 1u];
+    if (!slot_record_valid(rec) || rec->kind != SLOT_ACTIVATE || rec->crc != hdr->crc) {
+        return false;
+    }
+
+    *sequence = rec->sequence;
+    return true;
+}
+
+bool slot_activate(unsigned slot) {
+    if (slot >= SLOT_COUNT || flash_is_busy()) {
+        return false;
+    }
+
+    slot_settle();
+
+    // Only an image with a header can be activated, its CRC ties the record
+    // to it
+    const app_header_t *hdr = slot_header(slot);
+    if (hdr == NULL || !app_check(SLOT_BASE(slot), SLOT_IMAGE_MAX)) {
+        return false;
+    }
+
+    return slot_append(slot, SLOT_ACTIVATE, hdr->crc);
+}
+
+bool slot_revoke(unsigned slot) {
+    uint32_t sequence;
+
+    if (slot >= SLOT_COUNT || flash_is_busy()) {
+        return false;
+    }
+
+    slot_settle();
+
+    if (!slot_is_active(slot, &sequence)) {
+        return false;
+    }
+
+    return slot_append(slot, SLOT_REVOKE, slot_header(slot)->crc);
+}
+
+// Newest activation, as app_find() picks it. The image was checked when it
+// was activated and can't change while it is protected, so its CRC isn't
+// checked again here.
+static unsigned slot_running(void) {
+    if (!slot_running_known) {
+        uint32_t best_sequence = 0;
+        uint32_t sequence;
+
+        slot_running_cached = SLOT_COUNT;
+        for (unsigned s = 0; s < SLOT_COUNT; s++) {
+            if (slot_is_active(s, &sequence)
+             && (slot_running_cached == SLOT_COUNT || sequence > best_sequence)) {
+                slot_running_cached = s;
+                best_sequence       = sequence;
+            }
+        }
+        slot_running_known = true;
+    }
+    return slot_running_cached;
+}
+
+bool slot_overlaps_active(uint32_t addr, uint32_t length) {
+    unsigned slot = slot_running();
+
+    return slot < SLOT_COUNT && length > 0
+        && addr < SLOT_BASE(slot) + SLOT_SIZE
+        && (addr >= SLOT_BASE(slot) || SLOT_BASE(slot) - addr < length);
+}
+
+uint8_t slot_active_sectors(void) {
+    unsigned slot = slot_running();
+    uint32_t first;
+
+    if (slot == SLOT_COUNT) {
+        return 0;
+    }
+    first = (SLOT_BASE(slot) - FLASH_BANK2_BASE) / FLASH_SECTOR_SIZE;
+    return (uint8_t)(((1u << (SLOT_SIZE / FLASH_SECTOR_SIZE)) - 1u) << first);
+}
@@ -1,14 +1,23 @@
 #include <string.h>
 
 #include "stm32h7xx.h"
+#include "cache.h"
+#include "dwt.h"
+#include "sections.h"
 
 extern void main(void);
 
 __attribute__((noreturn)) void program_startup() {
     __disable_irq();
 
+    // Boot time is measured from here, see boot_time_record()
+    dwt_init();
+
     SystemInit();
 
+    // Caches on for both paths; jump_to_application() turns them off again
+    cache_init();
+
     // Initialize .data section, clear .bss section
     extern unsigned char _etext;
     extern unsigned char _data;
@@ -32,6 +41,25 @@ __attribute__((noreturn)) void program_startup() {
     for (;;) ;
 }
 
+void tcm_init(void) {
+    extern unsigned char _itcm_load;
+    extern unsigned char _itcm_start;
+    extern unsigned char _itcm_end;
+    extern unsigned char _dtcm_load;
+    extern unsigned char _dtcm_data;
+    extern unsigned char _dtcm_edata;
+    extern unsigned char _dtcm_bss_start;
+    extern unsigned char _dtcm_bss_end;
+
+    memcpy(&_itcm_start, &_itcm_load, &_itcm_end - &_itcm_start);
+    memcpy(&_dtcm_data, &_dtcm_load, &_dtcm_edata - &_dtcm_data);
+    memset(&_dtcm_bss_start, 0, &_dtcm_bss_end - &_dtcm_bss_start);
+
+    // New code goes out through the data side, don't fetch ahead of it
+    __DSB();
+    __ISB();
+}
+
 #pragma GCC push_options
 #pragma GCC target("general-regs-only")
 void Reset_Handler() __attribute__((__interrupt__, noreturn));
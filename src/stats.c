@@ -0,0 +1,7 @@
+#include "stats.h"
+
+stats_t stats = {
+    .magic   = STATS_MAGIC,
+    .version = STATS_VERSION,
+    .size    = sizeof(stats_t),
+};
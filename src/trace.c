@@ -0,0 +1,120 @@
+#ifdef DFU_TRACE
+
+#include <string.h>
+
+#include "trace.h"
+#include "clock.h"
+#include "dwt.h"
+#include "tusb.h"
+
+// Records kept, power of two
+#ifndef TRACE_RECORDS
+#define TRACE_RECORDS 1024
+#endif
+
+_Static_assert((TRACE_RECORDS & (TRACE_RECORDS - 1)) == 0,
+               "Trace ring size must be a power of two");
+
+#define TRACE_MAGIC   0x43525444u // "DTRC"
+#define TRACE_VERSION 1
+
+// Dump header, followed by count records, oldest first
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t clock_hz;
+    uint32_t count;
+} trace_header_t;
+
+static trace_record_t trace_ring[TRACE_RECORDS];
+static uint32_t       trace_head;          // free-running, next slot to write
+static volatile bool  trace_frozen;
+
+static struct {
+    bool           active;
+    trace_header_t header;
+    uint32_t       pos;    // bytes of header + records sent
+    uint32_t       first;  // ring index of the oldest record
+} trace_dump;
+
+void trace_event(trace_event_t event, uint32_t arg) {
+    if (trace_frozen) {
+        return;
+    }
+
+    // Claiming the slot atomically is enough, whoever interrupts us gets
+    // the next one
+    uint32_t i = __atomic_fetch_add(&trace_head, 1, __ATOMIC_RELAXED);
+    trace_record_t *r = &trace_ring[i % TRACE_RECORDS];
+
+    r->cycles = dwt_cycles();
+    r->event  = event;
+    r->arg    = arg;
+}
+
+void trace_dump_start(void) {
+    if (trace_dump.active) {
+        return;
+    }
+
+    trace_frozen = true;
+
+    uint32_t head  = __atomic_load_n(&trace_head, __ATOMIC_RELAXED);
+    uint32_t count = (head < TRACE_RECORDS) ? head : TRACE_RECORDS;
+
+    trace_dump.header.magic    = TRACE_MAGIC;
+    trace_dump.header.version  = TRACE_VERSION;
+    trace_dump.header.clock_hz = CPU_CLOCK_HZ;
+    trace_dump.header.count    = count;
+    trace_dump.first  = head - count;
+    trace_dump.pos    = 0;
+    trace_dump.active = true;
+}
+
+void trace_dump_task(void) {
+    if (!trace_dump.active) {
+        return;
+    }
+
+    const uint32_t total = sizeof(trace_header_t)
+                         + trace_dump.header.count * sizeof(trace_record_t);
+
+    while (trace_dump.pos < total) {
+        uint32_t space = tud_cdc_write_available();
+        if (space == 0) {
+            break; // rest on a later pass
+        }
+
+        const uint8_t *src;
+        uint32_t       len;
+
+        if (trace_dump.pos < sizeof(trace_header_t)) {
+            src = (const uint8_t *)&trace_dump.header + trace_dump.pos;
+            len = sizeof(trace_header_t) - trace_dump.pos;
+        } else {
+            // One record (or what is left of it) at a time keeps the ring
+            // wrap-around simple
+            uint32_t off = trace_dump.pos - sizeof(trace_header_t);
+            uint32_t idx = (trace_dump.first + off / sizeof(trace_record_t)) % TRACE_RECORDS;
+            uint32_t in  = off % sizeof(trace_record_t);
+
+            src = (const uint8_t *)&trace_ring[idx] + in;
+            len = sizeof(trace_record_t) - in;
+        }
+
+        if (len > space) {
+            len = space;
+        }
+        trace_dump.pos += tud_cdc_write(src, len);
+    }
+    tud_cdc_write_flush();
+
+    if (trace_dump.pos == total) {
+        // Start the next capture from an empty ring
+        trace_head        = 0;
+        trace_dump.active = false;
+        trace_frozen      = false;
+    }
+}
+
+#endif
@@ -0,0 +1,52 @@
+#include <string.h>
+
+#include "uf2.h"
+
+uf2_kind_t uf2_check(const void *sector, uf2_block_t *block) {
+    memcpy(block, sector, sizeof(*block));
+
+    if (block->magic_start0 != UF2_MAGIC_START0
+     || block->magic_start1 != UF2_MAGIC_START1
+     || block->magic_end    != UF2_MAGIC_END) {
+        return UF2_NOT_UF2;
+    }
+
+    if (block->payload_size == 0 || block->payload_size > UF2_PAYLOAD_MAX
+     || block->block_no >= block->num_blocks) {
+        return UF2_BAD;
+    }
+
+    if (block->flags & (UF2_FLAG_NOT_MAIN_FLASH | UF2_FLAG_FILE_CONTAINER)) {
+        return UF2_SKIP;
+    }
+
+    // Files without a family ID are taken to be ours
+    if ((block->flags & UF2_FLAG_FAMILY_ID) && block->family_id != UF2_FAMILY_STM32H7) {
+        return UF2_SKIP;
+    }
+
+    return UF2_DATA;
+}
+
+void uf2_render(void *sector, uint32_t base, uint32_t size, uint32_t block_no) {
+    uf2_block_t *block = sector;
+    uint32_t     offset = block_no * UF2_PAYLOAD_SIZE;
+    uint32_t     length = (offset < size) ? size - offset : 0;
+
+    if (length > UF2_PAYLOAD_SIZE) {
+        length = UF2_PAYLOAD_SIZE;
+    }
+
+    memset(block, 0, sizeof(*block));
+    block->magic_start0 = UF2_MAGIC_START0;
+    block->magic_start1 = UF2_MAGIC_START1;
+    block->flags        = UF2_FLAG_FAMILY_ID;
+    block->target_addr  = base + offset;
+    block->payload_size = length;
+    block->block_no     = block_no;
+    block->num_blocks   = uf2_num_blocks(size);
+    block->family_id    = UF2_FAMILY_STM32H7;
+    block->magic_end    = UF2_MAGIC_END;
+
+    memcpy(block->data, (const void *)(base + offset), length);
+}
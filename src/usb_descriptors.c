@@ -1,4 +1,5 @@
 #include "tusb.h"
+#include "vendor_flash.h"
 
 /*
  * Clone ST's VID/PID to be compatible with existing OpenRTX build system
@@ -41,17 +42,22 @@ uint8_t const * tud_descriptor_device_cb(void)
 //--------------------------------------------------------------------+
 // Configuration Descriptor
 //--------------------------------------------------------------------+
-#define ALT_COUNT 1
+#define ALT_COUNT 2
 
 enum
 {
     ITF_NUM_CDC = 0,
     ITF_NUM_CDC_DATA,
     ITF_NUM_DFU_MODE,
+    ITF_NUM_VENDOR,
+    ITF_NUM_MSC,
     ITF_NUM_TOTAL
 };
 
-#define CONFIG_TOTAL_LEN  (TUD_CONFIG_DESC_LEN + TUD_CDC_DESC_LEN + TUD_DFU_DESC_LEN(ALT_COUNT))
+_Static_assert(ITF_NUM_VENDOR == VENDOR_ITF_NUM, "vendor_flash.c answers requests for this interface");
+
+#define CONFIG_TOTAL_LEN  (TUD_CONFIG_DESC_LEN + TUD_CDC_DESC_LEN + TUD_DFU_DESC_LEN(ALT_COUNT) \
+                         + TUD_VENDOR_DESC_LEN + TUD_MSC_DESC_LEN)
 #define FUNC_ATTRS        (DFU_ATTR_CAN_UPLOAD | DFU_ATTR_CAN_DOWNLOAD | DFU_ATTR_MANIFESTATION_TOLERANT)
 
 #define EPNUM_CDC_NOTIF 0x81
@@ -61,6 +67,9 @@ enum
 #define EPNUM_MSC_OUT   0x03
 #define EPNUM_MSC_IN    0x83
 
+#define EPNUM_VENDOR_OUT 0x04
+#define EPNUM_VENDOR_IN  0x84
+
 #define TUD_DFU_DESCRIPTOR_V011a(_itfnum, _alt_count, _stridx, _attr, _timeout, _xfer_size) \
   TU_XSTRCAT(TUD_DFU_ALT_,_alt_count)(_itfnum, 0, _stridx), \
   /* Function */ \
@@ -79,6 +88,12 @@ uint8_t const desc_fs_configuration[] =
     
     // Interface number, Alternate count, starting string index, attributes, detach timeout, transfer size
     TUD_DFU_DESCRIPTOR_V011a(ITF_NUM_DFU_MODE, ALT_COUNT, 5, FUNC_ATTRS, 1000, CFG_TUD_DFU_XFER_BUFSIZE),
+
+    // Interface number, string index, EP Out & IN address, EP size
+    TUD_VENDOR_DESCRIPTOR(ITF_NUM_VENDOR, 7, EPNUM_VENDOR_OUT, EPNUM_VENDOR_IN, CFG_TUD_VENDOR_EPSIZE),
+
+    // Interface number, string index, EP Out & EP In address, EP size
+    TUD_MSC_DESCRIPTOR(ITF_NUM_MSC, 8, EPNUM_MSC_OUT, EPNUM_MSC_IN, 64),
 };
 
 // Invoked when received GET CONFIGURATION DESCRIPTOR
@@ -148,9 +163,12 @@ static const char* string_desc_arr [] =
     "",                            // 3: Serials, should use chip ID
     "TinyUSB CDC",                 // 4: CDC Interface
     "@Internal Flash/0x08100000/8*128Kg", // 5: DFU Interface
+    "@Internal Flash (heatshrink)/0x08100000/8*128Kg", // 6: DFU alt 1, compressed
+    "Flash stream",                // 7: Vendor bulk interface
+    "UF2 volume",                  // 8: MSC interface
 };
 
-static uint16_t _desc_str[36 + 1];
+static uint16_t _desc_str[47 + 1]; // longest DFU alt string
 
 // Invoked when received GET STRING DESCRIPTOR request
 // Application return pointer to descriptor, whose contents must exist long
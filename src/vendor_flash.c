@@ -0,0 +1,393 @@
+#include <string.h>
+
+#include "tusb.h"
+#include "crc.h"
+#include "sections.h"
+#include "slots.h"
+#include "vendor_flash.h"
+#include "vendor_proto.h"
+
+// Whole internal flash may be read, only bank 2 written
+#define VND_READ_BASE  0x08000000u
+#define VND_READ_SIZE  (2u * 1024u * 1024u)
+#define VND_WRITE_BASE FLASH_BANK2_BASE
+#define VND_WRITE_SIZE (FLASH_SECTOR_COUNT * FLASH_SECTOR_SIZE)
+
+// Credit the host gets ahead of what has been taken out of the receive
+// buffer, i.e. the whole buffer
+#define VND_WINDOW CFG_TUD_VENDOR_RX_BUFSIZE
+
+typedef enum {
+    VND_IDLE = 0,    // waiting for a command
+    VND_WRITE,       // taking data into the flash stream
+    VND_ERASE,       // waiting for room in the flash queue
+    VND_DRAIN,       // CRC, READ, SYNC: waiting for everything to be written
+    VND_REPLY,       // status ready to go
+    VND_READ,        // sending READ data
+    VND_ERROR,       // dropping data until VND_REQ_RESET
+} vnd_state_t;
+
+static struct {
+    vnd_state_t state;
+    vnd_cmd_t   cmd;          // command being carried out
+    uint32_t    remaining;    // WRITE data still to come, READ data still to send
+    uint32_t    addr;         // READ position
+    uint8_t     sectors;      // ERASE
+
+    bool        streaming;    // flash stream open at next_addr
+    bool        begin;        // the current WRITE needs a new stream
+    bool        finishing;    // SYNC: finish job queued
+    uint32_t    next_addr;
+
+    uint16_t    seq;          // last command completed
+    uint32_t    consumed;     // OUT bytes taken since the reset
+    uint32_t    reported;     // credit in the last status sent
+
+    uint8_t     reply_status; // VND_REPLY
+    uint32_t    reply_value;
+    vnd_state_t reply_next;
+
+    volatile flash_error_t flash_error; // latched by vendor_job_done_cb()
+} vnd;
+
+// Flash engine completion, runs in the FLASH interrupt
+ITCM_FUNC void vendor_job_done_cb(flash_job_type_t type, uint32_t addr, flash_error_t err) {
+    (void)type;
+    (void)addr;
+
+    if (err != FLASH_ERR_NONE && vnd.flash_error == FLASH_ERR_NONE) {
+        vnd.flash_error = err;
+    }
+}
+
+static bool vnd_in_range(uint32_t addr, uint32_t length, uint32_t base, uint32_t size) {
+    return addr >= base && length <= size && addr - base <= size - length;
+}
+
+static bool vnd_send_status(uint8_t status, uint8_t cmd, uint32_t value) {
+    if (tud_vendor_write_available() < sizeof(vnd_status_t)) {
+        return false;
+    }
+
+    const vnd_status_t st = {
+        .status = status,
+        .cmd    = cmd,
+        .seq    = vnd.seq,
+        .credit = vnd.consumed + VND_WINDOW,
+        .value  = value,
+    };
+    tud_vendor_write(&st, sizeof(st));
+    tud_vendor_write_flush();
+
+    vnd.reported = st.credit;
+    return true;
+}
+
+static void vnd_reply(uint8_t status, uint32_t value, vnd_state_t next) {
+    vnd.reply_status = status;
+    vnd.reply_value  = value;
+    vnd.reply_next   = next;
+    vnd.state        = VND_REPLY;
+}
+
+static void vnd_fail(uint8_t status) {
+    vnd_reply(status, 0, VND_ERROR);
+}
+
+static void vnd_complete(void) {
+    vnd.seq   = vnd.cmd.seq;
+    vnd.state = VND_IDLE;
+}
+
+static bool vnd_start_command(void) {
+    if (tud_vendor_available() < sizeof(vnd_cmd_t)) {
+        // Nothing to do: tell the host about buffer space freed up meanwhile
+        if (vnd.consumed + VND_WINDOW - vnd.reported >= VND_WINDOW / 2) {
+            return vnd_send_status(VND_OK, 0, 0);
+        }
+        return false;
+    }
+
+    tud_vendor_read(&vnd.cmd, sizeof(vnd.cmd));
+    vnd.consumed += sizeof(vnd.cmd);
+
+    if (vnd.cmd.seq != (uint16_t)(vnd.seq + 1u)) {
+        vnd_fail(VND_ERR_SEQ);
+        return true;
+    }
+
+    const uint32_t addr   = vnd.cmd.addr;
+    const uint32_t length = vnd.cmd.length;
+
+    flash_set_owner(FLASH_OWNER_VENDOR);
+
+    switch (vnd.cmd.cmd) {
+        case VND_CMD_WRITE:
+            if (length == 0 || !vnd_in_range(addr, length, VND_WRITE_BASE, VND_WRITE_SIZE)
+             || slot_overlaps_active(addr, length)) {
+                vnd_fail(VND_ERR_ADDRESS);
+                break;
+            }
+            vnd.begin     = !vnd.streaming || addr != vnd.next_addr;
+
+            // A new stream starts on a flash word, like a DfuSe block
+            if (vnd.begin && (addr & (FLASH_WRITE_SIZE - 1u)) != 0) {
+                vnd_fail(VND_ERR_ADDRESS);
+                break;
+            }
+            vnd.remaining = length;
+            vnd.state     = VND_WRITE;
+            break;
+
+        case VND_CMD_ERASE:
+        {
+            if (length == 0 || !vnd_in_range(addr, length, VND_WRITE_BASE, VND_WRITE_SIZE)) {
+                vnd_fail(VND_ERR_ADDRESS);
+                break;
+            }
+            uint32_t first = (addr - VND_WRITE_BASE) / FLASH_SECTOR_SIZE;
+            uint32_t last  = (addr - VND_WRITE_BASE + length - 1u) / FLASH_SECTOR_SIZE;
+            vnd.sectors = (uint8_t)(((2u << last) - 1u) & ~((1u << first) - 1u));
+            if (vnd.sectors & slot_active_sectors()) {
+                vnd_fail(VND_ERR_ADDRESS);
+                break;
+            }
+            vnd.state   = VND_ERASE;
+            break;
+        }
+
+        case VND_CMD_CRC:
+        case VND_CMD_READ:
+            if (!(vnd.cmd.cmd == VND_CMD_CRC && length == 0)
+             && !vnd_in_range(addr, length, VND_READ_BASE, VND_READ_SIZE)) {
+                vnd_fail(VND_ERR_ADDRESS);
+                break;
+            }
+            vnd.state = VND_DRAIN;
+            break;
+
+        case VND_CMD_SYNC:
+        case VND_CMD_ACTIVATE:
+        case VND_CMD_REVOKE:
+            vnd.state = VND_DRAIN;
+            break;
+
+        default:
+            vnd_fail(VND_ERR_COMMAND);
+            break;
+    }
+    return true;
+}
+
+static bool vnd_write_data(void) {
+    if (vnd.begin) {
+        if (!flash_stream_begin(vnd.cmd.addr)) {
+            return false;
+        }
+        vnd.begin     = false;
+        vnd.streaming = true;
+        vnd.next_addr = vnd.cmd.addr;
+    }
+
+    uint32_t available = tud_vendor_available();
+    if (available == 0) {
+        return false;
+    }
+
+    uint32_t space;
+    uint8_t *dst = flash_stream_space(&space);
+    if (dst == NULL) {
+        return false;
+    }
+
+    // Straight from the receive buffer into a flash job
+    uint32_t n = vnd.remaining;
+    if (n > space)     n = space;
+    if (n > available) n = available;
+
+    n = tud_vendor_read(dst, n);
+    flash_stream_commit(n);
+
+    vnd.consumed  += n;
+    vnd.next_addr += n;
+    vnd.remaining -= n;
+
+    if (vnd.remaining == 0) {
+        vnd_complete();
+    }
+    return true;
+}
+
+// Everything queued has to be on flash before CRC, READ, SYNC and the slot
+// commands answer
+static bool vnd_drain(void) {
+    if (vnd.streaming) {
+        if (!flash_stream_flush()) {
+            return false;
+        }
+        vnd.streaming = false;
+    }
+
+    if ((vnd.cmd.cmd == VND_CMD_SYNC || vnd.cmd.cmd == VND_CMD_ACTIVATE
+      || vnd.cmd.cmd == VND_CMD_REVOKE) && !vnd.finishing) {
+        vnd.finishing = flash_finish_async();
+        if (!vnd.finishing) {
+            return false;
+        }
+    }
+
+    if (flash_is_busy()) {
+        return false;
+    }
+
+    uint32_t bytes;
+    vnd.seq = vnd.cmd.seq;
+
+    switch (vnd.cmd.cmd) {
+        case VND_CMD_CRC:
+            vnd_reply(VND_OK, (vnd.cmd.length == 0) ? flash_session_crc(&bytes)
+                                                    : crc32_update(0, (const void *)vnd.cmd.addr,
+                                                                   vnd.cmd.length),
+                      VND_IDLE);
+            break;
+
+        case VND_CMD_READ:
+            vnd.addr      = vnd.cmd.addr;
+            vnd.remaining = vnd.cmd.length;
+            vnd_reply(VND_OK, vnd.cmd.length, VND_READ);
+            break;
+
+        case VND_CMD_ACTIVATE:
+        case VND_CMD_REVOKE:
+        {
+            vnd.finishing = false;
+
+            bool ok = (vnd.cmd.cmd == VND_CMD_ACTIVATE) ? slot_activate(vnd.cmd.addr)
+                                                        : slot_revoke(vnd.cmd.addr);
+            if (ok) {
+                vnd_reply(VND_OK, 0, VND_IDLE);
+            } else {
+                vnd_fail(VND_ERR_SLOT);
+            }
+            break;
+        }
+
+        default:
+            vnd.finishing = false;
+            vnd_reply(VND_OK, flash_session_crc(&bytes), VND_IDLE);
+            break;
+    }
+    return true;
+}
+
+static bool vnd_read_data(void) {
+    if (vnd.remaining == 0) {
+        tud_vendor_write_flush();
+        vnd.state = VND_IDLE;
+        return true;
+    }
+
+    uint32_t n = tud_vendor_write_available();
+    if (n == 0) {
+        return false;
+    }
+    if (n > vnd.remaining) {
+        n = vnd.remaining;
+    }
+
+    // Flash is idle, so it can go out straight from its mapped address
+    n = tud_vendor_write((const void *)vnd.addr, n);
+    vnd.addr      += n;
+    vnd.remaining -= n;
+    return true;
+}
+
+// One step of the command state machine, true if it made progress
+static bool vnd_step(void) {
+    switch (vnd.state) {
+        case VND_IDLE:
+            return vnd_start_command();
+
+        case VND_WRITE:
+            return vnd_write_data();
+
+        case VND_ERASE:
+            if (!flash_erase_sectors_async(vnd.sectors)) {
+                return false;
+            }
+            vnd_complete();
+            return true;
+
+        case VND_DRAIN:
+            return vnd_drain();
+
+        case VND_REPLY:
+            if (!vnd_send_status(vnd.reply_status, vnd.cmd.cmd, vnd.reply_value)) {
+                return false;
+            }
+            vnd.state = vnd.reply_next;
+            return true;
+
+        case VND_READ:
+            return vnd_read_data();
+
+        case VND_ERROR:
+        {
+            uint8_t discard[64];
+            return tud_vendor_read(discard, sizeof(discard)) != 0;
+        }
+    }
+    return false;
+}
+
+void vendor_task(void) {
+    if (!tud_vendor_mounted()) {
+        return;
+    }
+
+    flash_error_t err = vnd.flash_error;
+    if (err != FLASH_ERR_NONE && vnd.state != VND_ERROR && vnd.state != VND_REPLY) {
+        vnd_fail((err == FLASH_ERR_WRITE_PROTECT) ? VND_ERR_WRITE_PROTECT : VND_ERR_PROGRAM);
+    }
+
+    while (vnd_step()) { }
+}
+
+// Vendor control requests on our interface
+bool tud_vendor_control_xfer_cb(uint8_t rhport, uint8_t stage, tusb_control_request_t const *request) {
+    if (request->bmRequestType_bit.recipient != TUSB_REQ_RCPT_INTERFACE
+     || request->wIndex != VENDOR_ITF_NUM) {
+        return false;
+    }
+    if (stage != CONTROL_STAGE_SETUP) {
+        return true;
+    }
+
+    switch (request->bRequest) {
+        case VND_REQ_RESET:
+            // The flash stream stays as it is: a WRITE to the address it
+            // stopped at carries on with it, anything else restarts it
+            tud_vendor_read_flush();
+            vnd.state       = VND_IDLE;
+            vnd.seq         = 0;
+            vnd.consumed    = 0;
+            vnd.reported    = VND_WINDOW;
+            vnd.finishing   = false;
+            vnd.flash_error = FLASH_ERR_NONE;
+            return tud_control_status(rhport, request);
+
+        case VND_REQ_INFO:
+        {
+            static vnd_info_t info = {
+                .version    = VND_PROTO_VERSION,
+                .window     = VND_WINDOW,
+                .write_base = VND_WRITE_BASE,
+                .write_size = VND_WRITE_SIZE,
+                .read_base  = VND_READ_BASE,
+                .read_size  = VND_READ_SIZE,
+            };
+            return tud_control_xfer(rhport, request, &info, sizeof(info));
+        }
+    }
+    return false;
+}
@@ -0,0 +1,96 @@
+#!/usr/bin/env python3
+"""Fill in the application header the bootloader checks before starting it.
+
+The application has to reserve the header space (include/app_header.h) at
+APP_HEADER_OFFSET from its base, erased (0xFF) or zeroed:
+
+    apphdr.py firmware.bin -o firmware-hdr.bin --version 42
+    apphdr.py --check firmware-hdr.bin
+
+An image for an application slot (include/slots.h) has to be linked for the
+slot's base address and fit in front of the slot's log, --slot checks that.
+"""
+
+import argparse
+import struct
+import sys
+import zlib
+
+# Must match include/app_header.h
+HEADER_OFFSET = 0x400
+HEADER_MAGIC = 0x48505041  # "APPH"
+HEADER = struct.Struct("<IIII")  # magic, length, crc, version
+CRC_OFFSET = HEADER_OFFSET + 8
+MAX_SIZE = 1024 * 1024
+SLOT_IMAGE_MAX = 512 * 1024 - 1024  # include/slots.h
+
+
+def image_crc(image):
+    # Everything but the crc field
+    crc = zlib.crc32(image[:CRC_OFFSET])
+    return zlib.crc32(image[CRC_OFFSET + 4:], crc)
+
+
+def add_header(image, version, max_size):
+    end = HEADER_OFFSET + HEADER.size
+    if len(image) < end:
+        image = image + b"\xff" * (end - len(image))
+    if len(image) > max_size:
+        sys.exit(f"image is {len(image)} bytes, only {max_size} fit")
+
+    reserved = image[HEADER_OFFSET:end]
+    if reserved not in (b"\xff" * HEADER.size, b"\x00" * HEADER.size) \
+            and HEADER.unpack(reserved)[0] != HEADER_MAGIC:
+        sys.exit(f"no room for the header at 0x{HEADER_OFFSET:x}: "
+                 "the application has to reserve it")
+
+    image = bytearray(image)
+    HEADER.pack_into(image, HEADER_OFFSET, HEADER_MAGIC, len(image), 0, version)
+    struct.pack_into("<I", image, CRC_OFFSET, image_crc(image))
+    return bytes(image)
+
+
+def check(image, max_size):
+    magic, length, crc, version = HEADER.unpack_from(image, HEADER_OFFSET)
+    if magic != HEADER_MAGIC:
+        print("no header")
+        return False
+    if length > len(image):
+        print(f"header says {length} bytes, file has {len(image)}")
+        return False
+    if length > max_size:
+        print(f"image is {length} bytes, only {max_size} fit")
+        return False
+
+    actual = image_crc(image[:length])
+    print(f"length {length}  crc {crc:08x}  version {version}  "
+          + ("ok" if actual == crc else f"BAD, image crc {actual:08x}"))
+    return actual == crc
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    ap.add_argument("image", help="application binary")
+    ap.add_argument("-o", "--output", help="output binary (default: in place)")
+    ap.add_argument("--version", type=lambda v: int(v, 0), default=0,
+                    help="version number to put in the header")
+    ap.add_argument("--check", action="store_true", help="only verify an existing header")
+    ap.add_argument("--slot", action="store_true",
+                    help="image for an application slot rather than all of bank 2")
+    args = ap.parse_args()
+    max_size = SLOT_IMAGE_MAX if args.slot else MAX_SIZE
+
+    with open(args.image, "rb") as f:
+        image = f.read()
+
+    if args.check:
+        sys.exit(0 if check(image, max_size) else 1)
+
+    image = add_header(image, args.version, max_size)
+    with open(args.output or args.image, "wb") as f:
+        f.write(image)
+    check(image, max_size)
+
+
+if __name__ == "__main__":
+    main()
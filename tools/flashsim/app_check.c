@@ -0,0 +1,23 @@
+#include "app_header.h"
+#include "boot_jump.h"
+#include "crc.h"
+
+// Stand-in for the image check of src/boot_jump.c: header length and CRC.
+// Test images have no real vector table, so an image without a header
+// passes as it is.
+bool app_check(uint32_t base, uint32_t max_size) {
+    const app_header_t *hdr = (const app_header_t *)(base + APP_HEADER_OFFSET);
+
+    if (hdr->magic != APP_HEADER_MAGIC) {
+        return true;
+    }
+    if (hdr->length < APP_HEADER_OFFSET + sizeof(app_header_t) || hdr->length > max_size) {
+        return false;
+    }
+
+    const uint8_t *start = (const uint8_t *)base;
+    const uint8_t *after = (const uint8_t *)&hdr->crc + sizeof(hdr->crc);
+
+    uint32_t crc = crc32_update(0, start, (uint32_t)((const uint8_t *)&hdr->crc - start));
+    return crc32_update(crc, after, hdr->length - (uint32_t)(after - start)) == hdr->crc;
+}
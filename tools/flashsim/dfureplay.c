@@ -0,0 +1,635 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+
+#include "tusb.h"
+#include "clock.h"
+#include "crc.h"
+#include "dfu_flash.h"
+#include "flash_model.h"
+
+/*
+ * Replays the control transfers of a usbmon capture (pcap or pcapng, from
+ * Wireshark or `tcpdump -i usbmonN`) of a dfu-util session into the DfuSe
+ * callbacks of src/dfu_tinyusb.c, with the flash model underneath. Time
+ * between requests is taken from the capture. Every GETSTATUS, GETSTATE and
+ * UPLOAD answer is compared with what the real device sent, and the host
+ * wait implied by bwPollTimeout is added up per kind of request.
+ */
+
+#define US_TO_CYCLES(us) ((uint64_t)(us) * (CPU_CLOCK_HZ / 1000000u))
+
+#define LINKTYPE_USB_LINUX         189 // 48 byte usbmon header
+#define LINKTYPE_USB_LINUX_MMAPPED 220 // 64 byte usbmon header
+
+#define USB_REQ_SET_CONFIGURATION 0x09
+#define USB_REQ_SET_INTERFACE     0x0B
+
+enum {
+    DFU_REQ_DETACH = 0,
+    DFU_REQ_DNLOAD,
+    DFU_REQ_UPLOAD,
+    DFU_REQ_GETSTATUS,
+    DFU_REQ_CLRSTATUS,
+    DFU_REQ_GETSTATE,
+    DFU_REQ_ABORT,
+};
+
+// One control transfer, submission and completion put together
+typedef struct {
+    uint64_t id;
+    uint64_t ts_us;       // submission
+    uint64_t done_us;     // completion
+    uint8_t  devnum;
+    uint8_t  setup[8];
+    int32_t  status;      // 0, or -EPIPE for a stall
+    bool     complete;
+    uint32_t length;
+    uint8_t *data;        // OUT data from the submission, IN data from the completion
+} xfer_t;
+
+static struct {
+    xfer_t  *v;
+    uint32_t count;
+    uint32_t cap;
+} xfers;
+
+// What GETSTATUS answered, grouped by the request it was about
+typedef enum {
+    KIND_DATA = 0,
+    KIND_SET_ADDRESS,
+    KIND_ERASE,
+    KIND_COMMAND,
+    KIND_MANIFEST,
+    KIND_OTHER,
+    KIND_COUNT,
+} kind_t;
+
+static const char *const kind_names[KIND_COUNT] = {
+    "data block", "set address", "erase", "other command", "manifest", "other",
+};
+
+static struct {
+    uint32_t polls;
+    uint32_t busy_capture;
+    uint32_t busy_replay;
+    uint64_t wait_capture_ms;  // sum of bwPollTimeout the device sent
+    uint64_t wait_replay_ms;   // ... and the replay
+    uint64_t gap_us;           // how long the host actually waited
+} totals[KIND_COUNT];
+
+static struct {
+    uint32_t tolerance_ms;
+    int      devnum;           // -1: the first device with a DFU request
+    bool     verbose;
+} opt = { .tolerance_ms = 2, .devnum = -1 };
+
+static uint32_t mismatches;
+
+// -- Capture reading -------------------------------------------------------
+
+static uint16_t rd16(const uint8_t *p) { return (uint16_t)(p[0] | p[1] << 8); }
+static uint32_t rd32(const uint8_t *p) { return rd16(p) | (uint32_t)rd16(p + 2) << 16; }
+static uint64_t rd64(const uint8_t *p) { return rd32(p) | (uint64_t)rd32(p + 4) << 32; }
+
+static void usbmon_packet(const uint8_t *pkt, uint32_t len, uint32_t linktype) {
+    uint32_t hdr = (linktype == LINKTYPE_USB_LINUX_MMAPPED) ? 64 : 48;
+    if (len < hdr) {
+        return;
+    }
+
+    uint64_t id       = rd64(pkt);
+    uint8_t  type     = pkt[8];
+    uint8_t  xfer     = pkt[9];
+    uint8_t  epnum    = pkt[10] & 0x7F;
+    uint8_t  devnum   = pkt[11];
+    bool     setup_ok = pkt[14] == 0;
+    uint64_t ts_us    = rd64(pkt + 16) * 1000000u + rd32(pkt + 24);
+    int32_t  status   = (int32_t)rd32(pkt + 28);
+    uint32_t captured = rd32(pkt + 36);
+
+    if (xfer != 2 || epnum != 0) {
+        return; // control endpoint only
+    }
+    if (captured > len - hdr) {
+        captured = len - hdr;
+    }
+
+    if (type == 'S' && setup_ok) {
+        if (xfers.count == xfers.cap) {
+            xfers.cap = xfers.cap ? 2 * xfers.cap : 1024;
+            xfers.v   = realloc(xfers.v, xfers.cap * sizeof(xfer_t));
+        }
+
+        xfer_t *x = &xfers.v[xfers.count++];
+        memset(x, 0, sizeof(*x));
+        x->id     = id;
+        x->ts_us  = ts_us;
+        x->devnum = devnum;
+        memcpy(x->setup, pkt + 40, 8);
+
+        if (!(x->setup[0] & 0x80) && captured > 0) {
+            x->data   = malloc(captured);
+            x->length = captured;
+            memcpy(x->data, pkt + hdr, captured);
+        }
+        return;
+    }
+
+    if (type == 'C' || type == 'E') {
+        // usbmon ids are URB addresses and get reused; take the latest
+        for (uint32_t i = xfers.count; i-- > 0; ) {
+            xfer_t *x = &xfers.v[i];
+            if (x->id != id || x->complete) {
+                continue;
+            }
+
+            x->complete = true;
+            x->done_us  = ts_us;
+            x->status   = (type == 'E') ? -1 : status;
+
+            if ((x->setup[0] & 0x80) && captured > 0) {
+                x->data   = malloc(captured);
+                x->length = captured;
+                memcpy(x->data, pkt + hdr, captured);
+            }
+            return;
+        }
+    }
+}
+
+static bool read_pcap(FILE *f, const uint8_t *ghdr) {
+    uint32_t magic = rd32(ghdr);
+    if (magic != 0xA1B2C3D4u && magic != 0xA1B23C4Du) {
+        fprintf(stderr, "dfureplay: big endian captures are not supported\n");
+        return false;
+    }
+    uint32_t linktype = rd32(ghdr + 20);
+
+    if (linktype != LINKTYPE_USB_LINUX && linktype != LINKTYPE_USB_LINUX_MMAPPED) {
+        fprintf(stderr, "dfureplay: link type %u is not a usbmon capture\n", linktype);
+        return false;
+    }
+
+    uint8_t  rec[16];
+    uint8_t *pkt = malloc(65536 + 64);
+    while (fread(rec, 1, sizeof(rec), f) == sizeof(rec)) {
+        uint32_t len = rd32(rec + 8);
+        if (len > 65536 + 64 || fread(pkt, 1, len, f) != len) {
+            break;
+        }
+        // Record timestamps are not needed, usbmon has its own
+        usbmon_packet(pkt, len, linktype);
+    }
+    free(pkt);
+    return true;
+}
+
+static bool read_pcapng(FILE *f) {
+    uint32_t linktypes[16] = { 0 };
+    uint32_t interfaces    = 0;
+    uint8_t  bh[8];
+
+    rewind(f);
+    while (fread(bh, 1, sizeof(bh), f) == sizeof(bh)) {
+        uint32_t type = rd32(bh);
+        uint32_t len  = rd32(bh + 4);
+        if (len < 12 || len > (1u << 24)) {
+            break;
+        }
+
+        uint8_t *body = malloc(len - 8);
+        if (fread(body, 1, len - 8, f) != len - 8) {
+            free(body);
+            break;
+        }
+
+        if (type == 0x0A0D0D0Au && rd32(body) != 0x1A2B3C4Du) {
+            fprintf(stderr, "dfureplay: big endian captures are not supported\n");
+            free(body);
+            return false;
+        }
+        if (type == 1 && interfaces < 16) {
+            linktypes[interfaces++] = rd16(body);
+        }
+        if (type == 6 && len >= 32) {
+            uint32_t itf      = rd32(body);
+            uint32_t captured = rd32(body + 12);
+            if (itf < interfaces && captured <= len - 32) {
+                usbmon_packet(body + 20, captured, linktypes[itf]);
+            }
+        }
+        free(body);
+    }
+    return true;
+}
+
+static bool read_capture(const char *path) {
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {
+        perror(path);
+        return false;
+    }
+
+    uint8_t ghdr[24];
+    bool ok = fread(ghdr, 1, sizeof(ghdr), f) == sizeof(ghdr);
+    if (ok) {
+        ok = (rd32(ghdr) == 0x0A0D0D0Au) ? read_pcapng(f) : read_pcap(f, ghdr);
+    }
+    fclose(f);
+    return ok;
+}
+
+// -- TinyUSB DFU class, as far as the callbacks can tell --------------------
+
+static struct {
+    uint8_t     itf;
+    uint8_t     alt;
+    dfu_state_t state;
+    uint8_t     status;
+
+    uint16_t       block;     // last DNLOAD
+    uint16_t       length;
+    const uint8_t *buffer;
+    uint8_t        xfer_buf[CFG_TUD_DFU_XFER_BUFSIZE];
+
+    uint64_t    last_us;
+} usb;
+
+static const char *state_name(uint8_t state) {
+    static const char *const names[] = {
+        "appIDLE", "appDETACH", "dfuIDLE", "dfuDNLOAD-SYNC", "dfuDNBUSY",
+        "dfuDNLOAD-IDLE", "dfuMANIFEST-SYNC", "dfuMANIFEST", "dfuMANIFEST-WAIT-RESET",
+        "dfuUPLOAD-IDLE", "dfuERROR",
+    };
+    return (state < sizeof(names) / sizeof(names[0])) ? names[state] : "?";
+}
+
+static kind_t request_kind(void) {
+    if (usb.state == DFU_MANIFEST_SYNC || usb.state == DFU_MANIFEST) {
+        return KIND_MANIFEST;
+    }
+    if (usb.state != DFU_DNLOAD_SYNC && usb.state != DFU_DNBUSY) {
+        return KIND_OTHER;
+    }
+    if (usb.block >= 2) {
+        return KIND_DATA;
+    }
+    if (usb.length > 0 && usb.buffer[0] == 0x21) return KIND_SET_ADDRESS;
+    if (usb.length > 0 && usb.buffer[0] == 0x41) return KIND_ERASE;
+    return KIND_COMMAND;
+}
+
+static uint32_t poll_timeout(const uint8_t *p) {
+    return p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16;
+}
+
+static void mismatch(uint32_t n, const xfer_t *x, const char *fmt, ...)
+    __attribute__((format(printf, 3, 4)));
+
+static void mismatch(uint32_t n, const xfer_t *x, const char *fmt, ...) {
+    va_list ap;
+
+    mismatches++;
+    if (!opt.verbose && mismatches > 20) {
+        return;
+    }
+
+    printf("#%-6u %10.3f s  ", n, x->ts_us / 1e6);
+    va_start(ap, fmt);
+    vprintf(fmt, ap);
+    va_end(ap);
+    printf("\n");
+}
+
+static void do_getstatus(uint32_t n, const xfer_t *x, uint64_t next_us) {
+    tud_dfu_get_status_request_t req = {
+        .state  = usb.state,
+        .block  = usb.block,
+        .length = usb.length,
+        .buffer = usb.buffer,
+    };
+    tud_dfu_get_status_control_t ctl  = { 0 };
+    dfu_status_response_t        resp = { 0 };
+    kind_t kind = request_kind();
+
+    if (!tud_dfu_get_status_cb(usb.alt, &req, &resp, &ctl)) {
+        // TinyUSB's own handling of the states the callback leaves to it
+        switch (usb.state) {
+            case DFU_DNLOAD_SYNC:
+            case DFU_DNBUSY:        usb.state = DFU_DNLOAD_IDLE; break;
+            case DFU_MANIFEST_SYNC:
+            case DFU_MANIFEST:      usb.state = DFU_IDLE;        break; // manifestation tolerant
+            default:                                             break;
+        }
+        resp.bStatus = usb.status;
+        resp.bState  = usb.state;
+    }
+
+    usb.state  = resp.bState;
+    usb.status = resp.bStatus;
+
+    uint32_t replay_ms = poll_timeout(resp.bwPollTimeout);
+    totals[kind].polls++;
+    totals[kind].wait_replay_ms += replay_ms;
+    totals[kind].busy_replay    += (resp.bState == DFU_DNBUSY || resp.bState == DFU_MANIFEST);
+
+    if (x->length < 6) {
+        return; // stalled or not captured, nothing to compare
+    }
+
+    const uint8_t *cap = x->data;
+    uint32_t capture_ms = poll_timeout(&cap[1]);
+
+    totals[kind].wait_capture_ms += capture_ms;
+    totals[kind].busy_capture    += (cap[4] == DFU_DNBUSY || cap[4] == DFU_MANIFEST);
+    if (next_us > x->done_us) {
+        totals[kind].gap_us += next_us - x->done_us;
+    }
+
+    if (cap[0] != resp.bStatus || cap[4] != resp.bState) {
+        mismatch(n, x, "GETSTATUS (%s): device %s status %u, replay %s status %u",
+                 kind_names[kind], state_name(cap[4]), cap[0], state_name(resp.bState), resp.bStatus);
+
+        // Follow the device so the rest of the capture still makes sense
+        usb.state  = cap[4];
+        usb.status = cap[0];
+    } else {
+        uint32_t diff = (capture_ms > replay_ms) ? capture_ms - replay_ms : replay_ms - capture_ms;
+        if (diff > opt.tolerance_ms) {
+            mismatch(n, x, "GETSTATUS (%s, %s): device bwPollTimeout %u ms, replay %u ms",
+                     kind_names[kind], state_name(cap[4]), capture_ms, replay_ms);
+        }
+    }
+}
+
+static void do_dnload(const xfer_t *x, uint16_t block, uint16_t length) {
+    if (length > CFG_TUD_DFU_XFER_BUFSIZE) {
+        fprintf(stderr, "dfureplay: %u byte DNLOAD, rebuild with -DDFU_XFER_SIZE=%u or more\n",
+                length, length);
+        exit(2);
+    }
+
+    usb.block  = block;
+    usb.length = length;
+    usb.buffer = usb.xfer_buf;
+
+    if (length == 0) {
+        usb.state = DFU_MANIFEST_SYNC;
+        return;
+    }
+
+    memcpy(usb.xfer_buf, x->data, (x->length < length) ? x->length : length);
+    usb.state = DFU_DNLOAD_SYNC;
+}
+
+static void do_upload(uint32_t n, const xfer_t *x, uint16_t block, uint16_t length) {
+    static uint8_t data[CFG_TUD_DFU_XFER_BUFSIZE];
+
+    if (length > sizeof(data)) {
+        length = sizeof(data);
+    }
+
+    uint16_t got = tud_dfu_upload_cb(usb.alt, block, data, length);
+    usb.state = (got < length) ? DFU_IDLE : DFU_UPLOAD_IDLE;
+
+    if (x->status != 0) {
+        return;
+    }
+    if (got != x->length) {
+        mismatch(n, x, "UPLOAD block %u: device sent %u bytes, replay %u", block, x->length, got);
+    } else if (block == 0 && memcmp(data, x->data, got) != 0) {
+        mismatch(n, x, "UPLOAD block 0: contents differ");
+    }
+}
+
+static void replay(void) {
+    uint32_t dfu_requests = 0;
+
+    usb.state = DFU_IDLE;
+
+    for (uint32_t n = 0; n < xfers.count; n++) {
+        const xfer_t *x = &xfers.v[n];
+        if (!x->complete || x->devnum != opt.devnum) {
+            continue;
+        }
+
+        uint8_t  type   = x->setup[0];
+        uint8_t  req    = x->setup[1];
+        uint16_t value  = rd16(&x->setup[2]);
+        uint16_t index  = rd16(&x->setup[4]);
+        uint16_t length = rd16(&x->setup[6]);
+
+        // Time passes for the flash in between
+        if (usb.last_us != 0 && x->ts_us > usb.last_us) {
+            flashsim_advance(US_TO_CYCLES(x->ts_us - usb.last_us));
+        }
+        usb.last_us = x->ts_us;
+
+        if (type == 0x00 && req == USB_REQ_SET_CONFIGURATION) {
+            tud_mount_cb();
+            usb.state = DFU_IDLE;
+            continue;
+        }
+        if (type == 0x01 && req == USB_REQ_SET_INTERFACE && index == usb.itf) {
+            usb.alt   = (uint8_t)value;
+            usb.state = DFU_IDLE;
+            continue;
+        }
+        if ((type & 0x7F) != 0x21 || index != usb.itf) {
+            continue;
+        }
+
+        dfu_requests++;
+
+        // Start of the next request, for the real host wait
+        uint64_t next_us = 0;
+        for (uint32_t m = n + 1; m < xfers.count; m++) {
+            if (xfers.v[m].devnum == opt.devnum) {
+                next_us = xfers.v[m].ts_us;
+                break;
+            }
+        }
+
+        switch (req) {
+            case DFU_REQ_DNLOAD:
+                if (x->status == 0) {
+                    do_dnload(x, value, length);
+                }
+                break;
+
+            case DFU_REQ_UPLOAD:
+                do_upload(n, x, value, length);
+                break;
+
+            case DFU_REQ_GETSTATUS:
+                do_getstatus(n, x, next_us);
+                break;
+
+            case DFU_REQ_GETSTATE:
+                if (x->length >= 1 && x->data[0] != usb.state) {
+                    mismatch(n, x, "GETSTATE: device %s, replay %s",
+                             state_name(x->data[0]), state_name(usb.state));
+                    usb.state = x->data[0];
+                }
+                break;
+
+            case DFU_REQ_CLRSTATUS:
+                usb.state  = DFU_IDLE;
+                usb.status = DFU_STATUS_OK;
+                break;
+
+            case DFU_REQ_ABORT:
+                tud_dfu_abort_cb(usb.alt);
+                usb.state = DFU_IDLE;
+                break;
+
+            case DFU_REQ_DETACH:
+                tud_dfu_detach_cb();
+                break;
+        }
+    }
+
+    printf("%u DFU requests to device %d interface %u\n", dfu_requests, opt.devnum, usb.itf);
+}
+
+// -- Report -----------------------------------------------------------------
+
+static void report(void) {
+    uint64_t first = 0, last = 0;
+    for (uint32_t n = 0; n < xfers.count; n++) {
+        if (xfers.v[n].devnum == opt.devnum && xfers.v[n].complete) {
+            if (first == 0) first = xfers.v[n].ts_us;
+            last = xfers.v[n].done_us;
+        }
+    }
+
+    printf("\n%-14s %7s %13s %11s %11s %11s\n", "GETSTATUS for", "polls",
+           "busy dev/rep", "wait dev", "wait replay", "host waited");
+
+    uint64_t sum_capture = 0, sum_replay = 0, sum_gap = 0;
+    for (int k = 0; k < KIND_COUNT; k++) {
+        if (totals[k].polls == 0) {
+            continue;
+        }
+        printf("%-14s %7u %6u/%-6u %8.1f ms %8.1f ms %8.1f ms\n", kind_names[k], totals[k].polls,
+               totals[k].busy_capture, totals[k].busy_replay,
+               (double)totals[k].wait_capture_ms, (double)totals[k].wait_replay_ms,
+               totals[k].gap_us / 1000.0);
+        sum_capture += totals[k].wait_capture_ms;
+        sum_replay  += totals[k].wait_replay_ms;
+        sum_gap     += totals[k].gap_us;
+    }
+
+    printf("%-14s %7s %13s %8.1f ms %8.1f ms %8.1f ms\n", "total", "", "",
+           (double)sum_capture, (double)sum_replay, sum_gap / 1000.0);
+    printf("\ncapture %.1f ms, %u mismatches (bwPollTimeout tolerance %u ms)\n",
+           (last - first) / 1000.0, mismatches, opt.tolerance_ms);
+}
+
+// -- Setup ----------------------------------------------------------------
+
+// The vendor and mass-storage interfaces are not part of the replay
+void vendor_job_done_cb(flash_job_type_t type, uint32_t addr, flash_error_t err) {
+    (void)type;
+    (void)addr;
+    (void)err;
+}
+
+void msc_job_done_cb(flash_job_type_t type, uint32_t addr, flash_error_t err) {
+    (void)type;
+    (void)addr;
+    (void)err;
+}
+
+// Nor is the main loop's scheduler
+void sched_post(uint32_t events) {
+    (void)events;
+}
+
+void flashsim_watchdog_cb(void) {
+    fprintf(stderr, "dfureplay: flash engine stuck\n");
+    exit(2);
+}
+
+static bool find_device(void) {
+    for (uint32_t n = 0; n < xfers.count; n++) {
+        const xfer_t *x = &xfers.v[n];
+        if ((x->setup[0] & 0x7F) == 0x21 && x->setup[1] <= DFU_REQ_ABORT
+         && (opt.devnum < 0 || x->devnum == opt.devnum)) {
+            opt.devnum = x->devnum;
+            usb.itf    = x->setup[4];
+            return true;
+        }
+    }
+    return false;
+}
+
+static void preload(const char *path) {
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {
+        perror(path);
+        exit(2);
+    }
+
+    static uint8_t image[FLASHSIM_SIZE];
+    size_t n = fread(image, 1, sizeof(image), f);
+    fclose(f);
+    flashsim_preload(0, image, (uint32_t)n);
+}
+
+static void usage(void) {
+    fprintf(stderr,
+        "usage: dfureplay [options] capture.pcap[ng]\n"
+        "  -d DEVNUM  device to replay (default: the first one sent a DFU request)\n"
+        "  -t MS      bwPollTimeout difference that counts as a mismatch (default 2)\n"
+        "  -i FILE    bank 2 contents before the session (default erased)\n"
+        "  -v         list every mismatch\n");
+    exit(2);
+}
+
+int main(int argc, char **argv) {
+    const char *image = NULL;
+    int c;
+
+    while ((c = getopt(argc, argv, "d:t:i:vh")) != -1) {
+        switch (c) {
+            case 'd': opt.devnum       = atoi(optarg); break;
+            case 't': opt.tolerance_ms = (uint32_t)atoi(optarg); break;
+            case 'i': image            = optarg; break;
+            case 'v': opt.verbose      = true; break;
+            default:  usage();
+        }
+    }
+    if (optind + 1 != argc) {
+        usage();
+    }
+
+    if (!read_capture(argv[optind])) {
+        return 2;
+    }
+    if (!find_device()) {
+        fprintf(stderr, "dfureplay: no DFU requests in %s\n", argv[optind]);
+        return 2;
+    }
+
+    const flashsim_config_t config = {
+        .row_cycles   = 84u * (CPU_CLOCK_HZ / 1000000u),
+        .erase_cycles = 844u * (CPU_CLOCK_HZ / 1000u),
+        .bank_cycles  = 8u * 844u * (CPU_CLOCK_HZ / 1000u),
+    };
+    flashsim_init(&config);
+    if (image != NULL) {
+        preload(image);
+    }
+
+    crc_init();
+    flash_init();
+    tud_mount_cb();
+
+    replay();
+    report();
+    return mismatches ? 1 : 0;
+}
@@ -0,0 +1,372 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "stm32h7xx.h"
+#include "clock.h"
+
+FLASH_TypeDef  flashsim_regs;
+DWT_Type       flashsim_dwt;
+CoreDebug_Type flashsim_coredebug;
+
+void FLASH_IRQHandler(void);
+
+#define FLASHSIM_WORDS (FLASHSIM_SIZE / FLASHSIM_WORD)
+
+#define SR_ERRORS (FLASH_SR_WRPERR | FLASH_SR_PGSERR | FLASH_SR_STRBERR \
+                 | FLASH_SR_INCERR | FLASH_SR_OPERR)
+
+// Error flag -> its interrupt enable share bit positions in CR and SR
+#define SR_IRQ_FLAGS (FLASH_SR_EOP | SR_ERRORS)
+
+typedef enum { OP_NONE = 0, OP_PROGRAM, OP_ERASE } op_type_t;
+
+typedef struct {
+    op_type_t type;
+    uint32_t  addr;                  // OP_PROGRAM: flash word
+    uint8_t   data[FLASHSIM_WORD];
+    uint32_t  mask;                  // bytes written into the buffer
+    uint8_t   sectors;               // OP_ERASE
+    uint64_t  done_at;
+} op_t;
+
+static struct {
+    flashsim_config_t   config;
+    flashsim_counters_t counters;
+
+    uint8_t *mem;
+    uint8_t  programmed[FLASHSIM_WORDS / 8];
+
+    uint64_t now;
+    bool     irq_enabled;
+    bool     irq_pending;
+    bool     stuck;
+    uint32_t ops;                    // operations started, for fault injection
+    uint32_t program_ops;
+
+    op_t     buffer;                 // write buffer being filled
+    op_t     active;                 // operation in progress (QW)
+    op_t     queued;                 // next one waiting for active
+} sim;
+
+static void fatal(const char *msg, uint32_t addr) {
+    fprintf(stderr, "flashsim: %s (0x%08X)\n", msg, addr);
+    exit(2);
+}
+
+void flashsim_init(const flashsim_config_t *config) {
+    if (sim.mem == NULL) {
+        // Both banks, so CRCs and reads of bank 1 work too; it stays erased
+        void *p = mmap((void *)(uintptr_t)FLASHSIM_MEM_BASE, FLASHSIM_MEM_SIZE,
+                       PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE,
+                       -1, 0);
+        if (p != (void *)(uintptr_t)FLASHSIM_MEM_BASE) {
+            fatal("cannot map flash at its real address", FLASHSIM_MEM_BASE);
+        }
+        memset(p, 0xFF, FLASHSIM_MEM_SIZE - FLASHSIM_SIZE);
+        sim.mem = (uint8_t *)p + (FLASHSIM_BASE - FLASHSIM_MEM_BASE);
+    }
+
+    uint8_t *mem = sim.mem;
+    memset(&sim, 0, sizeof(sim));
+    sim.mem    = mem;
+    sim.config = *config;
+
+    memset(sim.mem, 0xFF, FLASHSIM_SIZE);
+
+    memset(&flashsim_regs, 0, sizeof(flashsim_regs));
+    flashsim_regs.CR2 = FLASH_CR_LOCK;
+    flashsim_dwt.CYCCNT = 0;
+}
+
+void flashsim_reset_config(const flashsim_config_t *config) {
+    sim.config      = *config;
+    sim.ops         = 0;
+    sim.program_ops = 0;
+}
+
+void flashsim_preload(uint32_t offset, const uint8_t *data, uint32_t length) {
+    memcpy(sim.mem + offset, data, length);
+
+    for (uint32_t i = offset / FLASHSIM_WORD; i * FLASHSIM_WORD < offset + length; i++) {
+        sim.programmed[i / 8] |= 1u << (i % 8);
+    }
+}
+
+uint8_t *flashsim_mem(void) {
+    return sim.mem;
+}
+
+const flashsim_counters_t *flashsim_counters(void) {
+    return &sim.counters;
+}
+
+uint64_t flashsim_now(void) {
+    return sim.now;
+}
+
+// The firmware's SysTick count (sched.c), from model time
+uint32_t sched_ms(void) {
+    return (uint32_t)(sim.now / (CPU_CLOCK_HZ / 1000u));
+}
+
+bool flashsim_stuck(void) {
+    return sim.stuck;
+}
+
+void flashsim_irq_enable(bool enable) {
+    sim.irq_enabled = enable;
+}
+
+void flashsim_irq_pend(bool pend) {
+    sim.irq_pending = pend;
+}
+
+static void set_error(uint32_t flag) {
+    flashsim_regs.SR2 |= flag;
+}
+
+static uint8_t addr_sector(uint32_t addr) {
+    return (uint8_t)((addr - FLASHSIM_BASE) / FLASHSIM_SECTOR);
+}
+
+static void update_busy(void) {
+    uint32_t sr = flashsim_regs.SR2 & ~(FLASH_SR_QW | FLASH_SR_BSY);
+
+    if (sim.active.type != OP_NONE || sim.queued.type != OP_NONE) {
+        sr |= FLASH_SR_QW | FLASH_SR_BSY;
+    }
+    flashsim_regs.SR2 = sr;
+}
+
+// An operation enters the queue; check it the way the controller would
+static void submit(op_t *op) {
+    sim.ops++;
+
+    if (op->type == OP_PROGRAM) {
+        sim.program_ops++;
+
+        if (sim.config.wrp_sectors & (1u << addr_sector(op->addr))) {
+            set_error(FLASH_SR_WRPERR);
+            return;
+        }
+        if (sim.config.pgserr_at != 0 && sim.program_ops == sim.config.pgserr_at) {
+            set_error(FLASH_SR_PGSERR);
+            return;
+        }
+    } else if (sim.config.wrp_sectors & op->sectors) {
+        set_error(FLASH_SR_WRPERR);
+        return;
+    }
+
+    uint32_t cycles = (op->type == OP_PROGRAM) ? sim.config.row_cycles
+                    : (op->sectors == 0xFF)    ? sim.config.bank_cycles
+                                               : sim.config.erase_cycles;
+
+    if (sim.active.type == OP_NONE) {
+        sim.active = *op;
+        sim.active.done_at = sim.now + cycles;
+    } else {
+        // Only happens if the firmware doesn't wait for QW
+        sim.queued = *op;
+        sim.queued.done_at = cycles;
+    }
+    update_busy();
+}
+
+// Register writes only take effect when the model looks at them, which it
+// does before anything else happens
+static void poll_registers(void) {
+    FLASH_TypeDef *f = &flashsim_regs;
+
+    if (f->KEYR2 == 0xCDEF89ABu) {
+        f->CR2  &= ~FLASH_CR_LOCK;
+        f->KEYR2 = 0;
+    }
+
+    if (f->CCR2 != 0) {
+        f->SR2 &= ~(f->CCR2 & SR_IRQ_FLAGS);
+        f->CCR2 = 0;
+    }
+
+    if (f->CR2 & FLASH_CR_START) {
+        f->CR2 &= ~FLASH_CR_START;
+
+        uint32_t ops = f->CR2 & (FLASH_CR_PG | FLASH_CR_SER | FLASH_CR_BER);
+        if (f->CR2 & FLASH_CR_LOCK) {
+            set_error(FLASH_SR_WRPERR);
+        } else if (ops != FLASH_CR_SER && ops != FLASH_CR_BER) {
+            set_error(FLASH_SR_PGSERR); // inconsistent erase/program bits
+        } else {
+            op_t op = { .type = OP_ERASE };
+            op.sectors = (ops == FLASH_CR_BER) ? 0xFF
+                       : (uint8_t)(1u << ((f->CR2 & FLASH_CR_SNB) >> FLASH_CR_SNB_Pos));
+            submit(&op);
+        }
+    }
+
+    if (f->CR2 & FLASH_CR_FW) {
+        f->CR2 &= ~FLASH_CR_FW; // cleared by hardware
+
+        if (f->SR2 & FLASH_SR_WBNE) {
+            f->SR2 &= ~FLASH_SR_WBNE;
+            submit(&sim.buffer);
+            sim.buffer.type = OP_NONE;
+        }
+    }
+
+    // The interrupt line follows the flags
+    if ((f->SR2 & SR_IRQ_FLAGS) & (f->CR2 & SR_IRQ_FLAGS)) {
+        sim.irq_pending = true;
+    }
+}
+
+void flashsim_store(uint32_t addr, uint32_t value, unsigned size) {
+    poll_registers();
+
+    if (addr < FLASHSIM_BASE || addr + size > FLASHSIM_BASE + FLASHSIM_SIZE) {
+        fatal("store outside bank 2", addr);
+    }
+
+    FLASH_TypeDef *f = &flashsim_regs;
+    if ((f->CR2 & FLASH_CR_PG) == 0 || (f->CR2 & FLASH_CR_LOCK)) {
+        set_error(FLASH_SR_PGSERR);
+        poll_registers();
+        return;
+    }
+
+    uint32_t word = addr & ~(FLASHSIM_WORD - 1u);
+    if ((f->SR2 & FLASH_SR_WBNE) && word != sim.buffer.addr) {
+        // A new flash word before the previous one was complete
+        set_error(FLASH_SR_INCERR);
+        f->SR2 &= ~FLASH_SR_WBNE;
+        sim.buffer.type = OP_NONE;
+        poll_registers();
+        return;
+    }
+
+    if ((f->SR2 & FLASH_SR_WBNE) == 0) {
+        memset(&sim.buffer, 0, sizeof(sim.buffer));
+        memset(sim.buffer.data, 0xFF, sizeof(sim.buffer.data));
+        sim.buffer.type = OP_PROGRAM;
+        sim.buffer.addr = word;
+        f->SR2 |= FLASH_SR_WBNE;
+    }
+
+    uint32_t off = addr - word;
+    memcpy(&sim.buffer.data[off], &value, size);
+    sim.buffer.mask |= ((1u << size) - 1u) << off;
+
+    if (sim.buffer.mask == UINT32_MAX) {
+        f->SR2 &= ~FLASH_SR_WBNE;
+        submit(&sim.buffer);
+        sim.buffer.type = OP_NONE;
+    }
+
+    poll_registers();
+}
+
+static void complete(const op_t *op) {
+    if (op->type == OP_PROGRAM) {
+        uint32_t index = (op->addr - FLASHSIM_BASE) / FLASHSIM_WORD;
+        uint8_t *dst   = sim.mem + (op->addr - FLASHSIM_BASE);
+
+        if (sim.programmed[index / 8] & (1u << (index % 8))) {
+            if (sim.counters.reprograms++ == 0) {
+                sim.counters.first_reprogram = op->addr;
+            }
+        }
+        sim.programmed[index / 8] |= 1u << (index % 8);
+
+        // Programming can only clear bits
+        for (uint32_t i = 0; i < FLASHSIM_WORD; i++) {
+            dst[i] &= op->data[i];
+        }
+        sim.counters.programs++;
+    } else {
+        for (uint8_t s = 0; s < FLASHSIM_SECTORS; s++) {
+            if (op->sectors & (1u << s)) {
+                memset(sim.mem + s * FLASHSIM_SECTOR, 0xFF, FLASHSIM_SECTOR);
+                memset(&sim.programmed[s * FLASHSIM_SECTOR / FLASHSIM_WORD / 8], 0,
+                       FLASHSIM_SECTOR / FLASHSIM_WORD / 8);
+                sim.counters.erases++;
+            }
+        }
+    }
+}
+
+static void set_time(uint64_t t) {
+    sim.now = t;
+    flashsim_dwt.CYCCNT = (uint32_t)t;
+}
+
+// Finish the active operation if it is due by `until`
+static bool run_operation(uint64_t until) {
+    if (sim.active.type == OP_NONE || sim.stuck || sim.active.done_at > until) {
+        return false;
+    }
+
+    set_time(sim.active.done_at);
+    complete(&sim.active);
+
+    if (sim.config.stuck_qw_at != 0 && sim.ops >= sim.config.stuck_qw_at) {
+        sim.stuck = true; // QW stays up, no EOP ever
+        return true;
+    }
+
+    sim.active = sim.queued;
+    sim.active.done_at += sim.now;
+    sim.queued.type = OP_NONE;
+    update_busy();
+
+    flashsim_regs.SR2 |= FLASH_SR_EOP;
+    poll_registers();
+    return true;
+}
+
+// Run the interrupt for as long as it keeps firing
+static bool run_irqs(void) {
+    unsigned loops = 0;
+
+    poll_registers();
+    while (sim.irq_pending && sim.irq_enabled) {
+        sim.irq_pending = false;
+        sim.counters.irqs++;
+        FLASH_IRQHandler();
+        poll_registers();
+
+        if (++loops > 1000000) {
+            fatal("interrupt storm, a flag is never cleared", flashsim_regs.SR2);
+        }
+    }
+    return loops != 0;
+}
+
+void flashsim_advance(uint64_t cycles) {
+    uint64_t until = sim.now + cycles;
+
+    run_irqs();
+    while (run_operation(until)) {
+        run_irqs();
+    }
+    set_time(until);
+}
+
+void flashsim_wait_event(void) {
+    if (run_irqs()) {
+        return;
+    }
+
+    if (run_operation(UINT64_MAX)) {
+        run_irqs();
+        return;
+    }
+
+    // Nothing in flight and no interrupt coming: the caller would spin
+    // forever. Let the watchdog time out instead.
+    sim.stuck = true;
+    set_time(sim.now + sim.config.bank_cycles);
+    flashsim_watchdog_cb();
+}
@@ -0,0 +1,530 @@
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+
+#include "dfu_flash.h"
+#include "clock.h"
+#include "crc.h"
+#include "stats.h"
+#include "tusb.h"
+#include "flash_model.h"
+
+/*
+ * Runs download scenarios through src/dfu_flash.c against the bank 2 model
+ * and checks the result: image contents, erased tail of the last sector, the
+ * session CRC, and that no flash word was programmed twice between erases.
+ * Reported times are model time, i.e. what the flash itself costs. Reads
+ * cost nothing in the model, so the read scenario reports the host time of
+ * a flash_read() pass over the image instead, next to the byte loop it
+ * replaced.
+ */
+
+#define US_TO_CYCLES(us) ((uint64_t)(us) * (CPU_CLOCK_HZ / 1000000u))
+
+typedef enum { RESULT_OK = 0, RESULT_FLASH_ERROR, RESULT_FAIL, RESULT_HANG } result_t;
+
+static const char *const result_names[] = { "ok", "flash error", "FAIL", "HANG" };
+
+static struct {
+    uint32_t size;           // image bytes
+    uint32_t block;          // DfuSe block size
+    uint32_t usb_us;         // host time per block
+    uint32_t seed;
+    flashsim_config_t config;
+} opt = {
+    .size   = 768u * 1024u + 100u,
+    .block  = CFG_TUD_DFU_XFER_BUFSIZE,
+    .usb_us = 1000,
+    .seed   = 1,
+    .config = {
+        .row_cycles   = 84u * (CPU_CLOCK_HZ / 1000000u),
+        .erase_cycles = 844u * (CPU_CLOCK_HZ / 1000u),
+        .bank_cycles  = 8u * 844u * (CPU_CLOCK_HZ / 1000u),
+    },
+};
+
+static uint8_t *image;   // what should end up in flash
+static uint8_t *old;     // what is there before the download
+
+// Ranges of the image the host leaves out, and what it did send
+static struct { uint32_t off, len; } holes[2];
+static unsigned holes_count;
+static uint32_t sent_crc, sent_bytes;
+static bool     read_failed;
+static double   read_host_ms; // one flash_read() pass, read scenario only
+
+static flash_error_t job_error;
+static uint32_t      job_error_addr;
+static jmp_buf       watchdog;
+
+void flash_job_done_cb(flash_job_type_t type, uint32_t addr, flash_error_t err) {
+    (void) type;
+
+    if (err != FLASH_ERR_NONE && job_error == FLASH_ERR_NONE) {
+        job_error      = err;
+        job_error_addr = addr;
+    }
+}
+
+void flashsim_watchdog_cb(void) {
+    longjmp(watchdog, 1);
+}
+
+static uint32_t rand_next(void) {
+    // xorshift32, deterministic per seed
+    opt.seed ^= opt.seed << 13;
+    opt.seed ^= opt.seed >> 17;
+    opt.seed ^= opt.seed << 5;
+    return opt.seed;
+}
+
+// Random data with some erased-looking padding rows, like a real image
+static void make_images(void) {
+    image = malloc(FLASHSIM_SIZE);
+    old   = malloc(FLASHSIM_SIZE);
+
+    for (uint32_t i = 0; i < FLASHSIM_SIZE; i += 4) {
+        uint32_t v = rand_next();
+        memcpy(&image[i], &v, 4);
+        v = rand_next();
+        memcpy(&old[i], &v, 4);
+    }
+    for (uint32_t row = 0; row < FLASHSIM_SIZE; row += FLASH_WRITE_SIZE) {
+        if ((rand_next() & 15u) == 0) {
+            memset(&image[row], 0xFF, FLASH_WRITE_SIZE);
+        }
+    }
+}
+
+static uint8_t image_sectors(void) {
+    uint32_t n = (opt.size + FLASH_SECTOR_SIZE - 1u) / FLASH_SECTOR_SIZE;
+    return (uint8_t)((1u << n) - 1u);
+}
+
+static void start(uint32_t options) {
+    flashsim_init(&opt.config);
+    flash_init();
+    flash_set_options(options);
+
+    holes_count = 0;
+    read_failed = false;
+    sent_crc    = 0;
+    sent_bytes  = 0;
+
+    job_error      = FLASH_ERR_NONE;
+    job_error_addr = 0;
+}
+
+// The host's side of a download: the data phase of each block takes usb_us,
+// and a block is only accepted once the queue has room (the DfuSe layer
+// answers GETSTATUS with dfuDNBUSY until then)
+static void queue_erase(uint8_t sectors) {
+    while (!flash_erase_sectors_async(sectors)) {
+        flashsim_wait_event();
+    }
+}
+
+static bool erase_sectors(uint8_t sectors, bool one_by_one) {
+    if (!one_by_one) {
+        queue_erase(sectors);
+        return job_error == FLASH_ERR_NONE;
+    }
+
+    for (uint8_t s = 0; s < FLASH_SECTOR_COUNT; s++) {
+        if (sectors & (1u << s)) {
+            queue_erase(1u << s);
+        }
+    }
+    return job_error == FLASH_ERR_NONE;
+}
+
+static bool in_hole(uint32_t off) {
+    for (unsigned i = 0; i < holes_count; i++) {
+        if (off - holes[i].off < holes[i].len) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void sent(uint32_t off, uint32_t len) {
+    sent_crc    = crc32_update(sent_crc, &image[off], len);
+    sent_bytes += len;
+}
+
+static bool download(void) {
+    for (uint32_t off = 0; off < opt.size && job_error == FLASH_ERR_NONE; off += opt.block) {
+        uint32_t len = (opt.size - off < opt.block) ? opt.size - off : opt.block;
+
+        if (in_hole(off)) {
+            continue;
+        }
+
+        sent(off, len);
+        flashsim_advance(US_TO_CYCLES(opt.usb_us));
+        while (!flash_write_async(FLASH_BANK2_BASE + off, &image[off], len)) {
+            flashsim_wait_event();
+        }
+    }
+    return job_error == FLASH_ERR_NONE;
+}
+
+// Stream in random-sized pieces, erasing each sector just before the
+// stream gets to it
+static bool stream(void) {
+    uint32_t off = 0;
+    uint8_t  erased = 0;
+
+    while (!flash_stream_begin(FLASH_BANK2_BASE)) {
+        flashsim_wait_event();
+    }
+
+    while (off < opt.size && job_error == FLASH_ERR_NONE) {
+        uint8_t next = (uint8_t)((off + 3000u) / FLASH_SECTOR_SIZE);
+        if (next < FLASH_SECTOR_COUNT && !(erased & (1u << next))) {
+            erased |= 1u << next;
+            queue_erase(1u << next);
+            continue;
+        }
+
+        uint32_t chunk = 1u + rand_next() % 3000u;
+        if (chunk > opt.size - off) {
+            chunk = opt.size - off;
+        }
+
+        flashsim_advance(US_TO_CYCLES((uint64_t)opt.usb_us * chunk / opt.block));
+
+        while (chunk > 0 && job_error == FLASH_ERR_NONE) {
+            uint32_t space;
+            uint8_t *dst = flash_stream_space(&space);
+            if (dst == NULL) {
+                flashsim_wait_event();
+                continue;
+            }
+
+            uint32_t n = (chunk < space) ? chunk : space;
+            memcpy(dst, &image[off], n);
+            flash_stream_commit(n);
+            sent(off, n);
+            off   += n;
+            chunk -= n;
+        }
+    }
+
+    while (job_error == FLASH_ERR_NONE && !flash_stream_flush()) {
+        flashsim_wait_event();
+    }
+    return job_error == FLASH_ERR_NONE;
+}
+
+static bool finish(void) {
+    while (!flash_finish_async()) {
+        flashsim_wait_event();
+    }
+    flash_wait_idle();
+    return job_error == FLASH_ERR_NONE;
+}
+
+static bool verify(void) {
+    const uint8_t *mem = flashsim_mem();
+    uint32_t end = (opt.size + FLASH_SECTOR_SIZE - 1u) / FLASH_SECTOR_SIZE * FLASH_SECTOR_SIZE;
+    bool ok = true;
+
+    for (uint32_t i = 0; i < opt.size; i++) {
+        if (mem[i] != image[i]) {
+            printf("  mismatch at 0x%08X: %02X, expected %02X\n", FLASH_BANK2_BASE + i, mem[i], image[i]);
+            ok = false;
+            break;
+        }
+    }
+    for (uint32_t i = opt.size; i < end; i++) {
+        if (mem[i] != 0xFF) {
+            printf("  not erased at 0x%08X\n", FLASH_BANK2_BASE + i);
+            ok = false;
+            break;
+        }
+    }
+
+    uint32_t bytes;
+    uint32_t crc = flash_session_crc(&bytes);
+    if (bytes != sent_bytes || crc != sent_crc) {
+        printf("  session CRC %08X over %u bytes, expected %08X over %u\n",
+               crc, bytes, sent_crc, sent_bytes);
+        ok = false;
+    }
+
+    if (read_failed) {
+        ok = false;
+    }
+
+    const flashsim_counters_t *c = flashsim_counters();
+    if (c->reprograms != 0) {
+        printf("  %llu flash words programmed twice between erases, first at 0x%08X\n",
+               (unsigned long long)c->reprograms, c->first_reprogram);
+        ok = false;
+    }
+    return ok;
+}
+
+typedef bool (*scenario_fn)(void);
+
+static bool scenario_erase(void) {
+    start(0);
+    flashsim_preload(0, old, FLASHSIM_SIZE);
+    return erase_sectors(image_sectors(), true) && download() && finish();
+}
+
+static bool scenario_bank(void) {
+    start(0);
+    flashsim_preload(0, old, FLASHSIM_SIZE);
+    return erase_sectors(FLASH_ALL_SECTORS, false) && download() && finish();
+}
+
+// Reflash with a handful of changed rows: only sectors where a row can't be
+// programmed over should get erased
+static bool scenario_diff(void) {
+    start(FLASH_OPT_DIFF);
+
+    memcpy(old, image, FLASHSIM_SIZE);
+    for (int i = 0; i < 4; i++) {
+        uint32_t row = rand_next() % (opt.size / FLASH_WRITE_SIZE);
+        old[row * FLASH_WRITE_SIZE] ^= 0x5A;
+    }
+    memset(old + opt.size, 0xFF, FLASHSIM_SIZE - opt.size);
+    flashsim_preload(0, old, FLASHSIM_SIZE);
+
+    return erase_sectors(image_sectors(), true) && download() && finish();
+}
+
+// Diff reflash of an image with gaps the host leaves out, over stale data
+// that has to come out erased. The first gap's sector has a changed row
+// after it, so its erase must not restore the gap; the second one's sector
+// only gets settled at the end.
+static bool scenario_gaps(void) {
+    start(FLASH_OPT_DIFF);
+
+    if (opt.size >= 2u * FLASH_SECTOR_SIZE) {
+        holes[0].off = 4u * opt.block;
+        holes[0].len = 2u * opt.block;
+        holes[1].off = FLASH_SECTOR_SIZE + 8u * opt.block;
+        holes[1].len = 2u * opt.block;
+        holes_count  = 2;
+    }
+
+    memcpy(old, image, FLASHSIM_SIZE);
+    for (unsigned i = 0; i < holes_count; i++) {
+        memset(&image[holes[i].off], 0xFF, holes[i].len);
+        for (uint32_t j = 0; j < holes[i].len; j += 4) {
+            uint32_t v = rand_next();
+            memcpy(&old[holes[i].off + j], &v, 4);
+        }
+    }
+    old[FLASH_SECTOR_SIZE - 2u * opt.block] ^= 0x5A;
+    memset(old + opt.size, 0xFF, FLASHSIM_SIZE - opt.size);
+    flashsim_preload(0, old, FLASHSIM_SIZE);
+
+    return erase_sectors(image_sectors(), true) && download() && finish();
+}
+
+static bool scenario_auto(void) {
+    start(FLASH_OPT_AUTO_ERASE);
+    flashsim_preload(0, old, FLASHSIM_SIZE);
+    return download() && finish();
+}
+
+static bool scenario_stream(void) {
+    start(0);
+    flashsim_preload(0, old, FLASHSIM_SIZE);
+    return stream() && finish();
+}
+
+// What UPLOAD used to do, for comparison
+static void read_bytes(uint8_t *dst, uint32_t addr, uint32_t length) {
+    volatile uint8_t *src = (volatile uint8_t *)addr;
+
+    for (uint32_t i = 0; i < length; i++) {
+        dst[i] = src[i];
+    }
+}
+
+// Host milliseconds for one pass over the image in DFU blocks, best of a few
+static double read_pass_ms(void (*read)(uint8_t *, uint32_t, uint32_t), uint8_t *buf) {
+    double best = 0;
+
+    for (int rep = 0; rep < 20; rep++) {
+        struct timespec t0, t1;
+
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        for (uint32_t off = 0; off < opt.size; off += opt.block) {
+            read(buf, FLASH_BANK2_BASE + off, (opt.size - off < opt.block) ? opt.size - off : opt.block);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+
+        double ms = (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6;
+        if (rep == 0 || ms < best) {
+            best = ms;
+        }
+    }
+    return best;
+}
+
+// UPLOAD's side: read the image back through flash_read() with every
+// alignment of the buffer and of the flash address, as DFU blocks and at
+// odd lengths
+static bool scenario_read(void) {
+    static uint8_t buf[CFG_TUD_DFU_XFER_BUFSIZE + 8];
+
+    start(0);
+    memcpy(old, image, FLASHSIM_SIZE);
+    memset(old + opt.size, 0xFF, FLASHSIM_SIZE - opt.size);
+    flashsim_preload(0, old, FLASHSIM_SIZE);
+
+    for (uint32_t misalign = 0; misalign < 8 && !read_failed; misalign++) {
+        for (uint32_t off = misalign; off < opt.size; off += opt.block) {
+            uint32_t len = (opt.size - off < opt.block) ? opt.size - off : opt.block;
+            len -= (rand_next() & 1u) ? rand_next() % (len + 1u) : 0;
+
+            flash_read(buf + misalign, FLASH_BANK2_BASE + off, len);
+            if (memcmp(buf + misalign, &image[off], len) != 0) {
+                printf("  read back %u bytes at 0x%08X into buffer + %u wrong\n",
+                       len, FLASH_BANK2_BASE + off, misalign);
+                read_failed = true;
+                break;
+            }
+        }
+    }
+
+    double bytes_ms = read_pass_ms(read_bytes, buf);
+    read_host_ms    = read_pass_ms(flash_read, buf);
+    printf("  host, one pass: byte loop %.3f ms (%.0f MB/s), flash_read() %.3f ms (%.0f MB/s)\n",
+           bytes_ms, opt.size / 1e3 / bytes_ms, read_host_ms, opt.size / 1e3 / read_host_ms);
+    return true;
+}
+
+static const struct {
+    const char *name;
+    scenario_fn fn;
+} scenarios[] = {
+    { "erase",  scenario_erase  },
+    { "bank",   scenario_bank   },
+    { "diff",   scenario_diff   },
+    { "auto",   scenario_auto   },
+    { "stream", scenario_stream },
+    { "gaps",   scenario_gaps   },
+    { "read",   scenario_read   },
+};
+
+#define SCENARIO_COUNT (sizeof(scenarios) / sizeof(scenarios[0]))
+
+static result_t run(unsigned i) {
+    // Fresh random old image for each scenario, same target image
+    for (uint32_t j = 0; j < FLASHSIM_SIZE; j += 4) {
+        uint32_t v = rand_next();
+        memcpy(&old[j], &v, 4);
+    }
+
+    stats_t before = stats;
+    result_t result;
+
+    read_host_ms = 0;
+
+    if (setjmp(watchdog) != 0) {
+        result = RESULT_HANG;
+    } else if (!scenarios[i].fn()) {
+        flash_wait_idle();
+        result = RESULT_FLASH_ERROR;
+    } else {
+        result = verify() ? RESULT_OK : RESULT_FAIL;
+    }
+
+    const flashsim_counters_t *c = flashsim_counters();
+    double ms = (read_host_ms > 0) ? read_host_ms : (double)flashsim_now() / (CPU_CLOCK_HZ / 1000u);
+
+    printf("%-7s %-11s %9.1f ms %8.1f KB/s  erases %2llu  rows %6llu  skipped %6u  irqs %llu\n",
+           scenarios[i].name, result_names[result], ms,
+           ms > 0 ? opt.size / 1024.0 / (ms / 1000.0) : 0.0,
+           (unsigned long long)c->erases, (unsigned long long)c->programs,
+           stats.rows_skipped - before.rows_skipped, (unsigned long long)c->irqs);
+
+    if (result == RESULT_FLASH_ERROR) {
+        printf("  flash error %d at 0x%08X\n", job_error, job_error_addr);
+    } else if (result == RESULT_HANG) {
+        printf("  engine stuck in state %d with the queue not empty\n", flash_get_state());
+    }
+    return result;
+}
+
+static void usage(void) {
+    fprintf(stderr,
+        "usage: flashsim [options] [scenario...]\n"
+        "scenarios: erase bank diff auto stream gaps read (default: all)\n"
+        "  -s BYTES   image size (default %u)\n"
+        "  -b BYTES   DFU block size (default %u)\n"
+        "  -u US      host time per block (default %u)\n"
+        "  -r US      row program time (default 84)\n"
+        "  -e MS      sector erase time (default 844)\n"
+        "  -S SEED    random seed\n"
+        "  -w MASK    write-protected sectors\n"
+        "  -p N       fail the N-th program operation with PGSERR\n"
+        "  -q N       leave QW stuck after the N-th operation\n",
+        opt.size, opt.block, opt.usb_us);
+    exit(2);
+}
+
+int main(int argc, char **argv) {
+    int c;
+
+    while ((c = getopt(argc, argv, "s:b:u:r:e:S:w:p:q:h")) != -1) {
+        uint32_t v = (uint32_t)strtoul(optarg ? optarg : "0", NULL, 0);
+
+        switch (c) {
+            case 's': opt.size   = v; break;
+            case 'b': opt.block  = v; break;
+            case 'u': opt.usb_us = v; break;
+            case 'r': opt.config.row_cycles   = (uint32_t)US_TO_CYCLES(v); break;
+            case 'e': opt.config.erase_cycles = (uint32_t)US_TO_CYCLES(v * 1000u);
+                      opt.config.bank_cycles  = 8u * opt.config.erase_cycles; break;
+            case 'S': opt.seed = v ? v : 1; break;
+            case 'w': opt.config.wrp_sectors = (uint8_t)v; break;
+            case 'p': opt.config.pgserr_at   = v; break;
+            case 'q': opt.config.stuck_qw_at = v; break;
+            default:  usage();
+        }
+    }
+
+    if (opt.size == 0 || opt.size > FLASHSIM_SIZE
+     || opt.block == 0 || opt.block > CFG_TUD_DFU_XFER_BUFSIZE || opt.block % FLASH_WRITE_SIZE) {
+        usage();
+    }
+
+    make_images();
+
+    bool faults = opt.config.wrp_sectors || opt.config.pgserr_at || opt.config.stuck_qw_at;
+    int  status = 0;
+
+    for (unsigned i = 0; i < SCENARIO_COUNT; i++) {
+        bool selected = (optind == argc);
+        for (int a = optind; a < argc; a++) {
+            selected |= (strcmp(argv[a], scenarios[i].name) == 0);
+        }
+        if (!selected) {
+            continue;
+        }
+
+        result_t result = run(i);
+
+        // With faults injected, a reported flash error is the right outcome
+        if (result == RESULT_FAIL || result == RESULT_HANG
+         || (result == RESULT_FLASH_ERROR && !faults)) {
+            status = 1;
+        }
+    }
+
+    printf("estimates: sector erase %u ms, bank erase %u ms, %u byte block %u ms\n",
+           flash_erase_time_ms(1), flash_erase_time_ms(FLASH_ALL_SECTORS),
+           opt.block, flash_write_time_ms(opt.block));
+    return status;
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+// Behavioural model of the STM32H7 flash bank 2 controller: 256-bit write
+// buffer (WBNE), one operation queue slot (QW), EOP and error flags with
+// their interrupt enables, force-write, sector and bank erase timing, and
+// the ECC rule that a flash word may only be programmed once per erase.
+// Time only moves when the simulation asks it to.
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define FLASHSIM_BASE    0x08100000u
+#define FLASHSIM_SECTORS 8
+#define FLASHSIM_SECTOR  (128u * 1024u)
+#define FLASHSIM_SIZE    (FLASHSIM_SECTORS * FLASHSIM_SECTOR)
+#define FLASHSIM_WORD    32u
+
+#define FLASHSIM_MEM_BASE 0x08000000u
+#define FLASHSIM_MEM_SIZE (2u * 1024u * 1024u)
+
+typedef struct {
+    // Operation times in CPU cycles
+    uint32_t row_cycles;
+    uint32_t erase_cycles;
+    uint32_t bank_cycles;
+
+    // Fault injection
+    uint8_t  wrp_sectors;     // program/erase in these sectors -> WRPERR
+    uint32_t pgserr_at;       // the n-th program operation fails with PGSERR (0 = never)
+    uint32_t stuck_qw_at;     // QW never clears after the n-th operation (0 = never)
+} flashsim_config_t;
+
+typedef struct {
+    uint64_t programs;        // flash words programmed
+    uint64_t erases;          // sector erases, a bank erase counts 8
+    uint64_t reprograms;      // ECC rule violations
+    uint32_t first_reprogram; // address of the first one
+    uint64_t irqs;            // FLASH_IRQHandler calls
+} flashsim_counters_t;
+
+// Maps the bank at its real address so dfu_flash.c can read it directly.
+// Contents start out erased.
+void flashsim_init(const flashsim_config_t *config);
+void flashsim_reset_config(const flashsim_config_t *config);
+
+// Put an existing image in place, as programmed (not erased) flash
+void flashsim_preload(uint32_t offset, const uint8_t *data, uint32_t length);
+
+uint8_t *flashsim_mem(void);
+const flashsim_counters_t *flashsim_counters(void);
+uint64_t flashsim_now(void);
+bool flashsim_stuck(void);
+
+// Let time pass (running the interrupt whenever it fires)
+void flashsim_advance(uint64_t cycles);
+
+// Run until the next thing happens: a pending interrupt or the end of the
+// operation in progress. Used by flash_wait_idle(). If nothing is ever going
+// to happen it calls flashsim_watchdog_cb(), which must not return.
+void flashsim_wait_event(void);
+__attribute__((noreturn)) void flashsim_watchdog_cb(void);
+
+// Hooks for the stand-in CMSIS header
+void flashsim_store(uint32_t addr, uint32_t value, unsigned size);
+void flashsim_irq_enable(bool enable);
+void flashsim_irq_pend(bool pend);
@@ -0,0 +1,5 @@
+#pragma once
+
+// The DEBUG_MEASURE pin has nowhere to go on the host
+#define gpio_setPin(...)   ((void)0)
+#define gpio_clearPin(...) ((void)0)
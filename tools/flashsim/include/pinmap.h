@@ -0,0 +1,3 @@
+#pragma once
+
+#define PHONE_TXD 0
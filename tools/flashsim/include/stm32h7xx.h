@@ -0,0 +1,95 @@
+#pragma once
+
+// Host stand-in for the CMSIS device header: just what dfu_flash.c and the
+// headers it pulls in use, wired to the model in flash_model.c. Bit positions
+// match stm32h743xx.h.
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "flash_model.h"
+
+#define __IO volatile
+#define __O  volatile
+
+typedef struct {
+    __IO uint32_t KEYR2;
+    __IO uint32_t CR2;
+    __IO uint32_t SR2;
+    __IO uint32_t CCR2;
+} FLASH_TypeDef;
+
+extern FLASH_TypeDef flashsim_regs;
+#define FLASH (&flashsim_regs)
+
+#define FLASH_CR_LOCK       (1u << 0)
+#define FLASH_CR_PG         (1u << 1)
+#define FLASH_CR_SER        (1u << 2)
+#define FLASH_CR_BER        (1u << 3)
+#define FLASH_CR_PSIZE_0    (1u << 4)
+#define FLASH_CR_PSIZE_1    (1u << 5)
+#define FLASH_CR_FW         (1u << 6)
+#define FLASH_CR_START      (1u << 7)
+#define FLASH_CR_SNB_Pos    8
+#define FLASH_CR_SNB        (7u << FLASH_CR_SNB_Pos)
+#define FLASH_CR_EOPIE      (1u << 16)
+#define FLASH_CR_WRPERRIE   (1u << 17)
+#define FLASH_CR_PGSERRIE   (1u << 18)
+#define FLASH_CR_STRBERRIE  (1u << 19)
+#define FLASH_CR_INCERRIE   (1u << 21)
+#define FLASH_CR_OPERRIE    (1u << 22)
+
+#define FLASH_SR_BSY        (1u << 0)
+#define FLASH_SR_WBNE       (1u << 1)
+#define FLASH_SR_QW         (1u << 2)
+#define FLASH_SR_EOP        (1u << 16)
+#define FLASH_SR_WRPERR     (1u << 17)
+#define FLASH_SR_PGSERR     (1u << 18)
+#define FLASH_SR_STRBERR    (1u << 19)
+#define FLASH_SR_INCERR     (1u << 21)
+#define FLASH_SR_OPERR      (1u << 22)
+
+#define FLASH_CCR_CLR_EOP   (1u << 16)
+
+typedef enum { FLASH_IRQn = 4 } IRQn_Type;
+
+static inline void NVIC_EnableIRQ(IRQn_Type irq)       { (void)irq; flashsim_irq_enable(true); }
+static inline void NVIC_DisableIRQ(IRQn_Type irq)      { (void)irq; flashsim_irq_enable(false); }
+static inline void NVIC_SetPendingIRQ(IRQn_Type irq)   { (void)irq; flashsim_irq_pend(true); }
+static inline void NVIC_ClearPendingIRQ(IRQn_Type irq) { (void)irq; flashsim_irq_pend(false); }
+static inline void NVIC_SetPriority(IRQn_Type irq, uint32_t prio) { (void)irq; (void)prio; }
+
+#define __DMB() __atomic_signal_fence(__ATOMIC_SEQ_CST)
+#define __DSB() __atomic_signal_fence(__ATOMIC_SEQ_CST)
+#define __ISB() __atomic_signal_fence(__ATOMIC_SEQ_CST)
+
+static inline uint32_t __CLZ(uint32_t v) { return v ? (uint32_t)__builtin_clz(v) : 32u; }
+
+// The model has no cache, flash reads always see the array
+static inline void SCB_InvalidateDCache_by_Addr(volatile void *addr, int32_t size) { (void)addr; (void)size; }
+static inline void SCB_CleanInvalidateDCache(void) { }
+
+// Cycle counter, driven by model time
+typedef struct {
+    __IO uint32_t CTRL;
+    __IO uint32_t CYCCNT;
+    __O  uint32_t LAR;
+} DWT_Type;
+
+typedef struct {
+    __IO uint32_t DEMCR;
+} CoreDebug_Type;
+
+extern DWT_Type       flashsim_dwt;
+extern CoreDebug_Type flashsim_coredebug;
+#define DWT       (&flashsim_dwt)
+#define CoreDebug (&flashsim_coredebug)
+
+#define DWT_CTRL_CYCCNTENA_Msk     (1u << 0)
+#define CoreDebug_DEMCR_TRCENA_Msk (1u << 24)
+
+// Hardware access shim in dfu_flash.c
+#define FLASH_HW_SHIM
+#define flash_store32(addr, value) flashsim_store((addr), (value), 4)
+#define flash_store8(addr, value)  flashsim_store((addr), (value), 1)
+#define flash_wait_event()         flashsim_wait_event()
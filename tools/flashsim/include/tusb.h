@@ -0,0 +1,96 @@
+#pragma once
+
+// Host stand-in for TinyUSB: the config plus the DFU class types the
+// callbacks in dfu_tinyusb.c are called with (patched TinyUSB), and the MSC
+// bits msc_flash.c uses
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+
+#include "tusb_config.h"
+
+typedef enum {
+    APP_IDLE = 0,
+    APP_DETACH,
+    DFU_IDLE,
+    DFU_DNLOAD_SYNC,
+    DFU_DNBUSY,
+    DFU_DNLOAD_IDLE,
+    DFU_MANIFEST_SYNC,
+    DFU_MANIFEST,
+    DFU_MANIFEST_WAIT_RESET,
+    DFU_UPLOAD_IDLE,
+    DFU_ERROR,
+} dfu_state_t;
+
+typedef enum {
+    DFU_STATUS_OK = 0,
+    DFU_STATUS_ERR_TARGET,
+    DFU_STATUS_ERR_FILE,
+    DFU_STATUS_ERR_WRITE,
+    DFU_STATUS_ERR_ERASE,
+    DFU_STATUS_ERR_CHECK_ERASED,
+    DFU_STATUS_ERR_PROG,
+    DFU_STATUS_ERR_VERIFY,
+    DFU_STATUS_ERR_ADDRESS,
+    DFU_STATUS_ERR_NOTDONE,
+    DFU_STATUS_ERR_FIRMWARE,
+    DFU_STATUS_ERR_VENDOR,
+    DFU_STATUS_ERR_USBR,
+    DFU_STATUS_ERR_POR,
+    DFU_STATUS_ERR_UNKNOWN,
+    DFU_STATUS_ERR_STALLEDPKT,
+} dfu_status_t;
+
+typedef struct __attribute__((packed)) {
+    uint8_t bStatus;
+    uint8_t bwPollTimeout[3];
+    uint8_t bState;
+    uint8_t iString;
+} dfu_status_response_t;
+
+// What the last DNLOAD left behind, passed to every GETSTATUS
+typedef struct {
+    dfu_state_t    state;
+    uint16_t       block;
+    uint16_t       length;
+    const uint8_t *buffer;
+} tud_dfu_get_status_request_t;
+
+typedef struct {
+    bool invoke_download;
+    bool invoke_manifest;
+} tud_dfu_get_status_control_t;
+
+bool     tud_dfu_get_status_cb(uint8_t alt, tud_dfu_get_status_request_t const *req,
+                               dfu_status_response_t *resp, tud_dfu_get_status_control_t *ctl);
+uint16_t tud_dfu_upload_cb(uint8_t alt, uint16_t block_num, uint8_t *data, uint16_t length);
+void     tud_dfu_download_cb(uint8_t alt, uint16_t block_num, uint8_t const *data, uint16_t length);
+void     tud_dfu_manifest_cb(uint8_t alt);
+void     tud_dfu_abort_cb(uint8_t alt);
+void     tud_dfu_detach_cb(void);
+void     tud_mount_cb(void);
+void     tud_umount_cb(void);
+
+// MSC class: sense keys and the SCSI command msc_flash.c handles itself
+enum {
+    SCSI_SENSE_NONE            = 0x00,
+    SCSI_SENSE_NOT_READY       = 0x02,
+    SCSI_SENSE_MEDIUM_ERROR    = 0x03,
+    SCSI_SENSE_ILLEGAL_REQUEST = 0x05,
+    SCSI_SENSE_DATA_PROTECT    = 0x07,
+};
+
+enum {
+    SCSI_CMD_PREVENT_ALLOW_MEDIUM_REMOVAL = 0x1E,
+};
+
+bool    tud_msc_set_sense(uint8_t lun, uint8_t sense_key, uint8_t add_sense_code, uint8_t add_sense_qualifier);
+void    tud_msc_inquiry_cb(uint8_t lun, uint8_t vendor_id[8], uint8_t product_id[16], uint8_t product_rev[4]);
+bool    tud_msc_test_unit_ready_cb(uint8_t lun);
+void    tud_msc_capacity_cb(uint8_t lun, uint32_t *block_count, uint16_t *block_size);
+bool    tud_msc_start_stop_cb(uint8_t lun, uint8_t power_condition, bool start, bool load_eject);
+int32_t tud_msc_read10_cb(uint8_t lun, uint32_t lba, uint32_t offset, void *buffer, uint32_t bufsize);
+int32_t tud_msc_write10_cb(uint8_t lun, uint32_t lba, uint32_t offset, uint8_t *buffer, uint32_t bufsize);
+int32_t tud_msc_scsi_cb(uint8_t lun, uint8_t const scsi_cmd[16], void *buffer, uint16_t bufsize);
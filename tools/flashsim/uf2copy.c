@@ -0,0 +1,659 @@
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+
+#include "app_header.h"
+#include "dfu_flash.h"
+#include "clock.h"
+#include "crc.h"
+#include "ghostfat.h"
+#include "msc_flash.h"
+#include "slots.h"
+#include "tusb.h"
+#include "uf2.h"
+#include "flash_model.h"
+
+/*
+ * Copies a UF2 file onto the virtual FAT volume the way a host would, through
+ * the MSC callbacks of src/msc_flash.c, against the bank 2 model:
+ *
+ *   mount   read the boot sector, root directory and FAT, and all of
+ *           CURRENT.UF2, which has to match bank 2
+ *   copy    write a directory entry, FAT and the file's sectors into free
+ *           clusters, in endpoint-buffer-sized pieces
+ *   check   bank 2 against the file (sectors it touches erased first, the
+ *           others left alone), no flash word programmed twice, and
+ *           CURRENT.UF2 read back again
+ *
+ * With a fault injected the host carries on writing past the failed
+ * WRITE10, then copies the file again once the flash works, which has to
+ * check out. -d copies half of a different file first.
+ *
+ * Without a file, a random image of -s bytes is made up, or with -a one
+ * with a header filling an application slot, which has to end up
+ * activated. -A leaves an activated image in a slot beforehand; a file
+ * for that slot has to be refused with DATA PROTECT and bank 2 left as it
+ * was. Times are model time.
+ */
+
+#define US_TO_CYCLES(us) ((uint64_t)(us) * (CPU_CLOCK_HZ / 1000000u))
+
+#define SECTOR GHOSTFAT_SECTOR_SIZE
+#define XFER   CFG_TUD_MSC_EP_BUFSIZE
+
+typedef enum { RESULT_OK = 0, RESULT_FLASH_ERROR, RESULT_FAIL, RESULT_HANG } result_t;
+
+static const char *const result_names[] = { "ok", "flash error", "FAIL", "HANG" };
+
+static struct {
+    uint32_t size;           // made-up image bytes
+    uint32_t usb_us;         // host time per endpoint buffer
+    uint32_t seed;
+    uint32_t slot;           // made-up slot image, SLOT_COUNT for none
+    uint32_t running;        // slot activated before the copy, or SLOT_COUNT
+    uint32_t options;        // engine options before the copy
+    bool     shuffle;        // write the file's sectors in random order
+    bool     twice;          // write every piece twice, like a retrying host
+    bool     other;          // copy half of a different file first
+    flashsim_config_t config;
+} opt = {
+    .size   = 768u * 1024u + 100u,
+    .usb_us = 3400,          // 4 KB at full-speed bulk rates
+    .seed   = 1,
+    .slot    = SLOT_COUNT,
+    .running = SLOT_COUNT,
+    .config = {
+        .row_cycles   = 84u * (CPU_CLOCK_HZ / 1000000u),
+        .erase_cycles = 844u * (CPU_CLOCK_HZ / 1000u),
+        .bank_cycles  = 8u * 844u * (CPU_CLOCK_HZ / 1000u),
+    },
+};
+
+static uint8_t *file;        // the UF2 file
+static uint32_t file_blocks;
+static uint32_t file_bytes;  // payload for bank 2
+static uint8_t *other;       // -d: the file given up on
+static uint32_t other_blocks;
+static uint8_t *old;         // bank 2 before the copy
+static uint8_t *expect;      // bank 2 after it
+
+// Volume layout, from the boot sector
+static struct {
+    uint32_t fat_start;
+    uint32_t fat_sectors;
+    uint32_t root_start;
+    uint32_t root_entries;
+    uint32_t data_start;
+    uint32_t sectors;
+} vol;
+
+static uint8_t sense_key;
+static jmp_buf watchdog;
+
+void flash_job_done_cb(flash_job_type_t type, uint32_t addr, flash_error_t err) {
+    msc_job_done_cb(type, addr, err);
+}
+
+bool tud_msc_set_sense(uint8_t lun, uint8_t key, uint8_t asc, uint8_t ascq) {
+    (void)lun;
+    (void)asc;
+    (void)ascq;
+
+    sense_key = key;
+    return true;
+}
+
+void flashsim_watchdog_cb(void) {
+    longjmp(watchdog, 1);
+}
+
+static uint32_t rand_next(void) {
+    // xorshift32, deterministic per seed
+    opt.seed ^= opt.seed << 13;
+    opt.seed ^= opt.seed >> 17;
+    opt.seed ^= opt.seed << 5;
+    return opt.seed;
+}
+
+static uint16_t get16(const uint8_t *p) {
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static uint32_t get32(const uint8_t *p) {
+    return (uint32_t)get16(p) | ((uint32_t)get16(p + 2) << 16);
+}
+
+// -- Input ----------------------------------------------------------------
+
+// Random bytes with a header, as tools/apphdr.py would fill it in
+static void make_image(uint8_t *data, uint32_t size) {
+    app_header_t *hdr = (app_header_t *)&data[APP_HEADER_OFFSET];
+    const uint8_t *after = (const uint8_t *)&hdr->crc + sizeof(hdr->crc);
+
+    for (uint32_t i = 0; i < size; i++) {
+        data[i] = (uint8_t)rand_next();
+    }
+    hdr->magic   = APP_HEADER_MAGIC;
+    hdr->length  = size;
+    hdr->version = 0;
+    hdr->crc     = crc32_update(crc32_update(0, data, (uint32_t)((uint8_t *)&hdr->crc - data)),
+                                after, size - (uint32_t)(after - data));
+}
+
+static void make_file(void) {
+    uint32_t base = FLASH_BANK2_BASE;
+    uint8_t *data = malloc(opt.size);
+
+    if (opt.slot < SLOT_COUNT) {
+        make_image(data, opt.size);
+        base = SLOT_BASE(opt.slot);
+    } else {
+        for (uint32_t i = 0; i < opt.size; i++) {
+            data[i] = (uint8_t)rand_next();
+        }
+    }
+
+    file_blocks = uf2_num_blocks(opt.size);
+    file        = calloc(file_blocks, UF2_BLOCK_SIZE);
+
+    // uf2_render() takes the data from memory at the target address
+    uint8_t *bank = flashsim_mem() + (base - FLASH_BANK2_BASE);
+    memcpy(bank, data, opt.size);
+    for (uint32_t n = 0; n < file_blocks; n++) {
+        uf2_render(&file[n * UF2_BLOCK_SIZE], base, opt.size, n);
+    }
+    memset(flashsim_mem(), 0xFF, FLASHSIM_SIZE);
+    free(data);
+}
+
+static void load_file(const char *path) {
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {
+        perror(path);
+        exit(2);
+    }
+
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    if (size <= 0 || size % UF2_BLOCK_SIZE != 0) {
+        fprintf(stderr, "%s: not a whole number of UF2 blocks\n", path);
+        exit(2);
+    }
+
+    file_blocks = (uint32_t)(size / UF2_BLOCK_SIZE);
+    file        = malloc((size_t)size);
+    if (fread(file, 1, (size_t)size, f) != (size_t)size) {
+        perror(path);
+        exit(2);
+    }
+    fclose(f);
+}
+
+// Another file for the same addresses: different data, and a different
+// block count, which is how the device tells files apart. Only its first
+// half gets copied, so the file's sectors have to be erased again.
+static void make_other(void) {
+    other_blocks = file_blocks / 2u;
+    other        = malloc((size_t)other_blocks * UF2_BLOCK_SIZE);
+    memcpy(other, file, (size_t)other_blocks * UF2_BLOCK_SIZE);
+
+    for (uint32_t n = 0; n < other_blocks; n++) {
+        uf2_block_t *block = (uf2_block_t *)&other[n * UF2_BLOCK_SIZE];
+
+        block->num_blocks++;
+        for (uint32_t i = 0; i < UF2_PAYLOAD_MAX; i++) {
+            block->data[i] ^= 0xA5;
+        }
+    }
+}
+
+// An image in the -A slot with an activation record in its log, as an
+// earlier update left it
+static void make_running(void) {
+    const uint32_t size = 64u * 1024u;
+    uint8_t *image = &old[SLOT_BASE(opt.running) - FLASH_BANK2_BASE];
+    uint8_t *log   = image + SLOT_SIZE - SLOT_LOG_SIZE;
+
+    make_image(image, size);
+    memset(log, 0xFF, SLOT_LOG_SIZE);
+
+    slot_record_t rec = {
+        .magic    = SLOT_RECORD_MAGIC,
+        .kind     = SLOT_ACTIVATE,
+        .sequence = 1,
+        .crc      = ((const app_header_t *)&image[APP_HEADER_OFFSET])->crc,
+    };
+    rec.check = rec.magic ^ rec.kind ^ rec.sequence ^ rec.crc;
+    memcpy(log, &rec, sizeof(rec));
+}
+
+// The copy into the running slot: every data block refused, nothing on
+// flash changed
+static bool verify_refused(bool copied) {
+    bool ok = true;
+
+    if (copied || sense_key != SCSI_SENSE_DATA_PROTECT) {
+        printf("  copy into the running slot not refused, sense key %u\n", sense_key);
+        ok = false;
+    }
+    if (memcmp(flashsim_mem(), old, FLASHSIM_SIZE) != 0) {
+        printf("  bank 2 changed by a refused copy\n");
+        ok = false;
+    }
+    if (flash_get_options() != opt.options) {
+        printf("  engine options %02X afterwards, were %02X\n", flash_get_options(), opt.options);
+        ok = false;
+    }
+    return ok;
+}
+
+// What bank 2 should hold after the copy: sectors the file touches are
+// auto-erased, then programmed
+static void make_expect(void) {
+    uf2_block_t block;
+    uint8_t     touched = 0;
+
+    memcpy(expect, old, FLASHSIM_SIZE);
+
+    for (int pass = 0; pass < 2; pass++) {
+        for (uint32_t n = 0; n < file_blocks; n++) {
+            if (uf2_check(&file[n * UF2_BLOCK_SIZE], &block) != UF2_DATA
+             || block.target_addr < FLASH_BANK2_BASE
+             || block.target_addr - FLASH_BANK2_BASE + block.payload_size > FLASHSIM_SIZE) {
+                continue;
+            }
+
+            uint32_t off = block.target_addr - FLASH_BANK2_BASE;
+            if (pass == 0) {
+                touched |= (uint8_t)(1u << (off / FLASHSIM_SECTOR));
+                touched |= (uint8_t)(1u << ((off + block.payload_size - 1u) / FLASHSIM_SECTOR));
+            } else {
+                memcpy(&expect[off], block.data, block.payload_size);
+                file_bytes += block.payload_size;
+            }
+        }
+
+        if (pass == 0) {
+            for (unsigned s = 0; s < FLASHSIM_SECTORS; s++) {
+                if (touched & (1u << s)) {
+                    memset(&expect[s * FLASHSIM_SECTOR], 0xFF, FLASHSIM_SECTOR);
+                }
+            }
+        }
+    }
+}
+
+// -- The host's side ------------------------------------------------------
+
+static void read_sectors(uint32_t lba, uint8_t *buf, uint32_t count) {
+    for (uint32_t done = 0; done < count; ) {
+        uint32_t n = count - done;
+        if (n > XFER / SECTOR) {
+            n = XFER / SECTOR;
+        }
+        tud_msc_read10_cb(0, lba + done, 0, buf + done * SECTOR, n * SECTOR);
+        done += n;
+    }
+}
+
+// One WRITE10 data phase, as TinyUSB hands it over: an endpoint buffer at a
+// time, and whatever the callback doesn't take is offered again
+static bool write_sectors(uint32_t lba, const uint8_t *data, uint32_t count) {
+    uint8_t buf[XFER];
+
+    for (uint32_t done = 0; done < count; ) {
+        uint32_t n = count - done;
+        if (n > XFER / SECTOR) {
+            n = XFER / SECTOR;
+        }
+        memcpy(buf, data + done * SECTOR, n * SECTOR);
+        flashsim_advance(US_TO_CYCLES((uint64_t)opt.usb_us * n * SECTOR / XFER));
+
+        uint32_t len = n * SECTOR;
+        uint32_t off = 0;
+        while (off < len) {
+            int32_t taken = tud_msc_write10_cb(0, lba + done, off, buf, len - off);
+            if (taken < 0) {
+                return false;
+            }
+            if ((uint32_t)taken < len - off) {
+                memmove(buf, buf + taken, len - off - (uint32_t)taken);
+                flashsim_wait_event();
+            }
+            off += (uint32_t)taken;
+        }
+        done += n;
+    }
+    return true;
+}
+
+static uint16_t fat_entry(uint32_t cluster) {
+    uint8_t sector[SECTOR];
+    read_sectors(vol.fat_start + cluster / (SECTOR / 2), sector, 1);
+    return get16(&sector[(cluster % (SECTOR / 2)) * 2]);
+}
+
+static bool mount(void) {
+    uint8_t sector[SECTOR];
+
+    read_sectors(0, sector, 1);
+    if (get16(&sector[11]) != SECTOR || sector[13] != 1 || sector[510] != 0x55 || sector[511] != 0xAA
+     || memcmp(&sector[54], "FAT16   ", 8) != 0) {
+        printf("  boot sector is not a FAT16 one with 512-byte clusters\n");
+        return false;
+    }
+
+    vol.fat_start    = get16(&sector[14]);
+    vol.fat_sectors  = get16(&sector[22]);
+    vol.root_start   = vol.fat_start + sector[16] * vol.fat_sectors;
+    vol.root_entries = get16(&sector[17]);
+    vol.data_start   = vol.root_start + vol.root_entries * 32u / SECTOR;
+    vol.sectors      = get16(&sector[19]);
+
+    uint32_t block_count;
+    uint16_t block_size;
+    tud_msc_capacity_cb(0, &block_count, &block_size);
+    if (block_count != vol.sectors || block_size != SECTOR) {
+        printf("  capacity %u x %u, boot sector says %u x %u\n", block_count, block_size, vol.sectors, SECTOR);
+        return false;
+    }
+
+    // CURRENT.UF2: a contiguous cluster chain holding bank 2 as it is now
+    read_sectors(vol.root_start, sector, 1);
+    for (uint32_t i = 0; i < SECTOR / 32; i++) {
+        const uint8_t *d = &sector[i * 32];
+        if (memcmp(d, "CURRENT UF2", 11) != 0) {
+            continue;
+        }
+
+        uint32_t start = get16(&d[26]);
+        uint32_t size  = get32(&d[28]);
+        uint32_t count = size / SECTOR;
+
+        if (size != uf2_num_blocks(FLASHSIM_SIZE) * UF2_BLOCK_SIZE) {
+            printf("  CURRENT.UF2 is %u bytes\n", size);
+            return false;
+        }
+        for (uint32_t c = 0; c < count; c++) {
+            uint16_t next = fat_entry(start + c);
+            if (next != ((c + 1 == count) ? 0xFFFF : start + c + 1)) {
+                printf("  CURRENT.UF2 cluster chain broken at cluster %u\n", start + c);
+                return false;
+            }
+        }
+
+        uint8_t *current = malloc(size);
+        read_sectors(vol.data_start + start - 2, current, count);
+
+        for (uint32_t n = 0; n < count; n++) {
+            uf2_block_t block;
+            if (uf2_check(&current[n * SECTOR], &block) != UF2_DATA
+             || block.block_no != n || block.num_blocks != count
+             || block.target_addr != FLASH_BANK2_BASE + n * UF2_PAYLOAD_SIZE
+             || memcmp(block.data, &flashsim_mem()[n * UF2_PAYLOAD_SIZE], block.payload_size) != 0) {
+                printf("  CURRENT.UF2 block %u does not match bank 2\n", n);
+                free(current);
+                return false;
+            }
+        }
+        free(current);
+        return true;
+    }
+
+    printf("  no CURRENT.UF2 in the root directory\n");
+    return false;
+}
+
+// Find room for the file after everything allocated
+static uint32_t free_cluster(void) {
+    uint32_t cluster = 2;
+    while (fat_entry(cluster) != 0) {
+        cluster++;
+    }
+    return cluster;
+}
+
+// Carries on past a failed write like a host flushing its cache would,
+// false if any failed
+static bool copy(const uint8_t *data, uint32_t blocks) {
+    uint32_t start = free_cluster();
+    uint8_t  sector[SECTOR];
+
+    if (vol.data_start + start - 2 + blocks > vol.sectors) {
+        printf("  file does not fit on the volume\n");
+        return false;
+    }
+
+    // Directory entry and FAT first, as hosts tend to do; none of it is kept
+    read_sectors(vol.root_start, sector, 1);
+    memcpy(&sector[15 * 32], "NEW     UF2", 11);
+    if (!write_sectors(vol.root_start, sector, 1)) {
+        return false;
+    }
+    read_sectors(vol.fat_start, sector, 1);
+    memset(sector + SECTOR / 2, 0xAA, SECTOR / 2);
+    if (!write_sectors(vol.fat_start, sector, 1)) {
+        return false;
+    }
+
+    // Then the data, in host-sized writes
+    const uint32_t per_write = 64; // sectors, 32 KB
+    uint32_t pieces = (blocks + per_write - 1) / per_write;
+    uint32_t *order = malloc(pieces * sizeof(*order));
+
+    for (uint32_t i = 0; i < pieces; i++) {
+        order[i] = i;
+    }
+    if (opt.shuffle) {
+        for (uint32_t i = pieces - 1; i > 0; i--) {
+            uint32_t j = rand_next() % (i + 1);
+            uint32_t t = order[i];
+            order[i] = order[j];
+            order[j] = t;
+        }
+    }
+
+    bool ok = true;
+    for (uint32_t i = 0; i < pieces; i++) {
+        uint32_t first = order[i] * per_write;
+        uint32_t count = (blocks - first < per_write) ? blocks - first : per_write;
+
+        for (int k = 0; k < (opt.twice ? 2 : 1); k++) {
+            ok &= write_sectors(vol.data_start + start - 2 + first, &data[first * SECTOR], count);
+        }
+    }
+    free(order);
+    return ok;
+}
+
+// Let msc_task() see the file onto flash
+static bool settle(void) {
+    while (!msc_task()) {
+        if (!flash_is_busy()) {
+            return false;
+        }
+        flashsim_wait_event();
+    }
+    return true;
+}
+
+static bool verify(void) {
+    const uint8_t *mem = flashsim_mem();
+    bool ok = true;
+
+    // The activation record is the one thing the file doesn't say
+    if (opt.slot < SLOT_COUNT) {
+        uint32_t sequence;
+        uint32_t log = SLOT_BASE(opt.slot) + SLOT_SIZE - SLOT_LOG_SIZE - FLASH_BANK2_BASE;
+
+        if (!slot_is_active(opt.slot, &sequence)) {
+            printf("  slot %u not activated\n", opt.slot);
+            ok = false;
+        }
+        memcpy(&expect[log], &mem[log], sizeof(slot_record_t));
+    }
+
+    for (uint32_t i = 0; i < FLASHSIM_SIZE; i++) {
+        if (mem[i] != expect[i]) {
+            printf("  mismatch at 0x%08X: %02X, expected %02X\n", FLASH_BANK2_BASE + i, mem[i], expect[i]);
+            ok = false;
+            break;
+        }
+    }
+
+    const flashsim_counters_t *c = flashsim_counters();
+    if (c->reprograms != 0) {
+        printf("  %llu flash words programmed twice between erases, first at 0x%08X\n",
+               (unsigned long long)c->reprograms, c->first_reprogram);
+        ok = false;
+    }
+
+    if (flash_get_options() != opt.options) {
+        printf("  engine options %02X afterwards, were %02X\n", flash_get_options(), opt.options);
+        ok = false;
+    }
+
+    // And what the host sees now
+    return ok && mount();
+}
+
+static void usage(void) {
+    fprintf(stderr,
+        "usage: uf2copy [options] [FILE.uf2]\n"
+        "  -s BYTES   size of the made-up image without a file (default %u)\n"
+        "  -a SLOT    made-up image for an application slot instead\n"
+        "  -A SLOT    slot running an activated image before the copy (with -a)\n"
+        "  -u US      host time per %u-byte endpoint buffer (default %u)\n"
+        "  -r         write the file in random order\n"
+        "  -t         write everything twice\n"
+        "  -d         copy half of a different file first\n"
+        "  -D         diff programming (FLASH_OPT_DIFF) on\n"
+        "  -S SEED    random seed\n"
+        "  -w MASK    write-protected sectors\n"
+        "  -p N       fail the N-th program operation with PGSERR\n"
+        "  -q N       leave QW stuck after the N-th operation\n",
+        opt.size, XFER, opt.usb_us);
+    exit(2);
+}
+
+int main(int argc, char **argv) {
+    int c;
+
+    while ((c = getopt(argc, argv, "s:a:A:u:rtdDS:w:p:q:h")) != -1) {
+        uint32_t v = (uint32_t)strtoul(optarg ? optarg : "0", NULL, 0);
+
+        switch (c) {
+            case 's': opt.size    = v; break;
+            case 'a': opt.slot    = (v < SLOT_COUNT) ? v : SLOT_COUNT + 1u;
+                      opt.size    = SLOT_IMAGE_MAX; break;
+            case 'A': opt.running = (v < SLOT_COUNT) ? v : SLOT_COUNT + 1u; break;
+            case 'u': opt.usb_us  = v; break;
+            case 'r': opt.shuffle = true; break;
+            case 't': opt.twice   = true; break;
+            case 'd': opt.other   = true; break;
+            case 'D': opt.options = FLASH_OPT_DIFF;
+                      if (!(FLASH_OPTS_SUPPORTED & FLASH_OPT_DIFF)) {
+                          fprintf(stderr, "-D: built without DFU_DIFF\n");
+                          exit(2);
+                      }
+                      break;
+            case 'S': opt.seed    = v ? v : 1; break;
+            case 'w': opt.config.wrp_sectors = (uint8_t)v; break;
+            case 'p': opt.config.pgserr_at   = v; break;
+            case 'q': opt.config.stuck_qw_at = v; break;
+            default:  usage();
+        }
+    }
+
+    if (opt.size == 0 || opt.size > FLASHSIM_SIZE || argc - optind > 1
+     || (opt.slot != SLOT_COUNT && (opt.slot > SLOT_COUNT || optind < argc))
+     || (opt.running != SLOT_COUNT && (opt.running > SLOT_COUNT || opt.slot == SLOT_COUNT))) {
+        usage();
+    }
+
+    // Faults only once the old image is in place
+    flashsim_config_t config = opt.config;
+    opt.config.wrp_sectors = 0;
+    opt.config.pgserr_at   = 0;
+    opt.config.stuck_qw_at = 0;
+    flashsim_init(&opt.config);
+    flash_init();
+    flash_set_options(opt.options);
+
+    if (optind < argc) {
+        load_file(argv[optind]);
+    } else {
+        make_file();
+    }
+
+    old    = malloc(FLASHSIM_SIZE);
+    expect = malloc(FLASHSIM_SIZE);
+    for (uint32_t i = 0; i < FLASHSIM_SIZE; i += 4) {
+        uint32_t r = rand_next();
+        memcpy(&old[i], &r, 4);
+    }
+    if (opt.running < SLOT_COUNT) {
+        make_running();
+    }
+    flashsim_preload(0, old, FLASHSIM_SIZE);
+    flashsim_reset_config(&config);
+    make_expect();
+    if (opt.other) {
+        make_other();
+    }
+
+    result_t result;
+
+    if (setjmp(watchdog) != 0) {
+        result = RESULT_HANG;
+    } else if (!mount()) {
+        result = RESULT_FAIL;
+    } else {
+        uint64_t t0 = flashsim_now();
+        bool copied = !opt.other || copy(other, other_blocks);
+        copied     &= copy(file, file_blocks);
+        bool done   = settle();
+        double ms   = (double)(flashsim_now() - t0) / (CPU_CLOCK_HZ / 1000u);
+
+        if (opt.running < SLOT_COUNT && opt.running == opt.slot) {
+            result = verify_refused(copied) ? RESULT_OK : RESULT_FAIL;
+        } else if (!copied && sense_key != SCSI_SENSE_NONE) {
+            printf("  write failed, sense key %u\n", sense_key);
+            result = RESULT_FLASH_ERROR;
+
+            // Once the flash works again, copying the file again has to
+            flashsim_reset_config(&opt.config);
+            sense_key = SCSI_SENSE_NONE;
+            if (!copy(file, file_blocks) || !settle()) {
+                printf("  copying again after the error failed, sense key %u\n", sense_key);
+                result = RESULT_FAIL;
+            } else if (!verify()) {
+                result = RESULT_FAIL;
+            }
+        } else if (!done) {
+            printf("  file copied but not all on flash\n");
+            result = RESULT_FAIL;
+        } else {
+            result = verify() ? RESULT_OK : RESULT_FAIL;
+        }
+
+        const flashsim_counters_t *cnt = flashsim_counters();
+        printf("%-11s %u blocks %9.1f ms %8.1f KB/s  erases %2llu  rows %6llu  irqs %llu\n",
+               result_names[result], file_blocks, ms,
+               ms > 0 ? file_bytes / 1024.0 / (ms / 1000.0) : 0.0,
+               (unsigned long long)cnt->erases, (unsigned long long)cnt->programs,
+               (unsigned long long)cnt->irqs);
+    }
+
+    if (result == RESULT_HANG) {
+        printf("HANG: engine stuck in state %d with the queue not empty\n", flash_get_state());
+    }
+
+    // With faults injected, a reported flash error is the right outcome
+    bool faults = config.wrp_sectors || config.pgserr_at || config.stuck_qw_at;
+    return (result == RESULT_FAIL || result == RESULT_HANG
+         || (result == RESULT_FLASH_ERROR && !faults)) ? 1 : 0;
+}
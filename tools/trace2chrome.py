@@ -0,0 +1,174 @@
+#!/usr/bin/env python3
+"""Convert a bootloader trace dump to Chrome trace JSON.
+
+Capture a dump by sending 'T' on the CDC port of a -DDFU_TRACE=ON build:
+
+    trace2chrome.py --port /dev/ttyACM0 -o trace.json
+    trace2chrome.py dump.bin -o trace.json
+
+and open the result in chrome://tracing or https://ui.perfetto.dev.
+"""
+
+import argparse
+import json
+import struct
+import sys
+
+MAGIC = 0x43525444  # "DTRC"
+HEADER = struct.Struct("<IIII")  # magic, version, clock_hz, count
+RECORD = struct.Struct("<III")   # cycles, event, arg
+
+# Must match trace_event_t in include/trace.h
+EVENTS = {
+    1: "DNLOAD",
+    2: "UPLOAD",
+    3: "GETSTATUS",
+    4: "STATUS_REPLY",
+    5: "JOB_START",
+    6: "JOB_END",
+    7: "ERASE_START",
+    8: "ERASE_END",
+    9: "ROW",
+    10: "FORCE_WRITE",
+    11: "FLASH_ERROR",
+    12: "READ_START",
+    13: "READ_END",
+}
+
+JOB_TYPES = {0: "erase", 1: "write", 2: "finish"}
+
+DFU_STATES = {
+    0: "appIDLE", 1: "appDETACH", 2: "dfuIDLE", 3: "dfuDNLOAD-SYNC",
+    4: "dfuDNBUSY", 5: "dfuDNLOAD-IDLE", 6: "dfuMANIFEST-SYNC",
+    7: "dfuMANIFEST", 8: "dfuMANIFEST-WAIT-RESET", 9: "dfuUPLOAD-IDLE",
+    10: "dfuERROR",
+}
+
+PID = 1
+TID_USB, TID_QUEUE, TID_FLASH = 1, 2, 3
+
+
+def read_dump_from_port(port):
+    import serial  # pyserial, only needed for live capture
+
+    with serial.Serial(port, timeout=2) as s:
+        s.reset_input_buffer()
+        s.write(b"T")
+        header = s.read(HEADER.size)
+        if len(header) != HEADER.size:
+            sys.exit("no trace header received, is this a DFU_TRACE build?")
+        count = HEADER.unpack(header)[3]
+        body = s.read(count * RECORD.size)
+    return header + body
+
+
+def parse(data):
+    magic, version, clock_hz, count = HEADER.unpack_from(data, 0)
+    if magic != MAGIC:
+        sys.exit("not a trace dump (bad magic)")
+    if version != 1:
+        sys.exit("unsupported trace version %d" % version)
+
+    records = []
+    offset = HEADER.size
+    for _ in range(count):
+        if offset + RECORD.size > len(data):
+            print("warning: dump truncated", file=sys.stderr)
+            break
+        records.append(RECORD.unpack_from(data, offset))
+        offset += RECORD.size
+    return clock_hz, records
+
+
+def convert(clock_hz, records):
+    events = []
+    cycles_per_us = clock_hz / 1e6
+    base = records[0][0] if records else 0
+    elapsed = 0
+    prev = base
+
+    def add(ph, name, tid, ts, **args):
+        ev = {"ph": ph, "name": name, "pid": PID, "tid": tid, "ts": ts}
+        if ph == "i":
+            ev["s"] = "t"
+        if args:
+            ev["args"] = args
+        events.append(ev)
+
+    for cycles, event, arg in records:
+        # CYCCNT wraps every ~10 s at 400 MHz; records are in order
+        elapsed += (cycles - prev) & 0xFFFFFFFF
+        prev = cycles
+        ts = elapsed / cycles_per_us
+
+        name = EVENTS.get(event, "event%d" % event)
+
+        if name == "DNLOAD" or name == "UPLOAD":
+            add("i", name, TID_USB, ts, block=arg >> 16, length=arg & 0xFFFF)
+        elif name == "GETSTATUS":
+            add("B", "GETSTATUS", TID_USB, ts,
+                state=DFU_STATES.get(arg >> 16, arg >> 16), block=arg & 0xFFFF)
+        elif name == "STATUS_REPLY":
+            add("E", "GETSTATUS", TID_USB, ts,
+                reply=DFU_STATES.get(arg >> 24, arg >> 24),
+                poll_ms=arg & 0xFFFFFF)
+        elif name == "JOB_START":
+            add("B", JOB_TYPES.get(arg >> 24, "job"), TID_QUEUE, ts,
+                queued=arg & 0xFF)
+        elif name == "JOB_END":
+            add("E", JOB_TYPES.get(arg, "job"), TID_QUEUE, ts)
+        elif name == "ERASE_START":
+            add("B", "bank erase" if arg == 0xFF else "erase sector %d" % arg,
+                TID_FLASH, ts)
+        elif name == "ERASE_END":
+            add("E", "erase", TID_FLASH, ts)
+        elif name == "ROW" or name == "FORCE_WRITE":
+            add("i", name, TID_FLASH, ts, addr="0x%08X" % arg)
+        elif name == "READ_START":
+            add("B", "flash read", TID_USB, ts, addr="0x%08X" % arg)
+        elif name == "READ_END":
+            add("E", "flash read", TID_USB, ts, length=arg)
+        elif name == "FLASH_ERROR":
+            add("i", name, TID_FLASH, ts, sr2="0x%08X" % arg)
+        else:
+            add("i", name, TID_FLASH, ts, arg=arg)
+
+    for tid, label in ((TID_USB, "USB"), (TID_QUEUE, "flash queue"),
+                       (TID_FLASH, "flash controller")):
+        events.append({"ph": "M", "name": "thread_name", "pid": PID,
+                       "tid": tid, "args": {"name": label}})
+
+    return {"traceEvents": events, "displayTimeUnit": "ms"}
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    ap.add_argument("dump", nargs="?", help="binary dump file")
+    ap.add_argument("--port", help="capture from this CDC serial port instead")
+    ap.add_argument("--save", help="also save the raw dump here")
+    ap.add_argument("-o", "--output", default="-", help="JSON output (default stdout)")
+    args = ap.parse_args()
+
+    if args.port:
+        data = read_dump_from_port(args.port)
+    elif args.dump:
+        with open(args.dump, "rb") as f:
+            data = f.read()
+    else:
+        ap.error("give a dump file or --port")
+
+    if args.save:
+        with open(args.save, "wb") as f:
+            f.write(data)
+
+    trace = convert(*parse(data))
+
+    if args.output == "-":
+        json.dump(trace, sys.stdout)
+    else:
+        with open(args.output, "w") as f:
+            json.dump(trace, f)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,399 @@
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <libusb.h>
+
+#include "vendor_proto.h"
+
+/*
+ * Host side of the vendor bulk interface:
+ *
+ *   vendorflash write FILE [ADDR]      erase, write and check the CRC
+ *   vendorflash read ADDR LENGTH FILE
+ *   vendorflash crc ADDR LENGTH
+ *
+ * Writes keep up to the device's credit in flight as a few overlapping bulk
+ * transfers, so the bus never waits for a round trip.
+ */
+
+#define USB_VID 0x0483
+#define USB_PID 0xdf11
+
+#define EP_OUT 0x04
+#define EP_IN  0x84
+
+#define OUT_TRANSFERS 4      // bulk OUT transfers in flight
+#define OUT_CHUNK     4096   // bytes per OUT transfer, at most
+#define IN_BUFSIZE    16384
+#define TIMEOUT_MS    5000
+
+static libusb_device_handle *dev;
+static int itf = -1;
+
+// Outgoing byte stream: commands and data, sent as credit allows
+static struct {
+    uint8_t *buf;
+    size_t   len;
+    size_t   cap;
+    size_t   sent;           // handed to libusb
+    size_t   acked;          // completed by libusb
+    uint32_t credit;
+    uint16_t seq;
+    int      in_flight;
+} out;
+
+// Incoming status stream
+static struct {
+    uint8_t  buf[IN_BUFSIZE];
+    size_t   len;
+    uint16_t done_seq;       // last command completed
+    int      error;
+    bool     failed;
+    uint32_t value;          // from the reply to the last CRC/READ/SYNC
+    uint8_t *read_dst;       // READ data goes here
+    uint32_t read_left;
+} in;
+
+static double now_s(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void die(const char *what, int err) {
+    fprintf(stderr, "vendorflash: %s: %s\n", what, (err < 0) ? libusb_error_name(err) : strerror(err));
+    exit(1);
+}
+
+static uint32_t crc32(uint32_t crc, const uint8_t *p, size_t len) {
+    crc = ~crc;
+    while (len--) {
+        crc ^= *p++;
+        for (int i = 0; i < 8; i++) {
+            crc = (crc >> 1) ^ (0xEDB88320u & -(crc & 1u));
+        }
+    }
+    return ~crc;
+}
+
+static void out_append(const void *data, size_t len) {
+    if (out.len + len > out.cap) {
+        out.cap = (out.len + len) * 2;
+        out.buf = realloc(out.buf, out.cap);
+    }
+    memcpy(out.buf + out.len, data, len);
+    out.len += len;
+}
+
+static uint16_t command(uint8_t cmd, uint32_t addr, uint32_t length, const uint8_t *data) {
+    const vnd_cmd_t c = {
+        .cmd    = cmd,
+        .seq    = ++out.seq,
+        .addr   = addr,
+        .length = length,
+    };
+    out_append(&c, sizeof(c));
+    if (cmd == VND_CMD_WRITE) {
+        out_append(data, length);
+    }
+    return c.seq;
+}
+
+static const char *status_name(uint8_t status) {
+    switch (status) {
+        case VND_ERR_COMMAND:       return "unknown command";
+        case VND_ERR_SEQ:           return "sequence error";
+        case VND_ERR_ADDRESS:       return "bad address";
+        case VND_ERR_WRITE_PROTECT: return "write protected";
+        case VND_ERR_PROGRAM:       return "programming error";
+        case VND_ERR_SLOT:          return "slot refused";
+        default:                    return "error";
+    }
+}
+
+// Take statuses (and READ data) out of the IN byte stream
+static void parse_in(void) {
+    size_t pos = 0;
+
+    for (;;) {
+        if (in.read_left > 0) {
+            size_t n = in.len - pos;
+            if (n > in.read_left) n = in.read_left;
+            memcpy(in.read_dst, in.buf + pos, n);
+            in.read_dst  += n;
+            in.read_left -= (uint32_t)n;
+            pos          += n;
+            if (in.read_left > 0) break;
+        }
+
+        if (in.len - pos < sizeof(vnd_status_t)) {
+            break;
+        }
+
+        vnd_status_t st;
+        memcpy(&st, in.buf + pos, sizeof(st));
+        pos += sizeof(st);
+
+        in.done_seq = st.seq;
+        if (st.credit - out.credit < 0x80000000u) {
+            out.credit = st.credit;
+        }
+        if (st.status != VND_OK) {
+            in.failed = true;
+            in.error  = st.status;
+            fprintf(stderr, "vendorflash: device: %s (command %u)\n", status_name(st.status), st.seq + 1u);
+        }
+        if (st.cmd != 0) {
+            in.value = st.value;
+            if (st.cmd == VND_CMD_READ && st.status == VND_OK) {
+                in.read_left = st.value;
+            }
+        }
+    }
+
+    memmove(in.buf, in.buf + pos, in.len - pos);
+    in.len -= pos;
+}
+
+static void LIBUSB_CALL in_done(struct libusb_transfer *t) {
+    if (t->status != LIBUSB_TRANSFER_COMPLETED && t->status != LIBUSB_TRANSFER_TIMED_OUT) {
+        die("bulk IN", t->status == LIBUSB_TRANSFER_NO_DEVICE ? LIBUSB_ERROR_NO_DEVICE : LIBUSB_ERROR_IO);
+    }
+
+    in.len += t->actual_length;
+    parse_in();
+
+    t->buffer = in.buf + in.len;
+    t->length = (int)(sizeof(in.buf) - in.len);
+    int err = libusb_submit_transfer(t);
+    if (err) die("bulk IN", err);
+}
+
+static void LIBUSB_CALL out_done(struct libusb_transfer *t) {
+    if (t->status != LIBUSB_TRANSFER_COMPLETED) {
+        die("bulk OUT", LIBUSB_ERROR_IO);
+    }
+    out.acked += t->actual_length;
+    out.in_flight--;
+    libusb_free_transfer(t);
+}
+
+// Send whatever the credit allows
+static void pump_out(void) {
+    while (out.in_flight < OUT_TRANSFERS && out.sent < out.len && !in.failed) {
+        size_t allowed = (uint32_t)(out.credit - (uint32_t)out.sent);
+        size_t n       = out.len - out.sent;
+
+        if (allowed == 0 || allowed > 0x80000000u) {
+            return;
+        }
+        if (n > allowed)   n = allowed;
+        if (n > OUT_CHUNK) n = OUT_CHUNK;
+
+        struct libusb_transfer *t = libusb_alloc_transfer(0);
+        libusb_fill_bulk_transfer(t, dev, EP_OUT, out.buf + out.sent, (int)n, out_done, NULL, TIMEOUT_MS);
+        int err = libusb_submit_transfer(t);
+        if (err) die("bulk OUT", err);
+
+        out.sent += n;
+        out.in_flight++;
+    }
+}
+
+// Run until command seq has completed (and its READ data, if any, arrived)
+static void wait_for(uint16_t seq, bool progress) {
+    double   start = now_s();
+    double   last  = start;
+    size_t   total = out.len;
+
+    while (!in.failed && ((int16_t)(in.done_seq - seq) < 0 || in.read_left > 0)) {
+        pump_out();
+
+        struct timeval tv = { .tv_sec = 1 };
+        int err = libusb_handle_events_timeout(NULL, &tv);
+        if (err) die("events", err);
+
+        if (progress && now_s() - last > 0.5) {
+            last = now_s();
+            fprintf(stderr, "\r%zu / %zu KB  %.0f KB/s ", out.acked / 1024, total / 1024,
+                    out.acked / 1024.0 / (last - start));
+        }
+    }
+    if (progress) {
+        fprintf(stderr, "\n");
+    }
+    if (in.failed) {
+        exit(1);
+    }
+}
+
+static void open_device(void) {
+    int err = libusb_init(NULL);
+    if (err) die("libusb_init", err);
+
+    dev = libusb_open_device_with_vid_pid(NULL, USB_VID, USB_PID);
+    if (dev == NULL) {
+        fprintf(stderr, "vendorflash: no device %04x:%04x\n", USB_VID, USB_PID);
+        exit(1);
+    }
+
+    // The vendor-specific interface
+    struct libusb_config_descriptor *cfg;
+    err = libusb_get_active_config_descriptor(libusb_get_device(dev), &cfg);
+    if (err) die("config descriptor", err);
+    for (int i = 0; i < cfg->bNumInterfaces; i++) {
+        if (cfg->interface[i].altsetting[0].bInterfaceClass == LIBUSB_CLASS_VENDOR_SPEC) {
+            itf = cfg->interface[i].altsetting[0].bInterfaceNumber;
+        }
+    }
+    libusb_free_config_descriptor(cfg);
+    if (itf < 0) {
+        fprintf(stderr, "vendorflash: device has no vendor interface, old bootloader?\n");
+        exit(1);
+    }
+
+    err = libusb_claim_interface(dev, itf);
+    if (err) die("claim interface", err);
+
+    // Start from a clean slate, whatever the last session left behind
+    const uint8_t type_out = LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_INTERFACE;
+    const uint8_t type_in  = LIBUSB_ENDPOINT_IN  | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_INTERFACE;
+
+    err = libusb_control_transfer(dev, type_out, VND_REQ_RESET, 0, (uint16_t)itf, NULL, 0, TIMEOUT_MS);
+    if (err < 0) die("reset", err);
+
+    vnd_info_t info;
+    err = libusb_control_transfer(dev, type_in, VND_REQ_INFO, 0, (uint16_t)itf,
+                                  (uint8_t *)&info, sizeof(info), TIMEOUT_MS);
+    if (err < (int)sizeof(info)) die("info", err < 0 ? err : EPROTO);
+    if (info.version != VND_PROTO_VERSION) {
+        fprintf(stderr, "vendorflash: protocol version %u, expected %u\n", info.version, VND_PROTO_VERSION);
+        exit(1);
+    }
+    out.credit = info.window;
+
+    // Drain anything left over from before the reset
+    uint8_t junk[512];
+    int n;
+    while (libusb_bulk_transfer(dev, EP_IN, junk, sizeof(junk), &n, 10) == 0) { }
+
+    struct libusb_transfer *t = libusb_alloc_transfer(0);
+    libusb_fill_bulk_transfer(t, dev, EP_IN, in.buf, sizeof(in.buf), in_done, NULL, 0);
+    err = libusb_submit_transfer(t);
+    if (err) die("bulk IN", err);
+}
+
+static uint8_t *read_file(const char *path, size_t *len) {
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) die(path, errno);
+
+    fseek(f, 0, SEEK_END);
+    *len = (size_t)ftell(f);
+    rewind(f);
+
+    uint8_t *data = malloc(*len ? *len : 1);
+    if (fread(data, 1, *len, f) != *len) die(path, EIO);
+    fclose(f);
+    return data;
+}
+
+static int do_write(const char *path, uint32_t addr) {
+    size_t   len;
+    uint8_t *data = read_file(path, &len);
+
+    if (len == 0) {
+        return 0;
+    }
+
+    double start = now_s();
+
+    command(VND_CMD_ERASE, addr, (uint32_t)len, NULL);
+    command(VND_CMD_WRITE, addr, (uint32_t)len, data);
+    uint16_t sync = command(VND_CMD_SYNC, 0, 0, NULL);
+    wait_for(sync, true);
+
+    double   secs = now_s() - start;
+    uint32_t crc  = crc32(0, data, len);
+    printf("%zu bytes in %.2f s, %.0f KB/s\n", len, secs, len / 1024.0 / secs);
+
+    if (in.value != crc) {
+        fprintf(stderr, "vendorflash: CRC mismatch, device %08X, file %08X\n", in.value, crc);
+        return 1;
+    }
+    printf("CRC %08X ok\n", crc);
+    return 0;
+}
+
+static int do_read(uint32_t addr, uint32_t length, const char *path) {
+    uint8_t *data = malloc(length ? length : 1);
+
+    double start = now_s();
+
+    in.read_dst = data;
+    uint16_t seq = command(VND_CMD_READ, addr, length, NULL);
+    wait_for(seq, false);
+
+    double secs = now_s() - start;
+    printf("%u bytes in %.2f s, %.0f KB/s\n", length, secs, length / 1024.0 / secs);
+
+    FILE *f = fopen(path, "wb");
+    if (f == NULL || fwrite(data, 1, length, f) != length) die(path, errno);
+    fclose(f);
+    return 0;
+}
+
+static int do_crc(uint32_t addr, uint32_t length) {
+    uint16_t seq = command(VND_CMD_CRC, addr, length, NULL);
+    wait_for(seq, false);
+    printf("%08X\n", in.value);
+    return 0;
+}
+
+static int do_slot(uint8_t cmd, uint32_t slot) {
+    uint16_t seq = command(cmd, slot, 0, NULL);
+    wait_for(seq, false);
+    printf("slot %u %s\n", slot, (cmd == VND_CMD_ACTIVATE) ? "activated" : "revoked");
+    return 0;
+}
+
+static void usage(void) {
+    fprintf(stderr,
+        "usage: vendorflash write FILE [ADDR]\n"
+        "       vendorflash read ADDR LENGTH FILE\n"
+        "       vendorflash crc ADDR LENGTH        (LENGTH 0: CRC of the last download)\n"
+        "       vendorflash activate|revoke SLOT\n");
+    exit(2);
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        usage();
+    }
+
+    int ret;
+    if (strcmp(argv[1], "write") == 0 && (argc == 3 || argc == 4)) {
+        open_device();
+        ret = do_write(argv[2], (argc == 4) ? (uint32_t)strtoul(argv[3], NULL, 0) : 0x08100000u);
+    } else if (strcmp(argv[1], "read") == 0 && argc == 5) {
+        open_device();
+        ret = do_read((uint32_t)strtoul(argv[2], NULL, 0), (uint32_t)strtoul(argv[3], NULL, 0), argv[4]);
+    } else if (strcmp(argv[1], "crc") == 0 && argc == 4) {
+        open_device();
+        ret = do_crc((uint32_t)strtoul(argv[2], NULL, 0), (uint32_t)strtoul(argv[3], NULL, 0));
+    } else if ((strcmp(argv[1], "activate") == 0 || strcmp(argv[1], "revoke") == 0) && argc == 3) {
+        open_device();
+        ret = do_slot((argv[1][0] == 'a') ? VND_CMD_ACTIVATE : VND_CMD_REVOKE,
+                      (uint32_t)strtoul(argv[2], NULL, 0));
+    } else {
+        usage();
+    }
+
+    libusb_release_interface(dev, itf);
+    libusb_close(dev);
+    return ret;
+}